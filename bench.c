@@ -0,0 +1,353 @@
+// Microbenchmarks for the allocator, directory and read primitives of mfs.c. The file system is
+// compiled in directly so the benchmarks call the same functions the shell does.
+//
+//   make bench            build and run everything
+//   ./mfs_bench [filter]  run only the benchmarks whose name contains filter
+#define main mfs_main
+#include "mfs.c"
+#undef main
+
+#include <math.h>
+
+#define REPEATS 15
+
+FILE * report;
+
+// Layouts the block, inode and inode-block benchmarks run against. Full layouts keep exactly one
+// slot free: at a random place, or as the last slot so a scan from the front sees every other.
+enum layout { EMPTY, HALF_RANDOM, HALF_ADVERSARIAL, FULL_RANDOM, FULL_ADVERSARIAL, LAYOUTS };
+
+const char * layout_names[LAYOUTS] = { "empty", "half/random", "half/adversarial",
+                                       "full/random", "full/adversarial" };
+
+uint64_t nowNs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+int compareDouble(const void * a, const void * b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Run op ops times per repetition and report the spread of ns/op over REPEATS repetitions
+void measure(const char * name, const char * layout, uint32_t ops,
+             void (*op)(uint32_t, void *), void * arg)
+{
+    double ns[REPEATS];
+    int r;
+
+    // One untimed round warms the caches and the branch predictors
+    op(ops, arg);
+    for(r = 0; r < REPEATS; r++)
+    {
+        uint64_t start = nowNs();
+        op(ops, arg);
+        ns[r] = (double) (nowNs() - start) / ops;
+    }
+
+    qsort(ns, REPEATS, sizeof(double), compareDouble);
+    double mean = 0;
+    for(r = 0; r < REPEATS; r++)
+    {
+        mean += ns[r] / REPEATS;
+    }
+    double var = 0;
+    for(r = 0; r < REPEATS; r++)
+    {
+        var += (ns[r] - mean) * (ns[r] - mean) / (REPEATS - 1);
+    }
+
+    fprintf(report, "%-20s %-18s %12.1f %12.1f %12.1f %10.1f\n", name, layout, ns[0],
+            ns[REPEATS / 2], mean, sqrt(var));
+    fflush(report);
+}
+
+// Mark count of the slots [first, last) in use: chosen at random, or the lowest ones
+void fillSlots(uint8_t * free_map, int32_t first, int32_t last, int32_t count, int random)
+{
+    int32_t slots = last - first;
+    int32_t i;
+    for(i = first; i < last; i++)
+    {
+        free_map[i] = 1;
+    }
+
+    if(!random)
+    {
+        for(i = first; i < first + count; i++)
+        {
+            free_map[i] = 0;
+        }
+        return;
+    }
+
+    // A partial Fisher-Yates shuffle picks count distinct slots
+    int32_t * order = malloc(slots * sizeof(int32_t));
+    for(i = 0; i < slots; i++)
+    {
+        order[i] = first + i;
+    }
+    for(i = 0; i < count; i++)
+    {
+        int32_t j = i + rand() % (slots - i);
+        int32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+        free_map[order[i]] = 0;
+    }
+    free(order);
+}
+
+int32_t layoutCount(enum layout layout, int32_t slots)
+{
+    switch(layout)
+    {
+        case EMPTY:            return 0;
+        case HALF_RANDOM:
+        case HALF_ADVERSARIAL: return slots / 2;
+        default:               return slots - 1;
+    }
+}
+
+int layoutRandom(enum layout layout)
+{
+    return layout == HALF_RANDOM || layout == FULL_RANDOM;
+}
+
+void setBlockLayout(enum layout layout)
+{
+    initImage();
+    int32_t slots = superblock->meta_top - FIRST_DATA_BLOCK;
+    fillSlots(free_blocks, FIRST_DATA_BLOCK, superblock->meta_top, layoutCount(layout, slots),
+              layoutRandom(layout));
+
+    int32_t block;
+    for(block = FIRST_DATA_BLOCK; block < superblock->meta_top; block++)
+    {
+        block_refs[block] = !free_blocks[block];
+    }
+}
+
+void opFindFreeBlock(uint32_t ops, void * arg)
+{
+    uint32_t i;
+    for(i = 0; i < ops; i++)
+    {
+        int32_t block = findFreeBlock();
+        releaseBlock(block);
+    }
+}
+
+void opDf(uint32_t ops, void * arg)
+{
+    volatile uint32_t sink = 0;
+    uint32_t i;
+    for(i = 0; i < ops; i++)
+    {
+        sink += df();
+    }
+}
+
+void opFindFreeInode(uint32_t ops, void * arg)
+{
+    uint32_t i;
+    for(i = 0; i < ops; i++)
+    {
+        int32_t inode = findFreeInode();
+        setInodeFree(inode, 1);
+    }
+}
+
+void opFindFreeInodeBlock(uint32_t ops, void * arg)
+{
+    uint32_t i;
+    for(i = 0; i < ops; i++)
+    {
+        int32_t index = findFreeInodeBlock(0);
+        inodes[0].blocks[index] = -1;
+    }
+}
+
+struct lookups
+{
+    char   (*names)[MAX_FILENAME];
+    int32_t count;
+};
+
+void opFindFile(uint32_t ops, void * arg)
+{
+    struct lookups * lookups = arg;
+    volatile int32_t sink = 0;
+    uint32_t i;
+    for(i = 0; i < ops; i++)
+    {
+        sink += findFile(lookups->names[i % lookups->count]);
+    }
+}
+
+void opReadBytes(uint32_t ops, void * arg)
+{
+    read_bytes("bench.dat", 0, ops);
+}
+
+void benchBlocks()
+{
+    enum layout layout;
+    for(layout = EMPTY; layout < LAYOUTS; layout++)
+    {
+        setBlockLayout(layout);
+        measure("findFreeBlock", layout_names[layout], 200, opFindFreeBlock, NULL);
+        measure("df", layout_names[layout], 200, opDf, NULL);
+    }
+}
+
+void benchInodes()
+{
+    enum layout layout;
+    for(layout = EMPTY; layout < LAYOUTS; layout++)
+    {
+        initImage();
+        fillSlots(free_inodes, 0, NUM_FILES, layoutCount(layout, NUM_FILES),
+                  layoutRandom(layout));
+        measure("findFreeInode", layout_names[layout], 100000, opFindFreeInode, NULL);
+    }
+
+    for(layout = EMPTY; layout < LAYOUTS; layout++)
+    {
+        // findFreeInodeBlock looks for a -1 in the block list of inode 0
+        uint8_t used[BLOCKS_PER_FILE];
+        initImage();
+        fillSlots(used, 0, BLOCKS_PER_FILE, layoutCount(layout, BLOCKS_PER_FILE),
+                  layoutRandom(layout));
+        int32_t i;
+        for(i = 0; i < BLOCKS_PER_FILE; i++)
+        {
+            inodes[0].blocks[i] = used[i] ? -1 : FIRST_DATA_BLOCK + i;
+        }
+        measure("findFreeInodeBlock", layout_names[layout], 100000, opFindFreeInodeBlock, NULL);
+    }
+}
+
+// Directory lookups with the fixed table half and fully used, and grown into extension chunks
+void benchLookups()
+{
+    static const int32_t sizes[] = { 0, NUM_FILES / 2, NUM_FILES, 16 * NUM_FILES };
+    int null_fd = open("/dev/null", O_RDONLY);
+    unsigned s;
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        initImage();
+        int32_t files = sizes[s];
+        struct lookups hits = { malloc((files + 1) * MAX_FILENAME), files };
+        struct lookups misses = { malloc(1024 * MAX_FILENAME), 1024 };
+        int32_t i;
+        for(i = 0; i < files; i++)
+        {
+            snprintf(hits.names[i], MAX_FILENAME, "file%06d.txt", i);
+            insertfd(null_fd, hits.names[i], 0);
+        }
+
+        // Shuffle so hits do not walk the directory in order
+        for(i = files - 1; i > 0; i--)
+        {
+            char t[MAX_FILENAME];
+            int32_t j = rand() % (i + 1);
+            memcpy(t, hits.names[i], MAX_FILENAME);
+            memcpy(hits.names[i], hits.names[j], MAX_FILENAME);
+            memcpy(hits.names[j], t, MAX_FILENAME);
+        }
+
+        // Misses share the long prefix of the real names
+        for(i = 0; i < misses.count; i++)
+        {
+            snprintf(misses.names[i], MAX_FILENAME, "file%06d.tx_", i);
+        }
+
+        char layout[32];
+        snprintf(layout, sizeof(layout), "%d files", files);
+        if(files)
+        {
+            measure("findFile hit", layout, 100000, opFindFile, &hits);
+        }
+        measure("findFile miss", layout, 100000, opFindFile, &misses);
+        free(hits.names);
+        free(misses.names);
+    }
+    close(null_fd);
+}
+
+// read_bytes on a 1 MB file stored contiguously and scattered over a half-full image. Its
+// output goes to /dev/null so the figure is the per-byte loop and printf, not the terminal.
+void benchReadBytes()
+{
+    int random;
+    for(random = 0; random < 2; random++)
+    {
+        setBlockLayout(random ? HALF_RANDOM : EMPTY);
+
+        FILE * tmp = tmpfile();
+        int32_t i;
+        for(i = 0; i < MAX_FILE_SIZE; i++)
+        {
+            fputc(rand() & 0xff, tmp);
+        }
+        fflush(tmp);
+        rewind(tmp);
+        insertfd(fileno(tmp), "bench.dat", MAX_FILE_SIZE);
+        fclose(tmp);
+
+        measure("read_bytes", random ? "scattered" : "contiguous", 65536, opReadBytes, NULL);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    const char * filter = argc > 1 ? argv[1] : "";
+    static const struct
+    {
+        const char * name;
+        void (*run)();
+    } benches[] = {
+        { "findFreeBlock df", benchBlocks },
+        { "findFreeInode findFreeInodeBlock", benchInodes },
+        { "findFile", benchLookups },
+        { "read_bytes", benchReadBytes },
+    };
+
+    // The file system prints to stdout, so the report keeps its own copy of it
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if(report == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        fprintf(stderr, "mfs_bench: can not redirect stdout\n");
+        return 1;
+    }
+
+    srand(1);
+    init();
+    if(imageAlloc(0) == -1)
+    {
+        fprintf(stderr, "mfs_bench: can not map an image\n");
+        return 1;
+    }
+
+    fprintf(report, "%d repetitions, ns/op\n", REPEATS);
+    fprintf(report, "%-20s %-18s %12s %12s %12s %10s\n", "benchmark", "layout", "min",
+            "median", "mean", "stddev");
+
+    unsigned i;
+    for(i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if(strstr(benches[i].name, filter) != NULL)
+        {
+            benches[i].run();
+        }
+    }
+
+    fclose(report);
+    return 0;
+}
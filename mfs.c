@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -6,22 +7,45 @@
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <ftw.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 #define BLOCK_SIZE 1024
 #define NUM_BLOCKS 65536
 #define BLOCKS_PER_FILE 1024
 #define NUM_FILES 256
-#define FIRST_DATA_BLOCK 1001
+#define SUPERBLOCK 18
+#define FREE_INODE_BLOCK 19
+#define FIRST_INODE_BLOCK 20
+#define FREE_BLOCK_MAP 1046
+#define FIRST_DATA_BLOCK 1110
 #define MAX_FILE_SIZE 1048576
+#define MAX_FILENAME 64
 #define HIDDEN 0x00000001
 #define HIDDEN_MASK 0xFE
 #define READ_ONLY 0x2
 #define READ_MASK 0xFD
 
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
+// Blocks of the current image, NULL when no image is open. Each open image has its own
+// buffer, mapped when it is opened or created and unmapped when it is closed.
+uint8_t (*data)[BLOCK_SIZE];
 
-// 512 blocks just for free block map
+// 64 blocks just for free block map, one byte per block of the image
 uint8_t * free_blocks;
 uint8_t * free_inodes;
 
@@ -36,20 +60,144 @@ struct directoryEntry
 struct directoryEntry* directory;
 
 // inode
-struct inode
+struct inodeInfo
 {
-    int32_t  blocks[BLOCKS_PER_FILE];
     short    in_use;
     uint8_t  attribute;
+    uint8_t  tail;          // where the last partial block is kept, see TAIL_INLINE
     uint32_t file_size;
 };
 
+struct inode
+{
+    int32_t          blocks[BLOCKS_PER_FILE];
+    struct inodeInfo info;
+};
+
 struct inode* inodes;
 
+// Number of data blocks a file of size bytes occupies
+#define BLOCKS_FOR(size) (((size) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// Files past the first NUM_FILES live in extension chunks, blocks taken from just below the
+// tables at the top of the data region. Each chunk holds EXT_PER_BLOCK records that pair a
+// directory entry with an inode of the same number. An extension inode keeps its first
+// EXT_DIRECT block numbers itself and the rest in up to EXT_MAPS map blocks.
+#define EXT_DIRECT 8
+#define EXT_MAPS 4
+#define MAP_ENTRIES (BLOCK_SIZE / sizeof(int32_t))
+#define MAPS_FOR(count) ((count) > EXT_DIRECT ? \
+                         ((count) - EXT_DIRECT + MAP_ENTRIES - 1) / MAP_ENTRIES : 0)
+
+struct extFile
+{
+    struct directoryEntry entry;
+    struct inodeInfo      info;
+    int32_t               direct[EXT_DIRECT];
+    int32_t               maps[EXT_MAPS];      // 0 when the map block is not allocated
+};
+
+#define EXT_PER_BLOCK (BLOCK_SIZE / sizeof(struct extFile))
+
+// Directory entries and inodes in use: NUM_FILES plus EXT_PER_BLOCK per extension chunk
+int32_t num_files = NUM_FILES;
+
+// Small files do not give their last partial block a block of its own. inodeInfo.tail is 0 when
+// every block of the file is its own, TAIL_INLINE when the whole file is kept in the inode in
+// place of its block numbers, and otherwise 1 + the TAIL_SLOT-byte slot where the last block's
+// bytes start in a tail block packed with the tails of other files. Neither layout is changed
+// in place: a write first moves the file back to blocks of its own.
+#define TAIL_SLOT   16
+#define TAIL_SLOTS  (BLOCK_SIZE / TAIL_SLOT)
+#define TAIL_MAX    (BLOCK_SIZE / 2)    // longer tails keep a block of their own
+#define TAIL_INLINE 0xff
+#define EXT_INLINE  (sizeof(int32_t) * (EXT_DIRECT + EXT_MAPS))
+
+_Static_assert(sizeof(struct inode) == 4104, "inode layout changed");
+_Static_assert(offsetof(struct extFile, maps) == offsetof(struct extFile, direct) +
+               sizeof(int32_t) * EXT_DIRECT, "inline bytes of an extension inode are split");
+_Static_assert(EXT_DIRECT + EXT_MAPS * MAP_ENTRIES >= BLOCKS_PER_FILE,
+               "extension inodes can not map a whole file");
+
+// Block 18, after the directory, describes the tables kept at the end of the image. Blocks
+// from meta_top to the end of the image are metadata and never hold file data.
+#define MFS_MAGIC 0x3153464d    // "MFS1"
+#define MFS_VERSION 1
+#define CRC_BLOCKS (NUM_BLOCKS * sizeof(uint32_t) / BLOCK_SIZE)
+#define REF_BLOCKS (NUM_BLOCKS * sizeof(uint16_t) / BLOCK_SIZE)
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_NAME 32
+
+// A snapshot's directory and inodes are frozen in a chain of data blocks starting at
+// first_block; the data blocks they name are shared with the live files by reference count.
+struct snapshotEntry
+{
+    char     name[SNAPSHOT_NAME];
+    int64_t  created;
+    int32_t  first_block;   // 0 for an unused slot
+    uint32_t files;
+};
+
+struct superblock
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t  meta_top;
+    int32_t  crc_table;     // first block of the per-block CRC32C table, 0 if there is none
+    int32_t  ref_table;     // first block of the per-block reference counts, 0 if there is none
+    int32_t  reserved;
+    struct snapshotEntry snapshots[MAX_SNAPSHOTS];
+    int32_t  ext_base;      // extension chunk k is block ext_base - 1 - k
+    uint32_t ext_chunks;
+    uint64_t generation;    // bumped by every change made in shared mode
+};
+
+struct superblock* superblock;
+
+_Static_assert(sizeof(struct superblock) <= BLOCK_SIZE, "superblock does not fit in a block");
+
+// CRC32C of every data block, updated whenever a block is written, or NULL
+uint32_t* block_crc;
+
+// Number of live files and snapshots referring to each data block, or NULL. A data block is
+// free exactly when its count is zero.
+uint16_t* block_refs;
+
+_Static_assert(NUM_FILES * sizeof(struct directoryEntry) <= SUPERBLOCK * BLOCK_SIZE,
+               "directory overlaps the superblock");
+// The inode table runs to block 1045, so the free block map and the data region have to
+// start after it rather than overlapping the last inodes.
+_Static_assert(FIRST_INODE_BLOCK * BLOCK_SIZE + NUM_FILES * sizeof(struct inode)
+               <= FREE_BLOCK_MAP * BLOCK_SIZE, "inode table overlaps the free block map");
+_Static_assert(FREE_BLOCK_MAP * BLOCK_SIZE + NUM_BLOCKS <= FIRST_DATA_BLOCK * BLOCK_SIZE,
+               "free block map overlaps the data region");
+
+// Status codes shared by the shell commands and the server protocol
+#define MFS_OK              0
+#define MFS_ERR_NOT_FOUND  -1
+#define MFS_ERR_EXISTS     -2
+#define MFS_ERR_NAME       -3
+#define MFS_ERR_TOO_LARGE  -4
+#define MFS_ERR_NO_SPACE   -5
+#define MFS_ERR_NO_ENTRY   -6
+#define MFS_ERR_NO_INODE   -7
+#define MFS_ERR_IO         -8
+#define MFS_ERR_READ_ONLY  -9
+#define MFS_ERR_RANGE      -10
+#define MFS_ERR_BAD_REQUEST -11
+#define MFS_ERR_CORRUPT    -12
+
 FILE    *fp;
-char    image_name[64];
+char    image_name[PATH_MAX];
 uint8_t image_open;
 
+// Where "-" sends data: standard output, or a copy of it in one-shot mode, where standard
+// output itself is pointed at standard error so messages can not mix with the data
+int     stdout_fd = STDOUT_FILENO;
+
+// Status of the last command that reports one; it becomes the one-shot exit status
+int32_t last_status;
+
 
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
@@ -59,756 +207,9716 @@ uint8_t image_open;
 
 #define MAX_COMMAND_SIZE 255    // The maximum command-line size
 
-#define MAX_NUM_ARGUMENTS 5     // Mav shell only supports four arguments
+#define MAX_NUM_ARGUMENTS 16    // The command and up to 15 arguments, for grep and sum
 
-int32_t findFreeBlock()
+const char * mfs_strerror(int32_t status)
 {
-    int i;
-    for(i = 0; i < NUM_BLOCKS; i++)
+    switch(status)
     {
-        if(free_blocks[i])
-        {
-            free_blocks[i] = 0;
-            return i + 1001;
-        }
+        case MFS_OK:              return "Success";
+        case MFS_ERR_NOT_FOUND:   return "File not found";
+        case MFS_ERR_EXISTS:      return "File already exists";
+        case MFS_ERR_NAME:        return "File name too long";
+        case MFS_ERR_TOO_LARGE:   return "File is too large";
+        case MFS_ERR_NO_SPACE:    return "Not enough free disk space";
+        case MFS_ERR_NO_ENTRY:    return "Could not find a free directory entry";
+        case MFS_ERR_NO_INODE:    return "Can not find a free inode";
+        case MFS_ERR_IO:          return "An error occurred reading or writing a host file";
+        case MFS_ERR_READ_ONLY:   return "File is read-only";
+        case MFS_ERR_RANGE:       return "Request exceeds file size";
+        case MFS_ERR_BAD_REQUEST: return "Malformed request";
+        case MFS_ERR_CORRUPT:     return "Block checksum mismatch, the file is damaged";
     }
-
-    return -1;
+    return "Unknown error";
 }
 
-int32_t findFreeInode()
+// CRC32C (Castagnoli). The SSE4.2 crc32 instruction does 8 bytes per step; machines without
+// it use slicing-by-8 tables.
+uint32_t crc32c_table[8][256];
+int      crc32c_hw;
+
+void crc32cInit()
 {
-    int i;
-    for(i = 0; i < NUM_FILES; i++)
+    uint32_t i;
+    for(i = 0; i < 256; i++)
     {
-        if(free_inodes[i])
+        uint32_t crc = i;
+        int k;
+        for(k = 0; k < 8; k++)
         {
-            free_inodes[i] = 0;
-            return i;
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
         }
+        crc32c_table[0][i] = crc;
     }
 
-    return -1;
-}
-
-int32_t findFreeInodeBlock(int32_t inode)
-{
-    int i;
-    for(i = 0; i < BLOCKS_PER_FILE; i++)
+    for(i = 0; i < 256; i++)
     {
-        if(inodes[inode].blocks[i] == -1)
+        int k;
+        for(k = 1; k < 8; k++)
         {
-            inodes[inode].blocks[i] = 0;
-            return i;
+            uint32_t prev = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
         }
     }
 
-    return -1;
+#if defined(__x86_64__) || defined(__i386__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
 }
 
-
-void init()
+uint32_t crc32cSoft(uint32_t crc, const uint8_t * p, size_t len)
 {
-    directory   = (struct directoryEntry*) &data[0][0];
-    inodes      = (struct inode*) &data[20][0];
-    free_blocks = (uint8_t*) &data[1000][0];
-    free_inodes = (uint8_t*) &data[19][0];
-
-    memset(image_name, 0, 64);
-    image_open = 0;
-
-    int i;
-    for(i = 0; i < NUM_FILES; i++)
+    while(len >= 8)
     {
-        directory[i].in_use = 0;
-        directory[i].inode  = -1;
-        free_inodes[i]      = 1;
-
-        memset(directory[i].filename, 0, 64);
-
-        int j;
-        for(j = 0; j < NUM_BLOCKS; j++)
-        {
-            inodes[i].blocks[j] = -1;
-            inodes[i].in_use = 0; 
-            inodes[i].attribute = 0x0;
-            inodes[i].file_size = 0;
-        }
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
     }
 
-    int j;
-    for(j = 0; j < NUM_BLOCKS; j++)
+    while(len--)
     {
-        free_blocks[j] = 1;
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
     }
+    return crc;
 }
 
-uint32_t df()
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cHard(uint32_t crc, const uint8_t * p, size_t len)
 {
-    int j;
-    int count = 0;
-    for(j = 0; j < NUM_BLOCKS; j++)
+    uint64_t crc64 = crc;
+    while(len >= 8)
     {
-        if(free_blocks[j])
-        {
-            count++;
-        }
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
     }
 
-    return count * BLOCK_SIZE;
+    crc = crc64;
+    while(len--)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
 }
+#endif
 
-void createfs(char * filename)
+// Continue a CRC32C over more data; crc is the raw register, not the inverted result
+uint32_t crc32cUpdate(uint32_t crc, const uint8_t * p, size_t len)
 {
-    fp = fopen(filename, "w");
-
-    strncpy(image_name, filename, strlen(filename));
+#if defined(__x86_64__)
+    if(crc32c_hw)
+    {
+        return crc32cHard(crc, p, len);
+    }
+#endif
+    return crc32cSoft(crc, p, len);
+}
 
-    memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
+uint32_t crc32c(const uint8_t * p, size_t len)
+{
+    return ~crc32cUpdate(~0U, p, len);
+}
 
-    image_open = 1;
+// Record the checksum of a data block that has just been written
+void sealBlock(int32_t block, const uint8_t * p)
+{
+    if(block_crc != NULL && block >= FIRST_DATA_BLOCK && block < superblock->meta_top)
+    {
+        block_crc[block] = crc32c(p, BLOCK_SIZE);
+    }
+}
 
-    int i;
-    for(i = 0; i < NUM_FILES; i++)
+// Check a data block against its recorded checksum before its contents are handed out
+int32_t verifyBlock(int32_t block, const uint8_t * p)
+{
+    if(block_crc != NULL && block >= FIRST_DATA_BLOCK && block < superblock->meta_top &&
+       crc32c(p, BLOCK_SIZE) != block_crc[block])
     {
-        directory[i].in_use = 0;
-        directory[i].inode  = -1;
-        free_inodes[i]      = 1;
+        return MFS_ERR_CORRUPT;
+    }
+    return MFS_OK;
+}
 
-        memset(directory[i].filename, 0, 64);
+// Block cache for images opened with "open -c <blocks>". Only the metadata blocks in front of
+// FIRST_DATA_BLOCK and the tables from meta_top on are read into data[] and stay there; data
+// blocks are fetched on demand
+// with pread into a fixed number of slots and evicted least recently used first. The rest of
+// data[] is never touched, so memory use follows the cache size rather than the image size.
+//
+// A dirty block is not written back into the image before savefs: the saved image may still
+// use a block that has been freed and reused since, and closing without savefs has to leave
+// the image as it was saved. Evicted dirty blocks go to an unlinked scratch file instead, and
+// are read back from there, until savefs copies them into the image.
+#define CACHE_MIN_BLOCKS 16
+#define CACHE_READAHEAD  32
+
+struct cacheSlot
+{
+    int32_t  block;
+    int32_t  prev;      // LRU list, most recently used at cache_head
+    int32_t  next;
+    uint16_t pins;
+    uint8_t  dirty;
+};
 
-        int j;
-        for(j = 0; j < NUM_BLOCKS; j++)
-        {
-            inodes[i].blocks[j] = -1;
-            inodes[i].in_use = 0; 
-            inodes[i].attribute = 0x0;
-            inodes[i].file_size = 0;
-        }
+uint8_t            cache_mode;
+int                image_fd = -1;
+struct cacheSlot * cache_slots;
+uint8_t          * cache_data;
+int32_t          * cache_index;     // slot holding each block of the image, or -1
+int32_t            cache_size;
+int32_t            cache_head;
+int32_t            cache_tail;
+int32_t            cache_last_block;
+uint64_t           cache_hits;
+uint64_t           cache_misses;
+uint64_t           cache_readahead;
+uint64_t           cache_writebacks;
+int                spill_fd = -1;   // scratch file, created on the first eviction of a dirty block
+int32_t          * spill_index;     // slot in the scratch file of each block of the image, or -1
+int32_t            spill_count;
+
+void cacheUnlink(int32_t slot)
+{
+    struct cacheSlot * c = &cache_slots[slot];
+    if(c->prev != -1)
+    {
+        cache_slots[c->prev].next = c->next;
     }
-
-    int j;
-    for(j = 0; j < NUM_BLOCKS; j++)
+    else
     {
-        free_blocks[j] = 1;
+        cache_head = c->next;
+    }
+    if(c->next != -1)
+    {
+        cache_slots[c->next].prev = c->prev;
+    }
+    else
+    {
+        cache_tail = c->prev;
     }
-
-    fclose(fp);
 }
 
-void savefs()
+void cachePushFront(int32_t slot)
 {
-    if(image_open == 0)
+    cache_slots[slot].prev = -1;
+    cache_slots[slot].next = cache_head;
+    if(cache_head != -1)
     {
-        printf("ERROR: Disk image is not open\n");
+        cache_slots[cache_head].prev = slot;
+    }
+    cache_head = slot;
+    if(cache_tail == -1)
+    {
+        cache_tail = slot;
     }
-
-    // fp = fopen(image_name, "w");
-    FILE* fp2 = fopen(image_name, "w");
-
-    fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp2);
-
-    memset(image_name, 0, 64);
-
-    fclose(fp2);
 }
 
-void openfs(char * filename)
+// Read block as it stands since the last savefs, from the scratch file if it was spilled
+int cacheRead(int32_t block, uint8_t * buf)
 {
-    fp = fopen(filename, "r");
+    int spilled = spill_index[block] != -1;
+    off_t offset = (off_t) (spilled ? spill_index[block] : block) * BLOCK_SIZE;
+    return pread(spilled ? spill_fd : image_fd, buf, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+}
 
-    if(fp == NULL)
+// Open an unlinked scratch file next to the image, on a filesystem that has room for the image,
+// and failing that in TMPDIR or /tmp. /tmp is often a tmpfs, where spilling would bring the
+// memory cache mode saves back. Returns -1 if none of them takes it.
+int cacheSpillOpen()
+{
+    char dir[PATH_MAX];
+    strcpy(dir, image_name);
+    char * slash = strrchr(dir, '/');
+    if(slash == NULL)
     {
-        printf("ERROR. File not found\n");
+        strcpy(dir, ".");
+    }
+    else
+    {
+        // Keep the slash of an image in /
+        *(slash == dir ? slash + 1 : slash) = '\0';
     }
 
-    strncpy(image_name, filename, strlen(filename));
-
-    fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+    const char * tmpdir = getenv("TMPDIR");
+    const char * dirs[] = { dir, tmpdir != NULL && *tmpdir ? tmpdir : "/tmp", "/tmp" };
+    int i;
+    for(i = 0; i < 3; i++)
+    {
+        int fd = open(dirs[i], O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if(fd != -1)
+        {
+            return fd;
+        }
 
-    image_open = 1;
+        // Not every filesystem has O_TMPFILE
+        char path[PATH_MAX];
+        size_t len = strlen(dirs[i]);
+        if(len + sizeof("/.mfs-cacheXXXXXX") > sizeof(path))
+        {
+            continue;
+        }
+        memcpy(path, dirs[i], len);
+        memcpy(path + len, "/.mfs-cacheXXXXXX", sizeof("/.mfs-cacheXXXXXX"));
+        fd = mkostemp(path, O_CLOEXEC);
+        if(fd != -1)
+        {
+            unlink(path);
+            return fd;
+        }
+    }
+    return -1;
 }
 
-void closefs()
+// Move a dirty slot to the scratch file. Returns -1, leaving it dirty, if it can not be written.
+int cacheWriteBack(int32_t slot)
 {
-    if(image_open == 0)
+    struct cacheSlot * c = &cache_slots[slot];
+    if(!c->dirty)
     {
-        printf("ERROR: Disk image is not open\n");
-        return;
+        return 0;
     }
 
-    fclose(fp);
+    if(spill_fd == -1)
+    {
+        spill_fd = cacheSpillOpen();
+    }
 
-    image_open = 0;
-    memset(image_name, 0, 64);
+    int32_t spill = spill_index[c->block] != -1 ? spill_index[c->block] : spill_count;
+    if(spill_fd == -1 || pwrite(spill_fd, &cache_data[(size_t) slot * BLOCK_SIZE], BLOCK_SIZE,
+                                (off_t) spill * BLOCK_SIZE) != BLOCK_SIZE)
+    {
+        printf("ERROR: Can not write block %d to the scratch file of %s\n", c->block,
+               image_name);
+        return -1;
+    }
+    if(spill == spill_count)
+    {
+        spill_index[c->block] = spill_count++;
+    }
+    c->dirty = 0;
+    cache_writebacks++;
+    return 0;
 }
 
-void list(char* attrib)
+// Free the least recently used unpinned slot and move it to the front of the list. Returns -1
+// when every slot is pinned or the slot's dirty block can not be put aside.
+int32_t cacheEvict()
 {
-    int i;
-    int not_found = 1;
-    int list_hidden = 0;
-    int list_attributes = 0;
-
-    if(attrib == NULL)
+    int32_t slot = cache_tail;
+    while(slot != -1 && cache_slots[slot].pins)
     {
-        // do nothing
+        slot = cache_slots[slot].prev;
     }
-    else if(!strcmp(attrib, "-h"))
+
+    if(slot == -1)
     {
-        list_hidden = 1;
+        printf("ERROR: Every block cache slot is in use\n");
+        return -1;
     }
-    else if(!strcmp(attrib, "-a"))
+
+    if(cacheWriteBack(slot) == -1)
     {
-        list_attributes = 1;
+        return -1;
     }
-    else
+    if(cache_slots[slot].block != -1)
     {
-        printf("ERROR: Incorrect parameter %s.\n", attrib);
-        return;
+        cache_index[cache_slots[slot].block] = -1;
     }
-    
+    cache_slots[slot].block = -1;
 
-    for(i = 0; i < NUM_FILES; i++)
-    {
-        //\TODO Add a checm to not list if the file is hidden
-        if(directory[i].in_use)
-        {
-            not_found = 0;
-            char filename[65];
-            uint32_t inode_index = directory[i].inode;
+    cacheUnlink(slot);
+    cachePushFront(slot);
+    return slot;
+}
 
-            memset(filename, 0, 65);
-            strncpy(filename, directory[i].filename, strlen(directory[i].filename));
- /*
-                +h +r 1
-                +h 1
-                +r 1
-                nothing: 0
-            
-            */
+// Bring block into the cache, reading it from the image when load is set. A miss that
+// continues a sequential scan also reads the blocks after it with a single preadv. Returns
+// the slot, or -1 if no slot can be freed.
+int32_t cacheLookup(int32_t block, int load)
+{
+    int32_t slot = cache_index[block];
+    int sequential = block == cache_last_block + 1;
+    cache_last_block = block;
 
+    if(slot != -1)
+    {
+        cache_hits++;
+        cacheUnlink(slot);
+        cachePushFront(slot);
+        return slot;
+    }
 
-            if(((inodes[inode_index].attribute & HIDDEN) != 1) && (list_attributes))
-            {
-                printf("%s\tAttribute: ", filename);
-                        
-                for (int i = 7; i >= 0; i--) {
-                    uint8_t mask = 1 << i;
-                    uint8_t bit = (inodes[inode_index].attribute & mask) >> i;
-                    printf("%d", bit);
-                }
+    cache_misses++;
 
-                printf("\n");
-            
+    int32_t count = 1;
+    if(load && sequential)
+    {
+        while(count < CACHE_READAHEAD && count < cache_size / 2 && block + count < NUM_BLOCKS &&
+              cache_index[block + count] == -1)
+        {
+            count++;
+        }
+    }
 
-            }
-            else if((inodes[inode_index].attribute & HIDDEN) != 1)
+    // Claim slots from the back of the run so block itself ends up most recently used
+    struct iovec iov[CACHE_READAHEAD];
+    int32_t i;
+    for(i = count - 1; i >= 0; i--)
+    {
+        slot = cacheEvict();
+        if(slot == -1)
+        {
+            // Give back the slots claimed so far; they hold nothing yet
+            for(i++; i < count; i++)
             {
-                printf("%s\n", filename);
-
+                cache_slots[cache_index[block + i]].block = -1;
+                cache_index[block + i] = -1;
             }
-            else if(list_hidden)
+            return -1;
+        }
+        cache_slots[slot].block = block + i;
+        cache_index[block + i] = slot;
+        iov[i].iov_base = &cache_data[(size_t) slot * BLOCK_SIZE];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    if(load)
+    {
+        if(preadv(image_fd, iov, count, (off_t) block * BLOCK_SIZE) != count * BLOCK_SIZE)
+        {
+            printf("ERROR: Can not read block %d from %s\n", block, image_name);
+            last_status = MFS_ERR_IO;
+        }
+        for(i = 0; i < count; i++)
+        {
+            if(spill_index[block + i] != -1 && cacheRead(block + i, iov[i].iov_base) == -1)
             {
-                printf("%s\n", filename);
+                printf("ERROR: Can not read block %d from the scratch file of %s\n",
+                       block + i, image_name);
+                last_status = MFS_ERR_IO;
             }
-
         }
+        cache_readahead += count - 1;
+    }
+
+    return slot;
+}
+
+// Map blocks of extension inodes are metadata held in data[] too, though they come from the
+// data region. One byte per block, allocated with data[].
+uint8_t * block_pinned;
 
+// Return a pointer to the contents of block. The block stays in memory until the matching
+// putBlock(). newBlock() is for blocks about to be overwritten and skips reading them. Both
+// return NULL only with a block cache, when no cache slot can be freed for the block.
+// Metadata blocks always live in data[], even when a block cache is in use
+int isPinned(int32_t block)
+{
+    return block < FIRST_DATA_BLOCK || block >= superblock->meta_top || block_pinned[block];
+}
+
+uint8_t * getBlock(int32_t block)
+{
+    if(!cache_mode || isPinned(block))
+    {
+        return data[block];
     }
 
-    if(not_found)
+    int32_t slot = cacheLookup(block, 1);
+    if(slot == -1)
     {
-        printf("ERROR: No files found.\n");
+        return NULL;
     }
+    cache_slots[slot].pins++;
+    return &cache_data[(size_t) slot * BLOCK_SIZE];
 }
 
-void insert(char * filename)
+uint8_t * newBlock(int32_t block)
 {
-    // verify the filename isn't NULL
-    if(filename == NULL)
+    if(!cache_mode || isPinned(block))
     {
-        printf("ERROR: Filename is NULL\n");
-        return;
+        return data[block];
     }
 
-    // verify the file exists
-    struct stat buf;
-    int ret = stat(filename, &buf);
-
-    if(ret == -1)
+    int32_t slot = cacheLookup(block, 0);
+    if(slot == -1)
     {
-        printf("ERROR: File does not exist.\n");
-        return;
+        return NULL;
     }
+    cache_slots[slot].pins++;
+    return &cache_data[(size_t) slot * BLOCK_SIZE];
+}
 
-    // verify the file is not too big
-    if(buf.st_size > MAX_FILE_SIZE)
+// Release a block returned by getBlock() or newBlock(), marking it dirty if it was changed
+void putBlock(int32_t block, int dirty)
+{
+    if(!cache_mode || isPinned(block))
     {
-        printf("ERROR: File is too large.\n");
+        if(dirty)
+        {
+            sealBlock(block, data[block]);
+        }
         return;
     }
 
-    // verify that there is enough space
-    if(buf.st_size > df())
+    // Nothing to release if getBlock() could not bring the block in
+    int32_t slot = cache_index[block];
+    if(slot == -1)
     {
-        printf("ERROR: Not enough free disk space.\n");
         return;
     }
-    // find an empty directory entry
-    int i;
-    int directory_entry = -1;
-    for(i = 0; i < NUM_FILES; i++)
+    cache_slots[slot].pins--;
+    if(dirty)
     {
-        if(directory[i].in_use == 0)
-        {
-            directory_entry = i;
-            break;
-        }
+        cache_slots[slot].dirty = 1;
+        sealBlock(block, &cache_data[(size_t) slot * BLOCK_SIZE]);
     }
+}
 
-    if(directory_entry == -1)
-    {
-        printf("ERROR: Could not find a free directory entry.\n");
+int cacheOpen(int32_t blocks)
+{
+    cache_size = blocks < CACHE_MIN_BLOCKS ? CACHE_MIN_BLOCKS : blocks;
+    cache_slots = calloc(cache_size, sizeof(struct cacheSlot));
+    cache_data = malloc((size_t) cache_size * BLOCK_SIZE);
+    cache_index = malloc(NUM_BLOCKS * sizeof(int32_t));
+    spill_index = malloc(NUM_BLOCKS * sizeof(int32_t));
+
+    if(cache_slots == NULL || cache_data == NULL || cache_index == NULL || spill_index == NULL)
+    {
+        free(cache_slots);
+        free(cache_data);
+        free(cache_index);
+        free(spill_index);
+        return -1;
     }
 
-    // Open the input file read-only 
-    FILE *ifp = fopen ( filename, "r" ); 
-    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename);
- 
-    // Save off the size of the input file since we'll use it in a couple of places and 
-    // also initialize our index variables to zero. 
-    int32_t copy_size   = buf . st_size;
+    memset(cache_index, 0xff, NUM_BLOCKS * sizeof(int32_t));
+    memset(spill_index, 0xff, NUM_BLOCKS * sizeof(int32_t));
+    spill_fd = -1;
+    spill_count = 0;
 
-    // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-    // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-    // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-    int32_t offset      = 0;               
+    cache_head = -1;
+    cache_tail = -1;
+    int32_t i;
+    for(i = 0; i < cache_size; i++)
+    {
+        cache_slots[i].block = -1;
+        cachePushFront(i);
+    }
 
-    // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-    // memory pool. Why? We are simulating the way the file system stores file data in
-    // blocks of space on the disk. block_index will keep us pointing to the area of
-    // the area that we will read from or write to.
-    int block_index = -1;
+    cache_last_block = -2;
+    cache_hits = cache_misses = cache_readahead = cache_writebacks = 0;
+    cache_mode = 1;
+    return 0;
+}
 
-      // find a free inode
-      int32_t inode_index = findFreeInode();
+// Put every dirty slot aside in the scratch file, so a scan can read each block with
+// cacheRead() from any thread. Returns -1 if a block can not be written.
+int cacheFlush()
+{
+    int ret = 0;
+    int32_t i;
+    for(i = 0; i < cache_size; i++)
+    {
+        if(cacheWriteBack(i) == -1)
+        {
+            ret = -1;
+        }
+    }
+    return ret;
+}
 
-      if(inode_index == -1)
-      {
-        printf("ERROR: Can not find a free inode.\n");
+// For savefs: write every block changed since the last save into the image and empty the
+// scratch file. Returns -1 if a block can not be copied; the scratch file is kept then.
+int cacheSave()
+{
+    if(cacheFlush() == -1)
+    {
+        return -1;
+    }
+
+    int32_t block;
+    for(block = 0; block < NUM_BLOCKS; block++)
+    {
+        uint8_t buf[BLOCK_SIZE];
+        if(spill_index[block] != -1 &&
+           (cacheRead(block, buf) == -1 ||
+            pwrite(image_fd, buf, BLOCK_SIZE, (off_t) block * BLOCK_SIZE) != BLOCK_SIZE))
+        {
+            printf("ERROR: Can not write block %d to %s\n", block, image_name);
+            return -1;
+        }
+    }
+
+    memset(spill_index, 0xff, NUM_BLOCKS * sizeof(int32_t));
+    spill_count = 0;
+    if(spill_fd != -1 && ftruncate(spill_fd, 0) == -1)
+    {
+        close(spill_fd);
+        spill_fd = -1;
+    }
+    return 0;
+}
+
+// Drop the cache and the scratch file without writing anything back, like closing an image
+// that was not saved
+void cacheClose()
+{
+    if(spill_fd != -1)
+    {
+        close(spill_fd);
+    }
+    free(cache_slots);
+    free(cache_data);
+    free(cache_index);
+    free(spill_index);
+    cache_slots = NULL;
+    cache_data = NULL;
+    cache_index = NULL;
+    spill_index = NULL;
+    spill_fd = -1;
+    cache_mode = 0;
+}
+
+void cachestat()
+{
+    if(!cache_mode)
+    {
+        printf("Image is held in memory, no block cache\n");
         return;
-      }    
+    }
 
-      // place the file info in the directory
-      directory[directory_entry].in_use = 1;
-      directory[directory_entry].inode = inode_index;
-      strncpy(directory[directory_entry].filename, filename, strlen(filename));
+    uint64_t lookups = cache_hits + cache_misses;
+    printf("cache: %d blocks, %lu hits, %lu misses (%.1f%% hit), %lu read ahead, "
+           "%lu set aside until savefs\n", cache_size, (unsigned long) cache_hits,
+           (unsigned long) cache_misses, lookups ? 100.0 * cache_hits / lookups : 0.0,
+           (unsigned long) cache_readahead, (unsigned long) cache_writebacks);
+}
 
-      inodes[inode_index].file_size = buf.st_size;
-      inodes[inode_index].in_use = 1;
- 
-    // copy_size is initialized to the size of the input file so each loop iteration we
-    // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-    // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-    // we have copied all the data from the input file.
-    while( copy_size > 0 )
-    {
-      // Index into the input file by offset number of bytes.  Initially offset is set to
-      // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-      // then increase the offset by BLOCK_SIZE and continue the process.  This will
-      // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-      fseek( ifp, offset, SEEK_SET );
- 
-      // Read BLOCK_SIZE number of bytes from the input file and store them in our
-      // data array. 
+// Add a reference to a data block, taking it out of the free map
+void refBlock(int32_t block)
+{
+    free_blocks[block] = 0;
+    if(block_refs != NULL)
+    {
+        block_refs[block]++;
+    }
+}
 
-      // find a free block
+// Tail block that new tails are packed into, or -1, and how many of its slots are taken
+int32_t  tail_block = -1;
+uint32_t tail_used;
 
-      block_index = findFreeBlock();
-      if(block_index == -1)
-      {
-        printf("ERROR: Can not find a free block.\n");
-      }    
+// Drop a reference to a data block; it is free again once nothing refers to it
+void releaseBlock(int32_t block)
+{
+    if(block_refs != NULL && block_refs[block] > 1)
+    {
+        block_refs[block]--;
+        return;
+    }
+
+    if(block_refs != NULL)
+    {
+        block_refs[block] = 0;
+    }
+    free_blocks[block] = 1;
+
+    // Once free the block may be handed to anything, so no more tails go into it
+    if(block == tail_block)
+    {
+        tail_block = -1;
+    }
+}
+
+// A block a snapshot still refers to must be copied before a live file changes it
+int isShared(int32_t block)
+{
+    return block_refs != NULL && block_refs[block] > 1;
+}
+
+int32_t findFreeBlock()
+{
+    int i;
+    for(i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
+    {
+        if(free_blocks[i])
+        {
+            refBlock(i);
+            return i;
+        }
+    }
 
-     
+    return -1;
+}
 
-      int32_t bytes  = fread( data[block_index], BLOCK_SIZE, 1, ifp );
+int32_t findFreeInode()
+{
+    int i;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(free_inodes[i])
+        {
+            free_inodes[i] = 0;
+            return i;
+        }
+    }
 
-      
-      // save the block in the inode
-      int32_t inode_block = findFreeInodeBlock(inode_index);
-      inodes[inode_index].blocks[inode_block] = block_index;
+    return -1;
+}
 
+int32_t findFreeInodeBlock(int32_t inode)
+{
+    int i;
+    for(i = 0; i < BLOCKS_PER_FILE; i++)
+    {
+        if(inodes[inode].blocks[i] == -1)
+        {
+            inodes[inode].blocks[i] = 0;
+            return i;
+        }
+    }
 
-      // If bytes == 0 and we haven't reached the end of the file then something is 
-      // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-      // It means we've reached the end of our input file.
-      if( bytes == 0 && !feof( ifp ) )
-      {
-        printf("ERROR: An error occured reading from the input file.\n");
+    return -1;
+}
+
+// Take count blocks just below meta_top for a new table. Returns its first block, or 0 when
+// files already use any of those blocks.
+int32_t reserveTable(int32_t count)
+{
+    int32_t first = superblock->meta_top - count;
+    int32_t j;
+    for(j = first; j < superblock->meta_top; j++)
+    {
+        if(!free_blocks[j])
+        {
+            return 0;
+        }
+    }
+
+    for(j = first; j < superblock->meta_top; j++)
+    {
+        free_blocks[j] = 0;
+    }
+
+    superblock->meta_top = first;
+    memset(data[first], 0, count * BLOCK_SIZE);
+    return first;
+}
+
+// The data region ends at meta_top, and everything that walks it relies on that value
+int validMetaTop()
+{
+    return superblock->meta_top >= FIRST_DATA_BLOCK && superblock->meta_top <= NUM_BLOCKS;
+}
+
+// A table of count blocks starting at first has to lie between meta_top and the end of the
+// image; 0 stands for no table
+int validTable(int32_t first, int32_t count)
+{
+    return first == 0 || (first >= superblock->meta_top && first <= NUM_BLOCKS - count);
+}
+
+int validDataBlock(int32_t block)
+{
+    return block >= FIRST_DATA_BLOCK && block < superblock->meta_top;
+}
+
+struct extFile * extFile(int32_t file)
+{
+    int32_t n = file - NUM_FILES;
+    return (struct extFile*) data[superblock->ext_base - 1 - n / EXT_PER_BLOCK] +
+           n % EXT_PER_BLOCK;
+}
+
+// Directory entry number entry, from the fixed directory or an extension chunk
+struct directoryEntry * dirEntry(int32_t entry)
+{
+    return entry < NUM_FILES ? &directory[entry] : &extFile(entry)->entry;
+}
+
+// An entry in use that names an inode out of range is damaged: fsck reports it, and
+// everything else passes it by instead of following the number
+int entryLive(int32_t entry)
+{
+    int32_t inode = dirEntry(entry)->inode;
+    return dirEntry(entry)->in_use && inode >= 0 && inode < num_files;
+}
+
+struct inodeInfo * inodeInfo(int32_t inode)
+{
+    return inode < NUM_FILES ? &inodes[inode].info : &extFile(inode)->info;
+}
+
+// The free inode map only covers the fixed inode table; an extension inode is free when it is
+// not in use
+int inodeFree(int32_t inode)
+{
+    return inode < NUM_FILES ? free_inodes[inode] : !inodeInfo(inode)->in_use;
+}
+
+void setInodeFree(int32_t inode, int free)
+{
+    if(inode < NUM_FILES)
+    {
+        free_inodes[inode] = free;
+    }
+}
+
+// Returns the data block holding block number index of inode, or -1
+int32_t fileBlock(int32_t inode, uint32_t index)
+{
+    if(inode < NUM_FILES)
+    {
+        return inodes[inode].blocks[index];
+    }
+
+    struct extFile * file = extFile(inode);
+    if(index < EXT_DIRECT)
+    {
+        return file->direct[index];
+    }
+
+    index -= EXT_DIRECT;
+    int32_t map = file->maps[index / MAP_ENTRIES];
+    if(!validDataBlock(map))
+    {
+        return -1;
+    }
+    return ((int32_t*) data[map])[index % MAP_ENTRIES];
+}
+
+// Pin a block in data[] so the block cache never holds it
+void pinBlock(int32_t block)
+{
+    if(cache_mode && cache_index[block] != -1)
+    {
+        int32_t slot = cache_index[block];
+        cache_slots[slot].block = -1;
+        cache_slots[slot].dirty = 0;
+        cache_index[block] = -1;
+    }
+    block_pinned[block] = 1;
+}
+
+// Point block number index of inode at block, allocating the map block that holds it when
+// needed. Returns MFS_ERR_NO_SPACE when there is no block left for the map.
+int32_t setFileBlock(int32_t inode, uint32_t index, int32_t block)
+{
+    if(inode < NUM_FILES)
+    {
+        inodes[inode].blocks[index] = block;
+        return MFS_OK;
+    }
+
+    struct extFile * file = extFile(inode);
+    if(index < EXT_DIRECT)
+    {
+        file->direct[index] = block;
+        return MFS_OK;
+    }
+
+    index -= EXT_DIRECT;
+    int32_t * map = &file->maps[index / MAP_ENTRIES];
+    if(!validDataBlock(*map))
+    {
+        if(block == -1)
+        {
+            return MFS_OK;
+        }
+
+        int32_t fresh = findFreeBlock();
+        if(fresh == -1)
+        {
+            return MFS_ERR_NO_SPACE;
+        }
+        pinBlock(fresh);
+        memset(data[fresh], 0xff, BLOCK_SIZE);
+        *map = fresh;
+    }
+
+    ((int32_t*) data[*map])[index % MAP_ENTRIES] = block;
+    sealBlock(*map, data[*map]);
+    return MFS_OK;
+}
+
+// Map blocks a file of count blocks needs on top of its data blocks
+uint32_t mapsFor(int32_t inode, uint32_t count)
+{
+    return inode < NUM_FILES ? 0 : MAPS_FOR(count);
+}
+
+// Give back the map blocks of inode from map number first on. They are forgotten too unless
+// keep is set, which lets undel find them again.
+void releaseMaps(int32_t inode, uint32_t first, int keep)
+{
+    if(inode < NUM_FILES || inodeInfo(inode)->tail == TAIL_INLINE)
+    {
         return;
-      }
+    }
 
-      // Clear the EOF file flag.
-      clearerr( ifp );
+    struct extFile * file = extFile(inode);
+    for(; first < EXT_MAPS; first++)
+    {
+        if(validDataBlock(file->maps[first]))
+        {
+            block_pinned[file->maps[first]] = 0;
+            releaseBlock(file->maps[first]);
+            if(!keep)
+            {
+                file->maps[first] = 0;
+            }
+        }
+    }
+}
 
-      // Reduce copy_size by the BLOCK_SIZE bytes.
-      copy_size -= BLOCK_SIZE;
-      
-      // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-      // the fseek at the top of the loop to position us to the correct spot.
-      offset    += BLOCK_SIZE;
+// Point every block number of inode nowhere, forgetting any map blocks it had
+void clearFileBlocks(int32_t inode)
+{
+    if(inode < NUM_FILES)
+    {
+        memset(inodes[inode].blocks, 0xff, sizeof(inodes[inode].blocks));
+        return;
     }
 
-    // We are done copying from the input file so close it out.
-    fclose( ifp );
- 
+    struct extFile * file = extFile(inode);
+    memset(file->direct, 0xff, sizeof(file->direct));
+    memset(file->maps, 0, sizeof(file->maps));
+}
 
+int isInline(int32_t inode)
+{
+    return inodeInfo(inode)->tail == TAIL_INLINE;
 }
 
-void delete(char* filename)
+// Bytes of an inline file, kept where its block numbers would be
+uint8_t * inlineData(int32_t inode)
 {
-    if(filename == NULL)
+    return inode < NUM_FILES ? (uint8_t*) inodes[inode].blocks : (uint8_t*) extFile(inode)->direct;
+}
+
+// Largest file inode can hold inline
+uint32_t inlineMax(int32_t inode)
+{
+    return inode < NUM_FILES ? BLOCK_SIZE : EXT_INLINE;
+}
+
+// Number of block numbers in the block list of inode
+uint32_t blockCount(int32_t inode)
+{
+    return isInline(inode) ? 0 : BLOCKS_FOR(inodeInfo(inode)->file_size);
+}
+
+// Number of blocks that are the file's own, not counting a packed tail
+uint32_t ownBlocks(int32_t inode)
+{
+    uint32_t count = blockCount(inode);
+    return inodeInfo(inode)->tail && count ? count - 1 : count;
+}
+
+// Blocks fallocate reserved past the end of inode: the block numbers that follow its last
+// block up to the first -1. They are unwritten, and read as zeros once the file grows into
+// them.
+uint32_t reservedBlocks(int32_t inode)
+{
+    if(isInline(inode))
+    {
+        return 0;
+    }
+
+    uint32_t count = blockCount(inode);
+    uint32_t index = count;
+    while(index < BLOCKS_PER_FILE && fileBlock(inode, index) != -1)
+    {
+        index++;
+    }
+    return index - count;
+}
+
+// Give back the blocks reserved past the end of inode
+void releaseReserved(int32_t inode)
+{
+    uint32_t index = blockCount(inode);
+    uint32_t end = index + reservedBlocks(inode);
+    for(; index < end; index++)
+    {
+        releaseBlock(fileBlock(inode, index));
+        setFileBlock(inode, index, -1);
+    }
+}
+
+// Where the bytes of block number index of inode start in its data block: 0 except for the
+// last block of a file whose tail is packed
+uint32_t blockStart(int32_t inode, uint32_t index)
+{
+    uint8_t tail = inodeInfo(inode)->tail;
+    if(tail == 0 || tail == TAIL_INLINE || index + 1 < blockCount(inode))
+    {
+        return 0;
+    }
+    return (tail - 1) * TAIL_SLOT;
+}
+
+// Find room for a tail of len bytes. Returns the tail block with a reference taken for the
+// file, and its slot in *slot, or -1 when the image is full.
+int32_t packTail(uint32_t len, uint32_t * slot)
+{
+    uint32_t slots = (len + TAIL_SLOT - 1) / TAIL_SLOT;
+    if(tail_block == -1 || tail_used + slots > TAIL_SLOTS || block_refs[tail_block] == UINT16_MAX)
+    {
+        int32_t block = findFreeBlock();
+        if(block == -1)
+        {
+            return -1;
+        }
+        uint8_t * p = newBlock(block);
+        if(p == NULL)
+        {
+            releaseBlock(block);
+            return -1;
+        }
+        memset(p, 0, BLOCK_SIZE);
+        putBlock(block, 1);
+        tail_block = block;
+        tail_used = 0;
+    }
+    else
+    {
+        refBlock(tail_block);
+    }
+
+    *slot = tail_used;
+    tail_used += slots;
+    return tail_block;
+}
+
+// Give the last bytes of a packed or inline file a block of its own, so the file can be
+// changed in place like any other. Returns MFS_ERR_NO_SPACE when there is no free block.
+int32_t unpackFile(int32_t inode)
+{
+    uint8_t tail = inodeInfo(inode)->tail;
+    uint32_t size = inodeInfo(inode)->file_size;
+    if(tail == 0)
+    {
+        return MFS_OK;
+    }
+
+    if(tail == TAIL_INLINE && size == 0)
+    {
+        clearFileBlocks(inode);
+        inodeInfo(inode)->tail = 0;
+        return MFS_OK;
+    }
+
+    int32_t block = findFreeBlock();
+    if(block == -1)
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    uint8_t * p = newBlock(block);
+    if(p == NULL)
+    {
+        releaseBlock(block);
+        return MFS_ERR_IO;
+    }
+    memset(p, 0, BLOCK_SIZE);
+    if(tail == TAIL_INLINE)
+    {
+        memcpy(p, inlineData(inode), size);
+        inodeInfo(inode)->tail = 0;
+        clearFileBlocks(inode);
+        setFileBlock(inode, 0, block);
+    }
+    else
+    {
+        uint32_t index = size / BLOCK_SIZE;
+        int32_t old = fileBlock(inode, index);
+        const uint8_t * src = getBlock(old);
+        if(src == NULL)
+        {
+            putBlock(block, 0);
+            releaseBlock(block);
+            return MFS_ERR_IO;
+        }
+        memcpy(p, src + blockStart(inode, index), size % BLOCK_SIZE);
+        putBlock(old, 0);
+        inodeInfo(inode)->tail = 0;
+        setFileBlock(inode, index, block);
+        releaseBlock(old);
+    }
+    putBlock(block, 1);
+    return MFS_OK;
+}
+
+// Point *bytes at the bytes of block number index of inode and check its data block against
+// its checksum. The caller gives the block back with putFileBytes().
+int32_t getFileBytes(int32_t inode, uint32_t index, const uint8_t ** bytes)
+{
+    if(isInline(inode))
+    {
+        *bytes = inlineData(inode) + index * BLOCK_SIZE;
+        return MFS_OK;
+    }
+
+    // A block the cache can not take in reads as zeros, and the caller gets the error
+    static const uint8_t zero[BLOCK_SIZE];
+    int32_t block = fileBlock(inode, index);
+    uint8_t * p = getBlock(block);
+    if(p == NULL)
+    {
+        *bytes = zero;
+        return MFS_ERR_IO;
+    }
+    *bytes = p + blockStart(inode, index);
+    return verifyBlock(block, p);
+}
+
+void putFileBytes(int32_t inode, uint32_t index)
+{
+    if(!isInline(inode))
+    {
+        putBlock(fileBlock(inode, index), 0);
+    }
+}
+
+// Hash index from file name to directory entry so lookups do not scan the whole directory. It
+// lives in memory only and is rebuilt whenever an image is loaded. Server lookups read it
+// without a lock, so a grown index replaces the old one with a single pointer store and the
+// old one is kept on the retired list until no lookup can still be using it.
+struct nameIndex
+{
+    uint32_t           mask;
+    int32_t            capacity;
+    int32_t          * next;        // next entry in the same bucket
+    struct nameIndex * retired;
+    int32_t            buckets[];   // first entry of each bucket, or -1
+};
+
+struct nameIndex * names;
+int                names_shared;    // set while lookups may run alongside a rebuild
+
+uint32_t hashName(const char * name)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+    for(i = 0; i < MAX_FILENAME && name[i]; i++)
+    {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void indexAdd(int32_t entry)
+{
+    uint32_t bucket = hashName(dirEntry(entry)->filename) & names->mask;
+    names->next[entry] = names->buckets[bucket];
+    names->buckets[bucket] = entry;
+}
+
+void indexRemove(int32_t entry)
+{
+    int32_t * link = &names->buckets[hashName(dirEntry(entry)->filename) & names->mask];
+    while(*link != -1 && *link != entry)
+    {
+        link = &names->next[*link];
+    }
+    if(*link == entry)
+    {
+        *link = names->next[entry];
+    }
+}
+
+// Free the indexes replaced while lookups were running
+void indexReclaim()
+{
+    while(names != NULL && names->retired != NULL)
+    {
+        struct nameIndex * old = names->retired;
+        names->retired = old->retired;
+        free(old);
+    }
+}
+
+void indexRebuild()
+{
+    struct nameIndex * index = names;
+    if(index == NULL || num_files > index->capacity)
+    {
+        int32_t capacity = num_files * 2;
+        uint32_t buckets = 1;
+        while(buckets < (uint32_t) capacity)
+        {
+            buckets <<= 1;
+        }
+        index = malloc(sizeof(struct nameIndex) + (buckets + capacity) * sizeof(int32_t));
+        if(index == NULL)
+        {
+            printf("ERROR: Out of memory\n");
+            exit(1);
+        }
+        index->mask = buckets - 1;
+        index->capacity = capacity;
+        index->next = index->buckets + buckets;
+        index->retired = names;
+    }
+
+    memset(index->buckets, 0xff, (index->mask + 1) * sizeof(int32_t));
+    int32_t i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(entryLive(i))
+        {
+            uint32_t bucket = hashName(dirEntry(i)->filename) & index->mask;
+            index->next[i] = index->buckets[bucket];
+            index->buckets[bucket] = i;
+        }
+    }
+
+    // Publish the filled index before a lock-free lookup can find it
+    if(index != names)
+    {
+        __atomic_store_n(&names, index, __ATOMIC_RELEASE);
+        if(!names_shared)
+        {
+            indexReclaim();
+        }
+    }
+}
+
+// Lowest extension slot that may be free
+int32_t ext_free = NUM_FILES;
+
+// Add a chunk of extension records in the block just below the lowest table. Fails when that
+// block holds data or something else was reserved below the chunks.
+int32_t growFiles()
+{
+    if(superblock->ext_chunks == 0)
+    {
+        superblock->ext_base = superblock->meta_top;
+    }
+    else if(superblock->meta_top != superblock->ext_base - (int32_t) superblock->ext_chunks)
+    {
+        return -1;
+    }
+
+    int32_t first = num_files;
+    if(reserveTable(1) == 0)
+    {
+        return -1;
+    }
+    superblock->ext_chunks++;
+
+    int32_t i;
+    for(i = first; i < first + (int32_t) EXT_PER_BLOCK; i++)
+    {
+        struct extFile * file = extFile(i);
+        file->entry.inode = -1;
+        memset(file->direct, 0xff, sizeof(file->direct));
+    }
+
+    // Lock-free lookups read num_files, so the new records are set up before they count
+    __atomic_store_n(&num_files, first + EXT_PER_BLOCK, __ATOMIC_RELEASE);
+
+    if(num_files > names->capacity)
+    {
+        indexRebuild();
+    }
+    return first;
+}
+
+// Pick a free directory entry and inode for a new file. The fixed tables are used first, then
+// free extension slots, then a new extension chunk.
+int32_t allocFile(int32_t * entry, int32_t * inode)
+{
+    int i;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        if(!directory[i].in_use)
+        {
+            *inode = findFreeInode();
+            if(*inode != -1)
+            {
+                *entry = i;
+                return MFS_OK;
+            }
+            break;
+        }
+    }
+
+    for(; ext_free < num_files; ext_free++)
+    {
+        if(!dirEntry(ext_free)->in_use && !inodeInfo(ext_free)->in_use)
+        {
+            *entry = *inode = ext_free;
+            return MFS_OK;
+        }
+    }
+
+    int32_t grown = growFiles();
+    if(grown == -1)
+    {
+        return i == NUM_FILES ? MFS_ERR_NO_ENTRY : MFS_ERR_NO_INODE;
+    }
+    *entry = *inode = ext_free = grown;
+    return MFS_OK;
+}
+
+// Pin the map blocks of every live extension inode, reading them from the image first when
+// load is set and a block cache is in use
+void pinMaps(int load)
+{
+    memset(block_pinned, 0, NUM_BLOCKS);
+
+    int32_t i;
+    for(i = NUM_FILES; i < num_files; i++)
+    {
+        struct extFile * file = extFile(i);
+        uint32_t k;
+        for(k = 0; file->info.in_use && file->info.tail != TAIL_INLINE && k < EXT_MAPS; k++)
+        {
+            int32_t map = file->maps[k];
+            if(!validDataBlock(map))
+            {
+                continue;
+            }
+
+            if(load && cache_mode && pread(image_fd, data[map], BLOCK_SIZE,
+                                           (off_t) map * BLOCK_SIZE) != BLOCK_SIZE)
+            {
+                printf("ERROR: Can not read block %d from %s\n", map, image_name);
+                last_status = MFS_ERR_IO;
+            }
+            pinBlock(map);
+        }
+    }
+}
+
+// Recompute the file count for the extension chunks of a freshly loaded image, pin their map
+// blocks and rebuild the name index
+void loadExtensions()
+{
+    num_files = NUM_FILES;
+    ext_free = NUM_FILES;
+    tail_block = -1;
+
+    if(superblock->ext_chunks && (superblock->ext_base > NUM_BLOCKS ||
+       superblock->ext_base - (int32_t) superblock->ext_chunks < superblock->meta_top))
+    {
+        printf("ERROR: The extension chunks of %s are out of range and are ignored\n",
+               image_name);
+        superblock->ext_chunks = 0;
+    }
+    num_files += superblock->ext_chunks * EXT_PER_BLOCK;
+
+    pinMaps(1);
+    indexRebuild();
+}
+
+// Returns the directory index of the in-use file called filename, or -1. The walk is bounded
+// so a lookup racing a writer (see dirReadBegin) ends and retries instead of looping.
+int32_t findFile(const char * filename)
+{
+    struct nameIndex * index = __atomic_load_n(&names, __ATOMIC_ACQUIRE);
+    int32_t limit = __atomic_load_n(&num_files, __ATOMIC_RELAXED);
+    limit = limit < index->capacity ? limit : index->capacity;
+
+    int32_t i = index->buckets[hashName(filename) & index->mask];
+    int32_t steps;
+    for(steps = 0; i >= 0 && i < limit && steps < limit; steps++)
+    {
+        if(entryLive(i) && !strncmp(dirEntry(i)->filename, filename, MAX_FILENAME))
+        {
+            return i;
+        }
+        i = index->next[i];
+    }
+
+    return -1;
+}
+
+// Shared mode (open -s) maps the image file itself MAP_SHARED as data[], so every process
+// that has it open works on the same page-cache pages and changes reach the file as they are
+// made. Each command holds an fcntl lock on the metadata regions of the file, shared to read
+// and exclusive to change, and every change bumps superblock->generation so the others know
+// to rebuild the state they keep outside the image before their next command. An image that
+// can only be opened for reading is mapped MAP_PRIVATE, which shares the same pages until a
+// page is written, and takes read locks only.
+#define SHARED_WRITE 1
+#define SHARED_READ_ONLY 2
+
+uint8_t  shared_mode;
+uint64_t shared_generation;     // generation the state outside the image was built for
+
+// Set when the image file is a compressed container, see savefs -z. savefs keeps the format
+// the image was opened or last saved in.
+uint8_t  image_compressed;
+
+// Open images. The globals above always describe the current image; the handle of every other
+// open image holds its state until the shell switches to it.
+#define MAX_IMAGES 8
+
+struct image
+{
+    char                name[PATH_MAX];
+    uint8_t           (*data)[BLOCK_SIZE];     // NULL for a free slot
+    uint8_t           * block_pinned;
+    int32_t             num_files;
+    int32_t             ext_free;
+    int32_t             tail_block;
+    uint32_t            tail_used;
+    struct nameIndex  * names;
+    uint64_t            used;                   // when it was last made current
+    uint8_t             cache_mode;
+    int                 image_fd;
+    uint8_t             shared_mode;
+    uint64_t            shared_generation;
+    uint8_t             compressed;
+    struct cacheSlot  * cache_slots;
+    uint8_t           * cache_data;
+    int32_t           * cache_index;
+    int32_t             cache_size;
+    int32_t             cache_head;
+    int32_t             cache_tail;
+    int32_t             cache_last_block;
+    uint64_t            cache_hits;
+    uint64_t            cache_misses;
+    uint64_t            cache_readahead;
+    uint64_t            cache_writebacks;
+    int                 spill_fd;
+    int32_t           * spill_index;
+    int32_t             spill_count;
+};
+
+struct image images[MAX_IMAGES];
+int          current_image = -1;
+uint64_t     image_clock;
+
+// Point the table globals into data[] of the current image
+void imagePointers()
+{
+    directory   = (struct directoryEntry*) &data[0][0];
+    inodes      = (struct inode*) &data[FIRST_INODE_BLOCK][0];
+    free_blocks = (uint8_t*) &data[FREE_BLOCK_MAP][0];
+    free_inodes = (uint8_t*) &data[FREE_INODE_BLOCK][0];
+    superblock  = (struct superblock*) &data[SUPERBLOCK][0];
+    block_crc   = superblock->crc_table ? (uint32_t*) data[superblock->crc_table] : NULL;
+    block_refs  = superblock->ref_table ? (uint16_t*) data[superblock->ref_table] : NULL;
+}
+
+// Copy the state of the current image into its handle
+void imageStore()
+{
+    if(current_image == -1)
+    {
+        return;
+    }
+
+    struct image * h = &images[current_image];
+    memcpy(h->name, image_name, sizeof(h->name));
+    h->data = data;
+    h->block_pinned = block_pinned;
+    h->num_files = num_files;
+    h->ext_free = ext_free;
+    h->tail_block = tail_block;
+    h->tail_used = tail_used;
+    h->names = names;
+    h->cache_mode = cache_mode;
+    h->image_fd = image_fd;
+    h->shared_mode = shared_mode;
+    h->shared_generation = shared_generation;
+    h->compressed = image_compressed;
+    h->cache_slots = cache_slots;
+    h->cache_data = cache_data;
+    h->cache_index = cache_index;
+    h->cache_size = cache_size;
+    h->cache_head = cache_head;
+    h->cache_tail = cache_tail;
+    h->cache_last_block = cache_last_block;
+    h->cache_hits = cache_hits;
+    h->cache_misses = cache_misses;
+    h->cache_readahead = cache_readahead;
+    h->cache_writebacks = cache_writebacks;
+    h->spill_fd = spill_fd;
+    h->spill_index = spill_index;
+    h->spill_count = spill_count;
+}
+
+// Make the image in slot current, or leave no image open for -1
+void imageLoad(int slot)
+{
+    struct image none;
+    memset(&none, 0, sizeof(none));
+    none.num_files = NUM_FILES;
+    none.ext_free = NUM_FILES;
+    none.tail_block = -1;
+    none.image_fd = -1;
+    none.spill_fd = -1;
+
+    struct image * h = slot == -1 ? &none : &images[slot];
+    memcpy(image_name, h->name, sizeof(h->name));
+    data = h->data;
+    block_pinned = h->block_pinned;
+    num_files = h->num_files;
+    ext_free = h->ext_free;
+    tail_block = h->tail_block;
+    tail_used = h->tail_used;
+    names = h->names;
+    cache_mode = h->cache_mode;
+    image_fd = h->image_fd;
+    shared_mode = h->shared_mode;
+    shared_generation = h->shared_generation;
+    image_compressed = h->compressed;
+    cache_slots = h->cache_slots;
+    cache_data = h->cache_data;
+    cache_index = h->cache_index;
+    cache_size = h->cache_size;
+    cache_head = h->cache_head;
+    cache_tail = h->cache_tail;
+    cache_last_block = h->cache_last_block;
+    cache_hits = h->cache_hits;
+    cache_misses = h->cache_misses;
+    cache_readahead = h->cache_readahead;
+    cache_writebacks = h->cache_writebacks;
+    spill_fd = h->spill_fd;
+    spill_index = h->spill_index;
+    spill_count = h->spill_count;
+
+    current_image = slot;
+    image_open = slot != -1;
+    if(image_open)
+    {
+        h->used = ++image_clock;
+        imagePointers();
+    }
+}
+
+void imageSwitch(int slot)
+{
+    imageStore();
+    imageLoad(slot);
+}
+
+// Slot of the open image called name, or -1
+// An image name is kept whole, so savefs writes the very file that was opened, or the image
+// is refused
+int imageNameFits(const char * name)
+{
+    if(strlen(name) < sizeof(image_name))
+    {
+        return 1;
+    }
+    printf("ERROR: %.64s...: %s\n", name, mfs_strerror(MFS_ERR_NAME));
+    last_status = MFS_ERR_NAME;
+    return 0;
+}
+
+int imageFind(const char * name)
+{
+    imageStore();
+    int i;
+    for(i = 0; i < MAX_IMAGES; i++)
+    {
+        if(images[i].data != NULL && !strncmp(images[i].name, name, sizeof(images[i].name)))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Image buffers are anonymous mappings, so nothing is resident before it is touched and a
+// cached image only pays for its metadata. A fully loaded image asks for hugepages, from the
+// reserved pool if there is one and otherwise as transparent hugepages, to save TLB misses.
+void * imageMap(int cache)
+{
+    size_t len = (size_t) NUM_BLOCKS * BLOCK_SIZE;
+    void * p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if(!cache)
+    {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                 -1, 0);
+    }
+#endif
+    if(p == MAP_FAILED)
+    {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if(p != MAP_FAILED && !cache)
+        {
+            madvise(p, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Take a free slot for a new image, map its buffers and make it current. The image counts as
+// open only once it has been loaded or created. Returns -1 when every slot is in use or the
+// buffers can not be had.
+int imageAlloc(int cache)
+{
+    int slot;
+    imageStore();
+    for(slot = 0; slot < MAX_IMAGES && images[slot].data != NULL; slot++)
+    {
+    }
+    if(slot == MAX_IMAGES)
+    {
+        return -1;
+    }
+
+    uint8_t (*buf)[BLOCK_SIZE] = imageMap(cache);
+    uint8_t * pinned = calloc(NUM_BLOCKS, 1);
+    if(buf == NULL || pinned == NULL)
+    {
+        if(buf != NULL)
+        {
+            munmap(buf, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+        }
+        free(pinned);
+        return -1;
+    }
+
+    memset(&images[slot], 0, sizeof(images[slot]));
+    images[slot].data = buf;
+    images[slot].block_pinned = pinned;
+    images[slot].num_files = NUM_FILES;
+    images[slot].ext_free = NUM_FILES;
+    images[slot].tail_block = -1;
+    images[slot].image_fd = -1;
+    images[slot].spill_fd = -1;
+    imageLoad(slot);
+    image_open = 0;
+    return slot;
+}
+
+void cacheClose();
+
+int shared_lock_fd = -1;        // image file whose metadata the running command has locked
+
+// Drop the current image's buffers and switch to the most recently used image still open
+void imageRelease()
+{
+    if(cache_mode)
+    {
+        cacheClose();
+    }
+    if(image_fd != -1)
+    {
+        // Closing the file drops any lock on it
+        shared_lock_fd = image_fd == shared_lock_fd ? -1 : shared_lock_fd;
+        close(image_fd);
+    }
+    munmap(data, (size_t) NUM_BLOCKS * BLOCK_SIZE);
+    free(block_pinned);
+    while(names != NULL)
+    {
+        struct nameIndex * old = names;
+        names = old->retired;
+        free(old);
+    }
+    memset(&images[current_image], 0, sizeof(images[current_image]));
+
+    int next = -1;
+    int i;
+    for(i = 0; i < MAX_IMAGES; i++)
+    {
+        if(images[i].data != NULL && (next == -1 || images[i].used > images[next].used))
+        {
+            next = i;
+        }
+    }
+    imageLoad(next);
+}
+
+// Reset the directory, inodes and both free maps of the image in data[]
+void initImage()
+{
+    int i;
+    for(i = 0; i < NUM_FILES; i++)
+    {
+        dirEntry(i)->in_use = 0;
+        dirEntry(i)->inode  = -1;
+        free_inodes[i]      = 1;
+
+        memset(dirEntry(i)->filename, 0, 64);
+
+        int j;
+        for(j = 0; j < BLOCKS_PER_FILE; j++)
+        {
+            inodes[i].blocks[j] = -1;
+        }
+        inodeInfo(i)->in_use = 0;
+        inodeInfo(i)->attribute = 0x0;
+        inodeInfo(i)->tail = 0;
+        inodeInfo(i)->file_size = 0;
+    }
+
+    // The checksum table goes at the end of the image with the reference counts below it
+    memset(superblock, 0, BLOCK_SIZE);
+    superblock->magic = MFS_MAGIC;
+    superblock->version = MFS_VERSION;
+    superblock->crc_table = NUM_BLOCKS - CRC_BLOCKS;
+    superblock->ref_table = superblock->crc_table - REF_BLOCKS;
+    superblock->meta_top = superblock->ref_table;
+    block_crc = (uint32_t*) data[superblock->crc_table];
+    block_refs = (uint16_t*) data[superblock->ref_table];
+    memset(data[superblock->meta_top], 0, (NUM_BLOCKS - superblock->meta_top) * BLOCK_SIZE);
+
+    // The metadata blocks are never handed out by findFreeBlock()
+    int j;
+    for(j = 0; j < NUM_BLOCKS; j++)
+    {
+        free_blocks[j] = (j >= FIRST_DATA_BLOCK && j < superblock->meta_top);
+    }
+
+    loadExtensions();
+}
+
+// Called once an image has been loaded. Images written before the superblock or one of its
+// tables existed get them added, when the blocks just below the existing tables are free.
+// Returns -1, with the image left untouched, when the superblock is too damaged to use it
+int loadSuperblock()
+{
+    int32_t j;
+    int upgraded = 0;
+
+    if(superblock->magic == MFS_MAGIC && !validMetaTop())
+    {
+        printf("ERROR: The superblock of %s puts the end of the data region at block %d\n",
+               image_name, superblock->meta_top);
+        last_status = MFS_ERR_CORRUPT;
+        return -1;
+    }
+
+    // A table out of range is dropped; the reference counts are then rebuilt below
+    if(superblock->magic == MFS_MAGIC && !validTable(superblock->crc_table, CRC_BLOCKS))
+    {
+        printf("ERROR: The checksum table of %s is out of range and is ignored\n", image_name);
+        superblock->crc_table = 0;
+    }
+    if(superblock->magic == MFS_MAGIC && !validTable(superblock->ref_table, REF_BLOCKS))
+    {
+        printf("ERROR: The reference count table of %s is out of range and is rebuilt\n",
+               image_name);
+        superblock->ref_table = 0;
+    }
+
+    if(superblock->magic != MFS_MAGIC)
+    {
+        memset(superblock, 0, BLOCK_SIZE);
+        superblock->magic = MFS_MAGIC;
+        superblock->version = MFS_VERSION;
+        superblock->meta_top = NUM_BLOCKS;
+        superblock->crc_table = reserveTable(CRC_BLOCKS);
+        block_crc = (uint32_t*) data[superblock->crc_table];
+
+        for(j = FIRST_DATA_BLOCK; superblock->crc_table && j < superblock->meta_top; j++)
+        {
+            const uint8_t * p = free_blocks[j] ? NULL : getBlock(j);
+            if(p != NULL)
+            {
+                sealBlock(j, p);
+                putBlock(j, 0);
+            }
+        }
+        upgraded = 1;
+    }
+
+    if(superblock->ref_table == 0)
+    {
+        superblock->ref_table = reserveTable(REF_BLOCKS);
+        block_refs = (uint16_t*) data[superblock->ref_table];
+
+        for(j = FIRST_DATA_BLOCK; superblock->ref_table && j < superblock->meta_top; j++)
+        {
+            block_refs[j] = !free_blocks[j];
+        }
+        upgraded = 1;
+    }
+
+    block_crc = superblock->crc_table ? (uint32_t*) data[superblock->crc_table] : NULL;
+    block_refs = superblock->ref_table ? (uint16_t*) data[superblock->ref_table] : NULL;
+
+    if(upgraded)
+    {
+        printf("Upgraded %s: block checksums %s, reference counts %s; savefs to keep this\n",
+               image_name, block_crc ? "on" : "off (no room)",
+               block_refs ? "on" : "off (no room)");
+    }
+
+    loadExtensions();
+    return 0;
+}
+
+// No image is open, and so no image memory is used, until open or createfs
+void init()
+{
+    crc32cInit();
+
+    memset(image_name, 0, sizeof(image_name));
+    image_open = 0;
+}
+
+uint32_t df()
+{
+    int j;
+    int count = 0;
+    for(j = FIRST_DATA_BLOCK; j < superblock->meta_top; j++)
+    {
+        if(free_blocks[j])
+        {
+            count++;
+        }
+    }
+
+    return count * BLOCK_SIZE;
+}
+
+// Bytes held by fallocate reservations, which df() does not count as free
+uint64_t reservedBytes()
+{
+    uint64_t blocks = 0;
+    int32_t i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(inodeInfo(i)->in_use)
+        {
+            blocks += reservedBlocks(i);
+        }
+    }
+    return blocks * BLOCK_SIZE;
+}
+
+// Create filename and make it the current image. An image that was open stays open.
+void createfs(char * filename)
+{
+    if(!imageNameFits(filename))
+    {
+        return;
+    }
+
+    if(imageFind(filename) != -1)
+    {
+        printf("ERROR: %s is open, close it first\n", filename);
+        last_status = MFS_ERR_EXISTS;
+        return;
+    }
+
+    fp = fopen(filename, "w");
+
+    if(fp == NULL)
+    {
+        printf("ERROR: Can not create %s\n", filename);
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    if(imageAlloc(0) == -1)
+    {
+        printf("ERROR: Can not open more than %d images\n", MAX_IMAGES);
+        last_status = MFS_ERR_BAD_REQUEST;
+        fclose(fp);
+        fp = NULL;
+        return;
+    }
+
+    strcpy(image_name, filename);
+
+    // A fresh mapping is already zeroed
+    image_open = 1;
+
+    initImage();
+
+    // Write the empty image out so it can be opened before the first savefs
+    fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+
+    fclose(fp);
+    fp = NULL;
+}
+
+// savefs -z writes the image as a compressed container: a zimageHeader, an index of one
+// zimageChunk per ZCHUNK_BLOCKS blocks and then the chunks, each compressed with zlib on its
+// own so they can be compressed and decompressed on all cores. Chunks of zeros take no space
+// and chunks that do not compress are stored as they are. The magic can not start a raw image,
+// whose first bytes are a file name.
+#define ZIMAGE_MAGIC  "\x89MFSZ\r\n"
+#define ZCHUNK_BLOCKS 256
+#define ZCHUNK_BYTES  (ZCHUNK_BLOCKS * BLOCK_SIZE)
+#define ZCHUNKS       (NUM_BLOCKS / ZCHUNK_BLOCKS)
+#define ZCHUNK_ZERO   0
+#define ZCHUNK_RAW    1
+#define ZCHUNK_ZLIB   2
+
+struct zimageHeader
+{
+    char     magic[8];
+    uint32_t chunk_blocks;
+    uint32_t chunks;
+};
+
+struct zimageChunk
+{
+    uint64_t offset;        // in the file
+    uint32_t length;
+    uint32_t type;
+};
+
+int parallelFor(int32_t first, int32_t last, void (*fn)(int32_t, int32_t, void *), void * arg);
+int writeFull(int fd, const void * buf, size_t len);
+
+struct zimageJob
+{
+    uint8_t            * image;
+    const uint8_t      * file;      // the container when decompressing
+    struct zimageChunk * index;
+    uint8_t           ** out;       // compressed bytes of each zlib chunk
+    int                  failed;
+};
+
+int isCompressedImage(const void * start)
+{
+    return !memcmp(start, ZIMAGE_MAGIC, sizeof(ZIMAGE_MAGIC));
+}
+
+// Whether the image file open on fd is compressed. A block cache, a shared mapping and syncfs
+// all work on the blocks in the file, so they need an uncompressed image.
+int isCompressedFile(int fd)
+{
+    char magic[sizeof(ZIMAGE_MAGIC)];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && isCompressedImage(magic);
+}
+
+void zimageCompress(int32_t first, int32_t last, void * arg)
+{
+    struct zimageJob * job = arg;
+    int32_t c;
+    for(c = first; c < last; c++)
+    {
+        const uint8_t * src = job->image + (size_t) c * ZCHUNK_BYTES;
+        const uint64_t * words = (const uint64_t*) src;
+        size_t i;
+        for(i = 0; i < ZCHUNK_BYTES / sizeof(uint64_t) && words[i] == 0; i++)
+        {
+        }
+        if(i == ZCHUNK_BYTES / sizeof(uint64_t))
+        {
+            job->index[c].type = ZCHUNK_ZERO;
+            continue;
+        }
+
+        uLongf len = compressBound(ZCHUNK_BYTES);
+        job->out[c] = malloc(len);
+        if(job->out[c] == NULL)
+        {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(compress2(job->out[c], &len, src, ZCHUNK_BYTES, Z_DEFAULT_COMPRESSION) == Z_OK &&
+           len < ZCHUNK_BYTES)
+        {
+            job->index[c].type = ZCHUNK_ZLIB;
+            job->index[c].length = len;
+        }
+        else
+        {
+            free(job->out[c]);
+            job->out[c] = NULL;
+            job->index[c].type = ZCHUNK_RAW;
+            job->index[c].length = ZCHUNK_BYTES;
+        }
+    }
+}
+
+// Write the image at image to fd as a compressed container. Returns 0, or -1 on error.
+int writeCompressed(int fd, uint8_t * image)
+{
+    struct zimageChunk index[ZCHUNKS];
+    uint8_t * out[ZCHUNKS];
+    memset(index, 0, sizeof(index));
+    memset(out, 0, sizeof(out));
+    struct zimageJob job = { image, NULL, index, out, 0 };
+    parallelFor(0, ZCHUNKS, zimageCompress, &job);
+
+    struct zimageHeader header = { ZIMAGE_MAGIC, ZCHUNK_BLOCKS, ZCHUNKS };
+    uint64_t offset = sizeof(header) + sizeof(index);
+    int32_t c;
+    for(c = 0; c < ZCHUNKS; c++)
+    {
+        index[c].offset = offset;
+        offset += index[c].length;
+    }
+
+    int ret = job.failed || writeFull(fd, &header, sizeof(header)) == -1 ||
+              writeFull(fd, index, sizeof(index)) == -1 ? -1 : 0;
+    for(c = 0; c < ZCHUNKS; c++)
+    {
+        const uint8_t * p = out[c] ? out[c] : image + (size_t) c * ZCHUNK_BYTES;
+        if(ret == 0 && index[c].length && writeFull(fd, p, index[c].length) == -1)
+        {
+            ret = -1;
+        }
+        free(out[c]);
+    }
+    return ret;
+}
+
+void zimageDecompress(int32_t first, int32_t last, void * arg)
+{
+    struct zimageJob * job = arg;
+    int32_t c;
+    for(c = first; c < last; c++)
+    {
+        uint8_t * dst = job->image + (size_t) c * ZCHUNK_BYTES;
+        const uint8_t * src = job->file + job->index[c].offset;
+        uLongf len = ZCHUNK_BYTES;
+
+        // A fresh image buffer is already zeroed
+        if(job->index[c].type == ZCHUNK_RAW)
+        {
+            memcpy(dst, src, ZCHUNK_BYTES);
+        }
+        else if(job->index[c].type == ZCHUNK_ZLIB &&
+                (uncompress(dst, &len, src, job->index[c].length) != Z_OK ||
+                 len != ZCHUNK_BYTES))
+        {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Fill the freshly mapped image with the compressed container in fd. Returns 0, or -1 if it
+// is not a whole, undamaged container.
+int readCompressed(int fd, uint8_t * image)
+{
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(struct zimageHeader))
+    {
+        return -1;
+    }
+
+    const uint8_t * file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(file == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    const struct zimageHeader * header = (const struct zimageHeader*) file;
+    struct zimageChunk * index = (struct zimageChunk*) (file + sizeof(*header));
+    int ok = header->chunk_blocks == ZCHUNK_BLOCKS && header->chunks == ZCHUNKS &&
+             st.st_size >= (off_t) (sizeof(*header) + ZCHUNKS * sizeof(*index));
+    int32_t c;
+    for(c = 0; ok && c < ZCHUNKS; c++)
+    {
+        ok = index[c].type <= ZCHUNK_ZLIB &&
+             (index[c].type != ZCHUNK_RAW || index[c].length == ZCHUNK_BYTES) &&
+             index[c].offset + index[c].length <= (uint64_t) st.st_size;
+    }
+
+    struct zimageJob job = { image, file, index, NULL, 0 };
+    if(ok)
+    {
+        parallelFor(0, ZCHUNKS, zimageDecompress, &job);
+    }
+    munmap((void*) file, st.st_size);
+    return ok && !job.failed ? 0 : -1;
+}
+
+void saveWait(const char * name);
+int saveChild(const char * name, int compressed);
+
+void savefs()
+{
+    if(image_open == 0)
+    {
+        printf("ERROR: Disk image is not open\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    // A background save still running would otherwise replace this one when it finishes
+    saveWait(image_name);
+
+    // A shared image is the file itself, so saving only has to get it onto the disk
+    if(shared_mode)
+    {
+        if(msync(data, (size_t) NUM_BLOCKS * BLOCK_SIZE, MS_SYNC) == -1)
+        {
+            printf("ERROR: Can not write %s\n", image_name);
+            last_status = MFS_ERR_IO;
+        }
+        return;
+    }
+
+    // With a block cache only the metadata and the blocks changed since the last save need
+    // writing. The data blocks go first, so the metadata never names blocks not yet written.
+    if(cache_mode)
+    {
+        if(cacheSave() == -1)
+        {
+            printf("ERROR: Can not write %s\n", image_name);
+            last_status = MFS_ERR_IO;
+            return;
+        }
+        size_t tables = (size_t) (NUM_BLOCKS - superblock->meta_top) * BLOCK_SIZE;
+        if(pwrite(image_fd, data, FIRST_DATA_BLOCK * BLOCK_SIZE, 0) !=
+           FIRST_DATA_BLOCK * BLOCK_SIZE ||
+           pwrite(image_fd, data[superblock->meta_top], tables,
+                  (off_t) superblock->meta_top * BLOCK_SIZE) != tables)
+        {
+            printf("ERROR: Can not write %s\n", image_name);
+            last_status = MFS_ERR_IO;
+        }
+
+        // Map blocks of extension inodes are pinned in data[] rather than cached
+        int32_t block;
+        for(block = FIRST_DATA_BLOCK; block < superblock->meta_top; block++)
+        {
+            if(block_pinned[block] && pwrite(image_fd, data[block], BLOCK_SIZE,
+                                             (off_t) block * BLOCK_SIZE) != BLOCK_SIZE)
+            {
+                printf("ERROR: Can not write block %d to %s\n", block, image_name);
+                last_status = MFS_ERR_IO;
+            }
+        }
+        return;
+    }
+
+    // A compressed image is written whole and renamed over the old one, as a background save is
+    if(image_compressed)
+    {
+        if(saveChild(image_name, 1))
+        {
+            printf("ERROR: Can not write %s\n", image_name);
+            last_status = MFS_ERR_IO;
+        }
+        return;
+    }
+
+    // The image name is kept so the image can be saved more than once
+    FILE* fp2 = fopen(image_name, "w");
+
+    if(fp2 == NULL)
+    {
+        printf("ERROR: Can not write %s\n", image_name);
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp2);
+
+    fclose(fp2);
+}
+
+// Choose whether savefs writes the current image compressed. Returns -1 if it can not be.
+int saveFormat(int compressed)
+{
+    if(image_open == 0)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
+    }
+
+    // Those images are saved in place, block by block
+    if(compressed && (cache_mode || shared_mode))
+    {
+        printf("ERROR: An image opened with %s can not be saved compressed\n",
+               cache_mode ? "--cache" : "-s");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return -1;
+    }
+
+    image_compressed = compressed;
+    return 0;
+}
+
+// savefs --bg forks and the child writes the image while the shell carries on. The child's
+// copy-on-write view of data[] is the image as it was at the fork, however the parent changes
+// it afterwards. The child writes it to a temporary file next to the image, syncs it and
+// renames it over the image, so a crash leaves either the old or the new image whole.
+struct backgroundSave
+{
+    pid_t           pid;        // 0 for a free slot
+    char            name[PATH_MAX];
+    struct timespec started;
+};
+
+struct backgroundSave saves[MAX_IMAGES];
+
+// Runs in the child, and for savefs of a compressed image; returns its exit status
+int saveChild(const char * name, int compressed)
+{
+    char tmp[sizeof(image_name) + 16];
+    snprintf(tmp, sizeof(tmp), "%s.saveXXXXXX", name);
+    int fd = mkstemp(tmp);
+    if(fd == -1)
+    {
+        return 1;
+    }
+
+    // Keep the permissions of the image being replaced
+    struct stat st;
+    fchmod(fd, stat(name, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+    int failed = compressed ? writeCompressed(fd, &data[0][0]) == -1
+                            : writeFull(fd, data, (size_t) NUM_BLOCKS * BLOCK_SIZE) == -1;
+    if(failed || fsync(fd) == -1 || close(fd) == -1 || rename(tmp, name) == -1)
+    {
+        unlink(tmp);
+        return 1;
+    }
+
+    // Sync the directory so the rename itself survives a crash
+    char dir[sizeof(image_name)];
+    const char * slash = strrchr(name, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash == NULL ? 1 : (int) (slash - name + 1),
+             slash == NULL ? "." : name);
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// Report a finished background save
+void saveDone(struct backgroundSave * save, int status)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = end.tv_sec - save->started.tv_sec +
+                     (end.tv_nsec - save->started.tv_nsec) / 1e9;
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        printf("Background savefs of %s finished in %.2f s\n", save->name, seconds);
+    }
+    else
+    {
+        printf("ERROR: Background savefs of %s failed, the image on disk is unchanged\n",
+               save->name);
+        last_status = MFS_ERR_IO;
+    }
+    save->pid = 0;
+}
+
+// Report the background saves that have finished, without waiting for the others
+void savePoll()
+{
+    int i;
+    for(i = 0; i < MAX_IMAGES; i++)
+    {
+        int status;
+        if(saves[i].pid != 0 && waitpid(saves[i].pid, &status, WNOHANG) == saves[i].pid)
+        {
+            saveDone(&saves[i], status);
+        }
+    }
+}
+
+// Wait for the background saves of the image called name, or of every image when name is NULL
+void saveWait(const char * name)
+{
+    int i;
+    for(i = 0; i < MAX_IMAGES; i++)
+    {
+        int status;
+        if(saves[i].pid != 0 && (name == NULL || !strcmp(saves[i].name, name)) &&
+           waitpid(saves[i].pid, &status, 0) == saves[i].pid)
+        {
+            saveDone(&saves[i], status);
+        }
+    }
+}
+
+void saveBackground()
+{
+    if(image_open == 0)
+    {
+        printf("ERROR: Disk image is not open\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    // With a block cache most of the image is only on disk and the save writes in place, and a
+    // shared image is saved by syncing the file, so either is cheap enough to do now
+    if(cache_mode || shared_mode)
+    {
+        savefs();
+        return;
+    }
+
+    // One save of an image at a time keeps them finishing in order
+    saveWait(image_name);
+
+    int i;
+    for(i = 0; i < MAX_IMAGES && saves[i].pid != 0; i++)
+    {
+    }
+    if(i == MAX_IMAGES)
+    {
+        saveWait(NULL);
+        i = 0;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        printf("ERROR: Can not start a background savefs, saving now\n");
+        savefs();
+        return;
+    }
+    if(pid == 0)
+    {
+        _exit(saveChild(image_name, image_compressed));
+    }
+
+    saves[i].pid = pid;
+    memcpy(saves[i].name, image_name, sizeof(saves[i].name));
+    clock_gettime(CLOCK_MONOTONIC, &saves[i].started);
+    printf("Saving %s in the background\n", image_name);
+}
+
+void saveStatus()
+{
+    savePoll();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int i, running = 0;
+    for(i = 0; i < MAX_IMAGES; i++)
+    {
+        if(saves[i].pid != 0)
+        {
+            printf("%s: saving for %.2f s (pid %d)\n", saves[i].name,
+                   now.tv_sec - saves[i].started.tv_sec +
+                   (now.tv_nsec - saves[i].started.tv_nsec) / 1e9, (int) saves[i].pid);
+            running++;
+        }
+    }
+    if(!running)
+    {
+        printf("No background savefs running\n");
+    }
+}
+
+uint32_t fsck(int quiet, int repair);
+
+// A quick consistency check runs on every open so damage is noticed before it spreads
+void checkOnOpen()
+{
+    if(fsck(1, 0))
+    {
+        printf("WARNING: %s is inconsistent, run fsck for details or fsck -r to repair it\n",
+               image_name);
+    }
+}
+
+// Open filename and make it the current image; images already open stay open. With
+// cache_blocks > 0 only the metadata is loaded and data blocks are read through a block
+// cache of that many blocks; otherwise the whole image is read into data[].
+void openfs(char * filename, int32_t cache_blocks)
+{
+    if(!imageNameFits(filename))
+    {
+        return;
+    }
+
+    if(imageFind(filename) != -1)
+    {
+        printf("ERROR: %s is already open\n", filename);
+        last_status = MFS_ERR_EXISTS;
+        return;
+    }
+
+    if(imageAlloc(cache_blocks > 0) == -1)
+    {
+        printf("ERROR: Can not open more than %d images\n", MAX_IMAGES);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    if(cache_blocks > 0)
+    {
+        struct stat buf;
+        image_fd = open(filename, O_RDWR | O_CLOEXEC);
+        if(image_fd == -1)
+        {
+            printf("ERROR. File not found\n");
+            last_status = MFS_ERR_NOT_FOUND;
+            imageRelease();
+            return;
+        }
+        if(isCompressedFile(image_fd))
+        {
+            printf("ERROR: %s is compressed, open it without --cache\n", filename);
+            last_status = MFS_ERR_BAD_REQUEST;
+            imageRelease();
+            return;
+        }
+
+        if(fstat(image_fd, &buf) == -1 || buf.st_size < (off_t) NUM_BLOCKS * BLOCK_SIZE ||
+           pread(image_fd, data, FIRST_DATA_BLOCK * BLOCK_SIZE, 0) !=
+           FIRST_DATA_BLOCK * BLOCK_SIZE || cacheOpen(cache_blocks) == -1)
+        {
+            printf("ERROR: %s is not a complete filesystem image\n", filename);
+            last_status = MFS_ERR_IO;
+            imageRelease();
+            return;
+        }
+
+        strcpy(image_name, filename);
+        image_open = 1;
+
+        // The tables at the end of the image are pinned alongside the rest of the metadata
+        if(superblock->magic == MFS_MAGIC && validMetaTop())
+        {
+            size_t tables = (size_t) (NUM_BLOCKS - superblock->meta_top) * BLOCK_SIZE;
+            if(pread(image_fd, data[superblock->meta_top], tables,
+                     (off_t) superblock->meta_top * BLOCK_SIZE) != tables)
+            {
+                printf("ERROR: Can not read the tables of %s\n", filename);
+                last_status = MFS_ERR_IO;
+            }
+        }
+        if(loadSuperblock() == -1)
+        {
+            imageRelease();
+            return;
+        }
+        checkOnOpen();
+        return;
+    }
+
+    fp = fopen(filename, "r");
+
+    if(fp == NULL)
+    {
+        printf("ERROR. File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        imageRelease();
+        return;
+    }
+
+    strcpy(image_name, filename);
+
+    // A compressed image is told apart by its first bytes and decompressed on all cores
+    char magic[sizeof(ZIMAGE_MAGIC)];
+    image_compressed = fread(magic, sizeof(magic), 1, fp) == 1 && isCompressedImage(magic);
+    if(image_compressed ? readCompressed(fileno(fp), &data[0][0]) == -1 :
+       fseek(fp, 0, SEEK_SET) == -1 ||
+       fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp) != NUM_BLOCKS)
+    {
+        printf("ERROR: %s is not a complete filesystem image\n", filename);
+        last_status = MFS_ERR_IO;
+        fclose(fp);
+        fp = NULL;
+        imageRelease();
+        return;
+    }
+
+    image_open = 1;
+    if(loadSuperblock() == -1)
+    {
+        fclose(fp);
+        fp = NULL;
+        imageRelease();
+        return;
+    }
+    checkOnOpen();
+}
+
+void closefs()
+{
+    if(image_open == 0)
+    {
+        printf("ERROR: Disk image is not open\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    if(fp != NULL)
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+
+    // Another open image, if there is one, becomes current
+    imageRelease();
+    if(image_open)
+    {
+        printf("Now using %s\n", image_name);
+    }
+}
+
+// Wait for an fcntl lock of type on len bytes of fd from start, 0 meaning to the end
+int sharedLock(int fd, short type, off_t start, off_t len)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    while(fcntl(fd, F_SETLKW, &lock) == -1)
+    {
+        if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Another process has changed the image: rebuild the name index and everything else derived
+// from it
+void sharedRefresh()
+{
+    imagePointers();
+    loadExtensions();
+    shared_generation = superblock->generation;
+}
+
+// Open filename in shared mode, see SHARED_WRITE
+void openShared(char * filename)
+{
+    if(!imageNameFits(filename))
+    {
+        return;
+    }
+
+    if(imageFind(filename) != -1)
+    {
+        printf("ERROR: %s is already open\n", filename);
+        last_status = MFS_ERR_EXISTS;
+        return;
+    }
+
+    size_t len = (size_t) NUM_BLOCKS * BLOCK_SIZE;
+    uint8_t mode = SHARED_WRITE;
+    int fd = open(filename, O_RDWR | O_CLOEXEC);
+    if(fd == -1 && (errno == EACCES || errno == EROFS || errno == EPERM))
+    {
+        mode = SHARED_READ_ONLY;
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+    }
+    if(fd == -1)
+    {
+        printf("ERROR. File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    if(isCompressedFile(fd))
+    {
+        printf("ERROR: %s is compressed, open it and savefs -u to share it\n", filename);
+        last_status = MFS_ERR_BAD_REQUEST;
+        close(fd);
+        return;
+    }
+
+    struct stat buf;
+    void * map = MAP_FAILED;
+    if(fstat(fd, &buf) == 0 && buf.st_size >= (off_t) len)
+    {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   mode == SHARED_WRITE ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    }
+    if(map == MAP_FAILED)
+    {
+        printf("ERROR: %s is not a complete filesystem image\n", filename);
+        last_status = MFS_ERR_IO;
+        close(fd);
+        return;
+    }
+
+    // The handle's anonymous buffer gives way to the file
+    if(imageAlloc(1) == -1)
+    {
+        printf("ERROR: Can not open more than %d images\n", MAX_IMAGES);
+        last_status = MFS_ERR_BAD_REQUEST;
+        munmap(map, len);
+        close(fd);
+        return;
+    }
+    munmap(data, len);
+    data = map;
+    images[current_image].data = map;
+    image_fd = fd;
+    shared_mode = mode;
+    imagePointers();
+
+    strcpy(image_name, filename);
+    image_open = 1;
+
+    // An old image is upgraded in place, so nobody else may be using it meanwhile
+    sharedLock(fd, mode == SHARED_WRITE ? F_WRLCK : F_RDLCK, 0, 0);
+    if(loadSuperblock() == -1)
+    {
+        imageRelease();
+        return;
+    }
+    shared_generation = superblock->generation;
+    checkOnOpen();
+    sharedLock(fd, F_UNLCK, 0, 0);
+
+    if(mode == SHARED_READ_ONLY)
+    {
+        printf("%s is shared read-only\n", filename);
+    }
+}
+
+int oneShotChanges(char ** args);
+
+short shared_lock_type;
+int   shared_lock_slot;
+
+// Lock the metadata of a shared current image for the command in token: shared for one that
+// only reads it, exclusive for one that can change it. Commands that only open, close or
+// switch images need no lock. Returns -1 when the command can not run.
+int sharedBegin(char ** token)
+{
+    static const char * unlocked[] = { "open", "createfs", "close", "use", "images", "quit",
+                                       NULL };
+    if(!image_open || !shared_mode || token[0] == NULL)
+    {
+        return 0;
+    }
+
+    int i;
+    for(i = 0; unlocked[i] != NULL; i++)
+    {
+        if(!strcmp(token[0], unlocked[i]))
+        {
+            return 0;
+        }
+    }
+
+    short type = oneShotChanges(token) ? F_WRLCK : F_RDLCK;
+    if(type == F_WRLCK && shared_mode == SHARED_READ_ONLY)
+    {
+        printf("ERROR: %s is shared read-only\n", image_name);
+        last_status = MFS_ERR_READ_ONLY;
+        return -1;
+    }
+
+    // The directory, superblock, inodes and maps, then the tables at the top, always in that
+    // order so two processes can not deadlock
+    if(sharedLock(image_fd, type, 0, (off_t) FIRST_DATA_BLOCK * BLOCK_SIZE) == -1 ||
+       sharedLock(image_fd, type, (off_t) superblock->meta_top * BLOCK_SIZE, 0) == -1)
+    {
+        printf("ERROR: Can not lock %s: %s\n", image_name, strerror(errno));
+        sharedLock(image_fd, F_UNLCK, 0, 0);
+        last_status = MFS_ERR_IO;
+        return -1;
+    }
+
+    shared_lock_fd = image_fd;
+    shared_lock_type = type;
+    shared_lock_slot = current_image;
+    if(superblock->generation != shared_generation)
+    {
+        sharedRefresh();
+    }
+    return 0;
+}
+
+// Release the lock taken by sharedBegin(), telling the other processes about any change
+void sharedEnd()
+{
+    if(shared_lock_fd == -1)
+    {
+        return;
+    }
+
+    if(shared_lock_type == F_WRLCK && current_image == shared_lock_slot)
+    {
+        shared_generation = ++superblock->generation;
+    }
+    sharedLock(shared_lock_fd, F_UNLCK, 0, 0);
+    shared_lock_fd = -1;
+}
+
+void list(char* attrib)
+{
+    int i;
+    int not_found = 1;
+    int list_hidden = 0;
+    int list_attributes = 0;
+
+    if(attrib == NULL)
+    {
+        // do nothing
+    }
+    else if(!strcmp(attrib, "-h"))
+    {
+        list_hidden = 1;
+    }
+    else if(!strcmp(attrib, "-a"))
+    {
+        list_attributes = 1;
+    }
+    else
+    {
+        printf("ERROR: Incorrect parameter %s.\n", attrib);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+    
+
+    for(i = 0; i < num_files; i++)
+    {
+        //\TODO Add a checm to not list if the file is hidden
+        if(entryLive(i))
+        {
+            not_found = 0;
+            char filename[65];
+            uint32_t inode_index = dirEntry(i)->inode;
+
+            memset(filename, 0, 65);
+            snprintf(filename, sizeof(filename), "%.64s", dirEntry(i)->filename);
+ /*
+                +h +r 1
+                +h 1
+                +r 1
+                nothing: 0
+            
+            */
+
+
+            if(((inodeInfo(inode_index)->attribute & HIDDEN) != 1) && (list_attributes))
+            {
+                printf("%s\tAttribute: ", filename);
+                        
+                for (int i = 7; i >= 0; i--) {
+                    uint8_t mask = 1 << i;
+                    uint8_t bit = (inodeInfo(inode_index)->attribute & mask) >> i;
+                    printf("%d", bit);
+                }
+
+                printf("\n");
+            
+
+            }
+            else if((inodeInfo(inode_index)->attribute & HIDDEN) != 1)
+            {
+                printf("%s\n", filename);
+
+            }
+            else if(list_hidden)
+            {
+                printf("%s\n", filename);
+            }
+
+        }
+
+    }
+
+    if(not_found)
+    {
+        printf("ERROR: No files found.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+    }
+}
+
+// read() until len bytes arrive or the input ends. Returns the byte count, or -1 on error.
+ssize_t readFull(int fd, void * buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = read(fd, (uint8_t*) buf + done, len - done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n < 0)
+        {
+            return -1;
+        }
+        if(n == 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// write() all len bytes. Returns 0, or -1 on error.
+int writeFull(int fd, const void * buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = write(fd, (const uint8_t*) buf + done, len - done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// A host descriptor read or written through an optional buffer, so a stream of many small
+// files costs a few large read() or write() calls rather than one per block
+#define STREAM_BUFFER (1 << 20)
+
+struct stream
+{
+    int       fd;
+    uint8_t * buf;      // NULL for an unbuffered stream
+    size_t    pos;
+    size_t    len;
+};
+
+struct stream streamFd(int fd)
+{
+    struct stream st = { fd, NULL, 0, 0 };
+    return st;
+}
+
+// Returns a buffered stream on fd, or an unbuffered one if there is no memory for the buffer
+struct stream streamOpen(int fd)
+{
+    struct stream st = { fd, malloc(STREAM_BUFFER), 0, 0 };
+    return st;
+}
+
+// A stream that reads the len bytes at buf and then reports an error. streamClose() frees buf.
+struct stream streamBuffer(uint8_t * buf, size_t len)
+{
+    struct stream st = { -1, buf, 0, len };
+    return st;
+}
+
+// Like readFull(): returns the byte count, short only at the end of the input, or -1
+ssize_t streamRead(struct stream * st, void * buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        if(st->pos == st->len)
+        {
+            // Large reads skip the buffer once it is empty
+            if(st->buf == NULL || len - done >= STREAM_BUFFER)
+            {
+                ssize_t got = readFull(st->fd, (uint8_t*) buf + done, len - done);
+                return got < 0 ? -1 : (ssize_t) (done + got);
+            }
+
+            ssize_t got = read(st->fd, st->buf, STREAM_BUFFER);
+            if(got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(got <= 0)
+            {
+                return got < 0 ? -1 : (ssize_t) done;
+            }
+            st->pos = 0;
+            st->len = got;
+        }
+
+        size_t bytes = st->len - st->pos < len - done ? st->len - st->pos : len - done;
+        memcpy((uint8_t*) buf + done, st->buf + st->pos, bytes);
+        st->pos += bytes;
+        done += bytes;
+    }
+    return done;
+}
+
+int streamFlush(struct stream * st)
+{
+    int ret = st->buf != NULL && st->len ? writeFull(st->fd, st->buf, st->len) : 0;
+    st->len = 0;
+    return ret;
+}
+
+// Like writeFull(): returns 0, or -1 on error
+int streamWrite(struct stream * st, const void * buf, size_t len)
+{
+    if(st->buf == NULL)
+    {
+        return writeFull(st->fd, buf, len);
+    }
+
+    if(st->len + len > STREAM_BUFFER && streamFlush(st) == -1)
+    {
+        return -1;
+    }
+
+    if(len >= STREAM_BUFFER)
+    {
+        return writeFull(st->fd, buf, len);
+    }
+
+    memcpy(st->buf + st->len, buf, len);
+    st->len += len;
+    return 0;
+}
+
+void streamClose(struct stream * st)
+{
+    free(st->buf);
+    st->buf = NULL;
+}
+
+#define SIZE_UNKNOWN UINT32_MAX
+
+// Copy size bytes read from in into a new file called name, or everything up to the end of in
+// when size is SIZE_UNKNOWN. Returns MFS_OK or an MFS_ERR_* status. A copy that fails part way
+// gives back every block and the inode it took.
+int32_t insertStream(struct stream * in, const char * name, uint32_t size)
+{
+    if(strlen(name) > MAX_FILENAME)
+    {
+        return MFS_ERR_NAME;
+    }
+
+    // Input of unknown length is read a block at a time before it is placed, so a short block
+    // is known to be the last one. Input shorter than a block is then known whole and stored
+    // like any other small file.
+    uint8_t chunk_buf[BLOCK_SIZE];
+    ssize_t ahead = -1;
+    struct stream whole;
+    if(size == SIZE_UNKNOWN)
+    {
+        ahead = streamRead(in, chunk_buf, BLOCK_SIZE);
+        if(ahead < 0)
+        {
+            return MFS_ERR_IO;
+        }
+        if(ahead < BLOCK_SIZE)
+        {
+            size = ahead;
+            whole = streamBuffer(chunk_buf, ahead);
+            in = &whole;
+            ahead = -1;
+        }
+    }
+    int piped = size == SIZE_UNKNOWN;
+
+    if(!piped && size > MAX_FILE_SIZE)
+    {
+        return MFS_ERR_TOO_LARGE;
+    }
+
+    if(findFile(name) != -1)
+    {
+        return MFS_ERR_EXISTS;
+    }
+
+    // find an empty directory entry and inode
+    int32_t directory_entry;
+    int32_t inode_index;
+    int32_t status = allocFile(&directory_entry, &inode_index);
+    if(status != MFS_OK)
+    {
+        return status;
+    }
+
+    // Piped input is checked against the free space block by block as it arrives
+    int inline_file = size > 0 && size <= inlineMax(inode_index);
+    uint32_t blocks = inline_file || piped ? 0 : BLOCKS_FOR(size);
+    if((uint64_t) (blocks + mapsFor(inode_index, blocks)) * BLOCK_SIZE > df())
+    {
+        setInodeFree(inode_index, 1);
+        return MFS_ERR_NO_SPACE;
+    }
+
+    inodeInfo(inode_index)->tail = 0;
+    clearFileBlocks(inode_index);
+
+    if(inline_file)
+    {
+        if(streamRead(in, inlineData(inode_index), size) != size)
+        {
+            clearFileBlocks(inode_index);
+            setInodeFree(inode_index, 1);
+            return MFS_ERR_IO;
+        }
+        inodeInfo(inode_index)->tail = TAIL_INLINE;
+    }
+
+    // Copy the input one BLOCK_SIZE chunk at a time straight into free data blocks. A short
+    // last chunk goes into a tail block shared with other files.
+    uint32_t copied = inline_file ? size : 0;
+    int32_t block_count = 0;
+    while(copied < size)
+    {
+        uint32_t chunk = size - copied < BLOCK_SIZE ? size - copied : BLOCK_SIZE;
+        if(piped)
+        {
+            ssize_t got = ahead >= 0 ? ahead : streamRead(in, chunk_buf, BLOCK_SIZE);
+            ahead = -1;
+            if(got <= 0 || copied + got > MAX_FILE_SIZE)
+            {
+                status = got < 0 ? MFS_ERR_IO : got > 0 ? MFS_ERR_TOO_LARGE : MFS_OK;
+                break;
+            }
+            chunk = got;
+        }
+
+        uint32_t slot = 0;
+        int packed = chunk <= TAIL_MAX && block_refs != NULL;
+        int32_t block_index = packed ? packTail(chunk, &slot) : findFreeBlock();
+        if(block_index == -1)
+        {
+            status = MFS_ERR_NO_SPACE;
+            break;
+        }
+
+        status = setFileBlock(inode_index, block_count, block_index);
+        if(status != MFS_OK)
+        {
+            releaseBlock(block_index);
+            break;
+        }
+        block_count++;
+
+        uint8_t * block = packed ? getBlock(block_index) : newBlock(block_index);
+        if(block == NULL)
+        {
+            status = MFS_ERR_IO;
+            break;
+        }
+        ssize_t got = chunk;
+        if(piped)
+        {
+            memcpy(block + slot * TAIL_SLOT, chunk_buf, chunk);
+        }
+        else
+        {
+            got = streamRead(in, block + slot * TAIL_SLOT, chunk);
+        }
+        putBlock(block_index, 1);
+        if(got != chunk)
+        {
+            status = MFS_ERR_IO;
+            break;
+        }
+
+        inodeInfo(inode_index)->tail = packed ? slot + 1 : 0;
+        copied += chunk;
+    }
+
+    if(status != MFS_OK)
+    {
+        int32_t i;
+        for(i = 0; i < block_count; i++)
+        {
+            releaseBlock(fileBlock(inode_index, i));
+            setFileBlock(inode_index, i, -1);
+        }
+        releaseMaps(inode_index, 0, 0);
+        inodeInfo(inode_index)->tail = 0;
+        setInodeFree(inode_index, 1);
+        return status;
+    }
+
+    // place the file info in the directory
+    dirEntry(directory_entry)->in_use = 1;
+    dirEntry(directory_entry)->inode = inode_index;
+    memset(dirEntry(directory_entry)->filename, 0, MAX_FILENAME);
+    strncpy(dirEntry(directory_entry)->filename, name, MAX_FILENAME);
+
+    inodeInfo(inode_index)->file_size = copied;
+    inodeInfo(inode_index)->attribute = 0x0;
+    inodeInfo(inode_index)->in_use = 1;
+    indexAdd(directory_entry);
+
+    return MFS_OK;
+}
+
+int32_t insertfd(int fd, const char * name, uint32_t size)
+{
+    struct stream in = streamFd(fd);
+    return insertStream(&in, name, size);
+}
+
+void insert(char * filename)
+{
+    // verify the filename isn't NULL
+    if(filename == NULL)
+    {
+        printf("ERROR: Filename is NULL\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    // verify the file exists
+    struct stat buf;
+    int ret = stat(filename, &buf);
+
+    if(ret == -1)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    // verify the file is not too big before opening it
+    if(buf.st_size > MAX_FILE_SIZE)
+    {
+        printf("ERROR: File is too large.\n");
+        last_status = MFS_ERR_TOO_LARGE;
+        return;
+    }
+
+    // Open the input file read-only 
+    int ifd = open(filename, O_RDONLY);
+    if(ifd == -1)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    printf("Reading %d bytes from %s\n", (int) buf . st_size, filename);
+
+    int32_t status = insertfd(ifd, filename, buf.st_size);
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+
+    // We are done copying from the input file so close it out.
+    close(ifd);
+}
+
+// insert - <name> stores standard input as name, however long it turns out to be
+void insertStdin(char * name)
+{
+    if(name == NULL)
+    {
+        printf("ERROR: insert - needs a name for the file\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    struct stream in = streamOpen(STDIN_FILENO);
+    int32_t status = insertStream(&in, name, SIZE_UNKNOWN);
+    streamClose(&in);
+
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+    else
+    {
+        printf("Read %u bytes from standard input\n",
+               inodeInfo(dirEntry(findFile(name))->inode)->file_size);
+    }
+    last_status = status;
+}
+
+// Delete the file called filename. Its blocks and inode go back to the free maps, but the
+// block list is kept so undel can bring the file back while nothing has reused them.
+int32_t removeFile(const char * filename)
+{
+    int32_t delete_index = findFile(filename);
+
+    if(delete_index == -1)
+    {
+        return MFS_ERR_NOT_FOUND;
+    }
+
+    uint32_t inode_index = dirEntry(delete_index)->inode;
+    if((inodeInfo(inode_index)->attribute & READ_ONLY) == 2)
+    {
+        return MFS_ERR_READ_ONLY;
+    }
+
+    indexRemove(delete_index);
+    dirEntry(delete_index)->in_use = 0;
+    inodeInfo(inode_index)->in_use = 0;
+    setInodeFree(inode_index, 1);
+    if(inode_index >= NUM_FILES && (int32_t) inode_index < ext_free)
+    {
+        ext_free = inode_index;
+    }
+
+    // A reservation is given back for good; undel only brings back the file's data
+    releaseReserved(inode_index);
+    uint32_t i;
+    for(i = 0; i < blockCount(inode_index) && fileBlock(inode_index, i) != -1; i++)
+    {
+        releaseBlock(fileBlock(inode_index, i));
+    }
+    releaseMaps(inode_index, 0, 1);
+
+    return MFS_OK;
+}
+
+void delete(char* filename)
+{
+    if(filename == NULL)
+    {
+        printf("ERROR: Filename not specified.\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    int32_t status = removeFile(filename);
+
+    if(status == MFS_ERR_NOT_FOUND)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+    }
+    else if(status == MFS_ERR_READ_ONLY)
+    {
+        printf("ERROR: %s is read-only.\n", filename);
+        last_status = MFS_ERR_READ_ONLY;
+    }
+}
+
+void undel(char* filename)
+{
+    if(filename == NULL)
+    {
+        printf("ERROR: Filename not specified.\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+    
+    if(findFile(filename) != -1)
+    {
+        printf("ERROR: %s is not deleted.\n", filename);
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    int undelete_index = -1;
+    for(int i = 0; i < num_files; i++)
+    {
+        if(!dirEntry(i)->in_use && dirEntry(i)->inode >= 0 && dirEntry(i)->inode < num_files &&
+           strncmp(filename, dirEntry(i)->filename, MAX_FILENAME) == 0)
+        {
+            undelete_index = i;
+            break;
+        }
+        
+    }
+
+    if(undelete_index == -1)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    // The file can only come back if its inode and every one of its blocks are still free. A
+    // packed tail counts too, so a file whose tail block other files still use stays deleted.
+    uint32_t inode_index = dirEntry(undelete_index)->inode;
+    uint32_t i;
+    int recoverable = inodeFree(inode_index);
+    uint32_t k;
+    for(k = 0; inode_index >= NUM_FILES && !isInline(inode_index) && k < EXT_MAPS; k++)
+    {
+        int32_t map = extFile(inode_index)->maps[k];
+        recoverable = recoverable && (!validDataBlock(map) || free_blocks[map]);
+    }
+    for(i = 0; i < blockCount(inode_index) && fileBlock(inode_index, i) != -1; i++)
+    {
+        recoverable = recoverable && free_blocks[fileBlock(inode_index, i)];
+    }
+
+    if(!recoverable)
+    {
+        printf("ERROR: %s has been overwritten and can not be recovered.\n", filename);
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    for(i = 0; i < blockCount(inode_index) && fileBlock(inode_index, i) != -1; i++)
+    {
+        refBlock(fileBlock(inode_index, i));
+    }
+    for(k = 0; inode_index >= NUM_FILES && !isInline(inode_index) && k < EXT_MAPS; k++)
+    {
+        int32_t map = extFile(inode_index)->maps[k];
+        if(validDataBlock(map))
+        {
+            refBlock(map);
+            pinBlock(map);
+        }
+    }
+    setInodeFree(inode_index, 0);
+
+    dirEntry(undelete_index)->in_use = 1;
+    inodeInfo(inode_index)->in_use = 1;
+    indexAdd(undelete_index);
+}
+
+// Create dst as a copy of src that shares all of src's data blocks. Each block gains a
+// reference, so it is copied only when one of the two files later writes to it. Only an
+// extension inode's map blocks are new. Returns MFS_OK or an MFS_ERR_* status.
+int32_t clonefile(const char * src, const char * dst)
+{
+    if(strlen(dst) > MAX_FILENAME)
+    {
+        return MFS_ERR_NAME;
+    }
+
+    int32_t src_entry = findFile(src);
+    if(src_entry == -1)
+    {
+        return MFS_ERR_NOT_FOUND;
+    }
+
+    if(findFile(dst) != -1)
+    {
+        return MFS_ERR_EXISTS;
+    }
+
+    // Sharing needs the reference count table, and a count that can go one higher
+    int32_t src_inode = dirEntry(src_entry)->inode;
+    uint32_t size = inodeInfo(src_inode)->file_size;
+    uint32_t blocks = blockCount(src_inode);
+    uint32_t index;
+    for(index = 0; block_refs != NULL && index < blocks; index++)
+    {
+        if(block_refs[fileBlock(src_inode, index)] == UINT16_MAX)
+        {
+            break;
+        }
+    }
+    if(block_refs == NULL || index < blocks)
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    int32_t entry;
+    int32_t inode;
+    int32_t status = allocFile(&entry, &inode);
+    if(status != MFS_OK)
+    {
+        return status;
+    }
+
+    // An inline file is copied; one too big for the new inode's inline space gets a block
+    int copy_out = isInline(src_inode) && size > inlineMax(inode);
+    if((uint64_t) (mapsFor(inode, blocks) + copy_out) * BLOCK_SIZE > df())
+    {
+        setInodeFree(inode, 1);
+        return MFS_ERR_NO_SPACE;
+    }
+
+    inodeInfo(inode)->tail = inodeInfo(src_inode)->tail;
+    clearFileBlocks(inode);
+    if(copy_out)
+    {
+        int32_t block = findFreeBlock();
+        uint8_t * p = newBlock(block);
+        if(p == NULL)
+        {
+            releaseBlock(block);
+            setInodeFree(inode, 1);
+            return MFS_ERR_IO;
+        }
+        memset(p, 0, BLOCK_SIZE);
+        memcpy(p, inlineData(src_inode), size);
+        putBlock(block, 1);
+        inodeInfo(inode)->tail = 0;
+        setFileBlock(inode, 0, block);
+    }
+    else if(isInline(src_inode))
+    {
+        memcpy(inlineData(inode), inlineData(src_inode), size);
+    }
+
+    for(index = 0; index < blocks; index++)
+    {
+        int32_t block = fileBlock(src_inode, index);
+        status = setFileBlock(inode, index, block);
+        if(status != MFS_OK)
+        {
+            break;
+        }
+        refBlock(block);
+    }
+
+    if(status != MFS_OK)
+    {
+        uint32_t i;
+        for(i = 0; i < index; i++)
+        {
+            releaseBlock(fileBlock(inode, i));
+            setFileBlock(inode, i, -1);
+        }
+        releaseMaps(inode, 0, 0);
+        inodeInfo(inode)->tail = 0;
+        setInodeFree(inode, 1);
+        return status;
+    }
+
+    dirEntry(entry)->in_use = 1;
+    dirEntry(entry)->inode = inode;
+    memset(dirEntry(entry)->filename, 0, MAX_FILENAME);
+    strncpy(dirEntry(entry)->filename, dst, MAX_FILENAME);
+
+    inodeInfo(inode)->file_size = size;
+    inodeInfo(inode)->attribute = 0x0;
+    inodeInfo(inode)->in_use = 1;
+    indexAdd(entry);
+
+    return MFS_OK;
+}
+
+void clonecmd(char * src, char * dst)
+{
+    int32_t status = clonefile(src, dst);
+    last_status = status;
+    if(status == MFS_ERR_NO_SPACE && block_refs == NULL)
+    {
+        printf("ERROR: %s has no reference count table, so blocks can not be shared.\n",
+               image_name);
+    }
+    else if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+}
+
+// Write len bytes starting at offset of the file at directory index entry to out
+int32_t writeRangeTo(int32_t entry, uint32_t offset, uint32_t len, struct stream * out)
+{
+    int32_t file_inode = dirEntry(entry)->inode;
+    if(offset > inodeInfo(file_inode)->file_size || len > inodeInfo(file_inode)->file_size - offset)
+    {
+        return MFS_ERR_RANGE;
+    }
+
+    while(len > 0)
+    {
+        // Save off the current block within our inode that has our data
+        uint32_t index = offset / BLOCK_SIZE;
+        uint32_t block_offset = offset % BLOCK_SIZE;
+        uint32_t bytes = BLOCK_SIZE - block_offset < len ? BLOCK_SIZE - block_offset : len;
+
+        const uint8_t * block;
+        int32_t status = getFileBytes(file_inode, index, &block);
+        if(status == MFS_OK && streamWrite(out, block + block_offset, bytes) == -1)
+        {
+            status = MFS_ERR_IO;
+        }
+        putFileBytes(file_inode, index);
+        if(status != MFS_OK)
+        {
+            return status;
+        }
+
+        offset += bytes;
+        len -= bytes;
+    }
+
+    return MFS_OK;
+}
+
+int32_t writeRange(int32_t entry, uint32_t offset, uint32_t len, int fd)
+{
+    struct stream out = streamFd(fd);
+    return writeRangeTo(entry, offset, len, &out);
+}
+
+// Write the whole of the file at directory index entry to fd
+int32_t retrievefd(int32_t entry, int fd)
+{
+    return writeRange(entry, 0, inodeInfo(dirEntry(entry)->inode)->file_size, fd);
+}
+
+// Copy len bytes starting at offset of the file at directory index entry into buf
+int32_t readfile(int32_t entry, uint32_t offset, uint32_t len, uint8_t * buf)
+{
+    int32_t file_inode = dirEntry(entry)->inode;
+    if(offset > inodeInfo(file_inode)->file_size || len > inodeInfo(file_inode)->file_size - offset)
+    {
+        return MFS_ERR_RANGE;
+    }
+
+    while(len > 0)
+    {
+        uint32_t index = offset / BLOCK_SIZE;
+        uint32_t block_offset = offset % BLOCK_SIZE;
+        uint32_t bytes = BLOCK_SIZE - block_offset < len ? BLOCK_SIZE - block_offset : len;
+
+        const uint8_t * block;
+        int32_t status = getFileBytes(file_inode, index, &block);
+        if(status == MFS_OK)
+        {
+            memcpy(buf, block + block_offset, bytes);
+        }
+        putFileBytes(file_inode, index);
+        if(status != MFS_OK)
+        {
+            return status;
+        }
+
+        buf += bytes;
+        offset += bytes;
+        len -= bytes;
+    }
+
+    return MFS_OK;
+}
+
+void retrieve(char* filename, char* new_filename)
+{
+  int directory_location = findFile(filename);
+
+  if(directory_location == -1)
+  {
+    printf("ERROR: File not found\n");
+    last_status = MFS_ERR_NOT_FOUND;
+    return;
+  }
+
+  char * out = new_filename != NULL ? new_filename : filename;
+  int ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(ofd == -1)
+  {
+    printf("ERROR: Can not create the output file\n");
+    last_status = MFS_ERR_IO;
+    return;
+  }
+
+  int32_t status = retrievefd(directory_location, ofd);
+  if(status == MFS_ERR_CORRUPT)
+  {
+    printf("ERROR: %s.\n", mfs_strerror(status));
+    last_status = status;
+  }
+  else if(status != MFS_OK)
+  {
+    printf("ERROR: An error occurred writing to the specified file\n");
+    last_status = MFS_ERR_IO;
+  }
+
+  close(ofd);
+  // A partial copy of a damaged file is worse than none
+  if(status != MFS_OK)
+  {
+    unlink(out);
+  }
+}
+
+// Write filename to standard output, a megabyte at a time
+void cat(char * filename)
+{
+    int32_t entry = findFile(filename);
+    if(entry == -1)
+    {
+        printf("ERROR: File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    // Anything printf() holds has to come out before the file
+    fflush(stdout);
+    struct stream out = streamOpen(stdout_fd);
+    int32_t status = writeRangeTo(entry, 0, inodeInfo(dirEntry(entry)->inode)->file_size, &out);
+    if(status == MFS_OK && streamFlush(&out) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+    streamClose(&out);
+
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+    }
+    last_status = status;
+}
+
+// List the open images, marking the current one
+void imageList()
+{
+    imageStore();
+    int i;
+    for(i = 0; i < MAX_IMAGES; i++)
+    {
+        if(images[i].data != NULL)
+        {
+            printf("%c %s%s\n", i == current_image ? '*' : ' ', images[i].name,
+                   images[i].cache_mode ? " (block cache)" :
+                   images[i].compressed ? " (compressed)" : "");
+        }
+    }
+}
+
+void useImage(char * name)
+{
+    int slot = imageFind(name);
+    if(slot == -1)
+    {
+        printf("ERROR: %s is not open\n", name);
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+    imageSwitch(slot);
+}
+
+// Copy filename from the current image into the open image target, as new_name if given. The
+// data goes from one image's blocks to the other's through a buffer, not the host filesystem.
+void copyfile(char * filename, char * target, char * new_name)
+{
+    int32_t entry = findFile(filename);
+    if(entry == -1)
+    {
+        printf("ERROR: File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    int slot = imageFind(target);
+    if(slot == -1)
+    {
+        printf("ERROR: %s is not open\n", target);
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    uint32_t size = inodeInfo(dirEntry(entry)->inode)->file_size;
+    uint8_t attribute = inodeInfo(dirEntry(entry)->inode)->attribute;
+    uint8_t * buf = malloc(size ? size : 1);
+    if(buf == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        return;
+    }
+
+    int32_t status = readfile(entry, 0, size, buf);
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+        free(buf);
+        return;
+    }
+
+    const char * name = new_name != NULL ? new_name : filename;
+    int source = current_image;
+    imageSwitch(slot);
+
+    struct stream in = streamBuffer(buf, size);
+    status = insertStream(&in, name, size);
+    if(status == MFS_OK)
+    {
+        inodeInfo(dirEntry(findFile(name))->inode)->attribute = attribute;
+    }
+    streamClose(&in);
+
+    imageSwitch(source);
+    last_status = status;
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+    }
+}
+
+// Returns the data block holding block number index of inode, ready to be changed. A block
+// shared with a snapshot is copied first, and a zeroed block is allocated when the file does
+// not reach that far yet. Returns -1 when the image is full or a block can not be brought
+// into the block cache.
+int32_t fileBlockForWrite(int32_t inode, int32_t index)
+{
+    int32_t old_block = fileBlock(inode, index);
+    if(old_block != -1 && !isShared(old_block))
+    {
+        // A reserved block past the end of the file is unwritten and must read as zeros
+        if((uint32_t) index >= blockCount(inode))
+        {
+            uint8_t * p = newBlock(old_block);
+            if(p == NULL)
+            {
+                return -1;
+            }
+            memset(p, 0, BLOCK_SIZE);
+            putBlock(old_block, 1);
+        }
+        return old_block;
+    }
+
+    int32_t block_index = findFreeBlock();
+    if(block_index == -1)
+    {
+        return -1;
+    }
+
+    if(setFileBlock(inode, index, block_index) != MFS_OK)
+    {
+        releaseBlock(block_index);
+        return -1;
+    }
+
+    uint8_t * p = newBlock(block_index);
+    const uint8_t * src = p != NULL && old_block != -1 ? getBlock(old_block) : NULL;
+    if(p == NULL || (old_block != -1 && src == NULL))
+    {
+        putBlock(block_index, 0);
+        setFileBlock(inode, index, old_block);
+        releaseBlock(block_index);
+        return -1;
+    }
+
+    if(old_block != -1)
+    {
+        memcpy(p, src, BLOCK_SIZE);
+        putBlock(old_block, 0);
+        releaseBlock(old_block);
+    }
+    else
+    {
+        memset(p, 0, BLOCK_SIZE);
+    }
+    putBlock(block_index, 1);
+    return block_index;
+}
+
+// Make sure the file at directory index entry can be changed to new_size bytes with its
+// existing blocks first up to last rewritten: it must be writable, within the size limit, and
+// the image must hold the blocks it would gain and the copies of rewritten shared blocks.
+int32_t checkResize(int32_t entry, uint64_t new_size, uint32_t first, uint32_t last)
+{
+    int32_t inode = dirEntry(entry)->inode;
+
+    if(inodeInfo(inode)->attribute & READ_ONLY)
+    {
+        return MFS_ERR_READ_ONLY;
+    }
+
+    if(new_size > MAX_FILE_SIZE)
+    {
+        return MFS_ERR_TOO_LARGE;
+    }
+
+    // A packed or inline file first needs a block of its own for its last bytes. Growing into
+    // reserved blocks takes nothing more.
+    uint32_t have = BLOCKS_FOR(inodeInfo(inode)->file_size) + reservedBlocks(inode);
+    uint32_t own = ownBlocks(inode);
+    uint32_t need = BLOCKS_FOR(new_size);
+    uint32_t extra = need > have ? need - have : 0;
+    extra += need > have ? mapsFor(inode, need) - mapsFor(inode, have) : 0;
+    extra += inodeInfo(inode)->tail != 0;
+    for(; first < last && first < own; first++)
+    {
+        extra += isShared(fileBlock(inode, first));
+    }
+
+    if(extra * BLOCK_SIZE > df())
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    return MFS_OK;
+}
+
+// Overwrite len bytes at offset of the file at directory index entry, taking them from buf or,
+// when buf is NULL, reading them from fd. Only the blocks in the range are touched; the file
+// grows (zero filled past its old end) when the range runs beyond it.
+int32_t writeData(int32_t entry, uint32_t offset, const uint8_t * buf, int fd, uint32_t len)
+{
+    int32_t inode = dirEntry(entry)->inode;
+    uint64_t end = (uint64_t) offset + len;
+    uint32_t size = inodeInfo(inode)->file_size;
+
+    uint32_t first_changed = (offset < size ? offset : size) / BLOCK_SIZE;
+    int32_t status = checkResize(entry, end > size ? end : size, first_changed, BLOCKS_FOR(end));
+    if(status == MFS_OK)
+    {
+        status = unpackFile(inode);
+    }
+    if(status != MFS_OK)
+    {
+        return status;
+    }
+
+    // Bytes between the old end of file and offset must read back as zeros, including any
+    // stale bytes left in the last block by an earlier truncate
+    if(offset > size && size % BLOCK_SIZE)
+    {
+        int32_t last = fileBlockForWrite(inode, size / BLOCK_SIZE);
+        uint32_t stop = offset / BLOCK_SIZE == size / BLOCK_SIZE ? offset % BLOCK_SIZE
+                                                                  : BLOCK_SIZE;
+        uint8_t * p = last == -1 ? NULL : getBlock(last);
+        if(p == NULL)
+        {
+            return MFS_ERR_IO;
+        }
+        memset(p + size % BLOCK_SIZE, 0, stop - size % BLOCK_SIZE);
+        putBlock(last, 1);
+    }
+
+    uint32_t index;
+    for(index = BLOCKS_FOR(size); index < BLOCKS_FOR(offset); index++)
+    {
+        if(fileBlockForWrite(inode, index) == -1)
+        {
+            return MFS_ERR_IO;
+        }
+    }
+
+    while(len > 0)
+    {
+        int32_t block_index = fileBlockForWrite(inode, offset / BLOCK_SIZE);
+        uint32_t block_offset = offset % BLOCK_SIZE;
+        uint32_t bytes = BLOCK_SIZE - block_offset < len ? BLOCK_SIZE - block_offset : len;
+
+        // A block that is overwritten completely does not need to be read first
+        uint8_t * block = block_index == -1 ? NULL :
+                          bytes == BLOCK_SIZE ? newBlock(block_index) : getBlock(block_index);
+        if(block == NULL)
+        {
+            status = MFS_ERR_IO;
+            break;
+        }
+        ssize_t got = bytes;
+        if(buf != NULL)
+        {
+            memcpy(block + block_offset, buf, bytes);
+            buf += bytes;
+        }
+        else
+        {
+            got = readFull(fd, block + block_offset, bytes);
+        }
+        putBlock(block_index, 1);
+
+        if(got != bytes)
+        {
+            status = MFS_ERR_IO;
+            break;
+        }
+
+        offset += bytes;
+        len -= bytes;
+    }
+
+    if(offset > inodeInfo(inode)->file_size)
+    {
+        inodeInfo(inode)->file_size = offset;
+    }
+
+    return status;
+}
+
+// Cut the file at directory index entry down to size bytes, giving back the blocks past the
+// new end, or grow it with zeros.
+int32_t truncatefile(int32_t entry, uint32_t size)
+{
+    int32_t inode = dirEntry(entry)->inode;
+    uint32_t old_size = inodeInfo(inode)->file_size;
+
+    if(size > old_size)
+    {
+        return writeData(entry, size, (const uint8_t*) "", -1, 0);
+    }
+
+    int32_t status = checkResize(entry, size, 0, 0);
+    if(status == MFS_OK)
+    {
+        status = unpackFile(inode);
+    }
+    if(status != MFS_OK)
+    {
+        return status;
+    }
+
+    // Cutting a file gives back its reservation too
+    releaseReserved(inode);
+    uint32_t index;
+    for(index = BLOCKS_FOR(size); index < BLOCKS_FOR(old_size); index++)
+    {
+        releaseBlock(fileBlock(inode, index));
+        setFileBlock(inode, index, -1);
+    }
+    releaseMaps(inode, mapsFor(inode, BLOCKS_FOR(size)), 0);
+
+    inodeInfo(inode)->file_size = size;
+    return MFS_OK;
+}
+
+// Turn a string of hex digits, optionally starting with 0x, into bytes. Returns the number of
+// bytes, or -1 if the string is not hex.
+int32_t parseHex(const char * text, uint8_t * out, uint32_t max)
+{
+    if(!strncmp(text, "0x", 2) || !strncmp(text, "0X", 2))
+    {
+        text += 2;
+    }
+
+    size_t len = strlen(text);
+    if(len == 0 || len % 2 || len / 2 > max)
+    {
+        return -1;
+    }
+
+    uint32_t i;
+    for(i = 0; i < len / 2; i++)
+    {
+        unsigned int byte;
+        if(!isxdigit((unsigned char) text[2 * i]) || !isxdigit((unsigned char) text[2 * i + 1])
+           || sscanf(&text[2 * i], "%2x", &byte) != 1)
+        {
+            return -1;
+        }
+        out[i] = byte;
+    }
+    return len / 2;
+}
+
+// write <file> <offset> <hostfile|hexbytes>
+void writefile(char * filename, char * offset_text, char * source)
+{
+    int32_t entry = findFile(filename);
+    if(entry == -1)
+    {
+        printf("ERROR: File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    char * end;
+    unsigned long offset = strtoul(offset_text, &end, 0);
+    if(*end != '\0' || offset > MAX_FILE_SIZE)
+    {
+        printf("ERROR: Invalid offset %s\n", offset_text);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    int32_t status;
+    struct stat buf;
+    if(stat(source, &buf) == 0)
+    {
+        int ifd = open(source, O_RDONLY);
+        if(ifd == -1 || buf.st_size > MAX_FILE_SIZE)
+        {
+            printf("ERROR: Can not read %s\n", source);
+            last_status = MFS_ERR_IO;
+            if(ifd != -1)
+            {
+                close(ifd);
+            }
+            return;
+        }
+        status = writeData(entry, offset, NULL, ifd, buf.st_size);
+        close(ifd);
+    }
+    else
+    {
+        uint8_t bytes[MAX_COMMAND_SIZE / 2];
+        int32_t len = parseHex(source, bytes, sizeof(bytes));
+        if(len == -1)
+        {
+            printf("ERROR: %s is neither a file nor hex bytes\n", source);
+            last_status = MFS_ERR_BAD_REQUEST;
+            return;
+        }
+        status = writeData(entry, offset, bytes, -1, len);
+    }
+
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+}
+
+// append <file> <hostfile>
+void appendfile(char * filename, char * hostfile)
+{
+    int32_t entry = findFile(filename);
+    if(entry == -1)
+    {
+        printf("ERROR: File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    struct stat buf;
+    int ifd = open(hostfile, O_RDONLY);
+    if(ifd == -1 || fstat(ifd, &buf) == -1)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        if(ifd != -1)
+        {
+            close(ifd);
+        }
+        return;
+    }
+
+    int32_t status = MFS_ERR_TOO_LARGE;
+    if(buf.st_size <= MAX_FILE_SIZE)
+    {
+        status = writeData(entry, inodeInfo(dirEntry(entry)->inode)->file_size, NULL, ifd,
+                           buf.st_size);
+    }
+    close(ifd);
+
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+}
+
+// truncate <file> <size>
+void truncatecmd(char * filename, char * size_text)
+{
+    int32_t entry = findFile(filename);
+    if(entry == -1)
+    {
+        printf("ERROR: File not found\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    char * end;
+    unsigned long size = strtoul(size_text, &end, 0);
+    if(*end != '\0' || size > MAX_FILE_SIZE)
+    {
+        printf("ERROR: Invalid size %s\n", size_text);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    int32_t status = truncatefile(entry, size);
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+}
+
+// First block of a run of count free data blocks, trying want first, or -1
+int32_t findFreeRun(uint32_t count, int32_t want)
+{
+    int32_t block;
+    uint32_t run = 0;
+    for(block = want; block < superblock->meta_top && free_blocks[block] && run < count; block++)
+    {
+        run++;
+    }
+    if(run == count && want >= FIRST_DATA_BLOCK)
+    {
+        return want;
+    }
+
+    run = 0;
+    for(block = FIRST_DATA_BLOCK; block < superblock->meta_top; block++)
+    {
+        run = free_blocks[block] ? run + 1 : 0;
+        if(run == count)
+        {
+            return block - count + 1;
+        }
+    }
+    return -1;
+}
+
+// Reserve blocks so the file at directory index entry can grow to size bytes without taking
+// any more. The new blocks are one run of free blocks, right after the file's last block when
+// there is room; *runs says how many runs it took when free space is too fragmented for one.
+// Nothing is written to them. Returns MFS_OK or an MFS_ERR_* status.
+int32_t reserveFile(int32_t entry, uint32_t size, uint32_t * runs)
+{
+    int32_t inode = dirEntry(entry)->inode;
+    *runs = 0;
+
+    if(inodeInfo(inode)->attribute & READ_ONLY)
+    {
+        return MFS_ERR_READ_ONLY;
+    }
+
+    if(size > MAX_FILE_SIZE)
+    {
+        return MFS_ERR_TOO_LARGE;
+    }
+
+    // Reserved blocks follow blocks of the file's own, so a packed or inline file is given
+    // its own last block first
+    uint32_t have = BLOCKS_FOR(inodeInfo(inode)->file_size) + reservedBlocks(inode);
+    uint32_t need = BLOCKS_FOR(size);
+    if(need <= have)
+    {
+        return MFS_OK;
+    }
+
+    uint32_t count = need - have;
+    uint64_t extra = count + mapsFor(inode, need) - mapsFor(inode, have) +
+                     (inodeInfo(inode)->tail != 0);
+    if(extra * BLOCK_SIZE > df())
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    int32_t status = unpackFile(inode);
+    if(status != MFS_OK)
+    {
+        return status;
+    }
+
+    // Take the whole run before pointing the file at it, so a map block the file needs can
+    // not land in the middle of it
+    int32_t last = have ? fileBlock(inode, have - 1) : FIRST_DATA_BLOCK - 1;
+    int32_t start = findFreeRun(count, last + 1);
+    int32_t * blocks = malloc(count * sizeof(int32_t));
+    if(blocks == NULL)
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    uint32_t i;
+    for(i = 0; i < count; i++)
+    {
+        blocks[i] = start != -1 ? start + (int32_t) i : findFreeBlock();
+        if(blocks[i] == -1)
+        {
+            count = i;
+            status = MFS_ERR_NO_SPACE;
+            break;
+        }
+        if(start != -1)
+        {
+            refBlock(blocks[i]);
+        }
+        *runs += i == 0 || blocks[i] != blocks[i - 1] + 1;
+    }
+
+    for(i = 0; i < count && status == MFS_OK; i++)
+    {
+        status = setFileBlock(inode, have + i, blocks[i]);
+    }
+
+    if(status != MFS_OK)
+    {
+        for(i = 0; i < count; i++)
+        {
+            releaseBlock(blocks[i]);
+            setFileBlock(inode, have + i, -1);
+        }
+        releaseMaps(inode, mapsFor(inode, have), 0);
+    }
+    free(blocks);
+    return status;
+}
+
+// Reserve size bytes for filename, creating it empty when there is no such file. A file it
+// created is removed again if the reservation fails.
+int32_t fallocateFile(const char * filename, uint32_t size, uint32_t * runs)
+{
+    int32_t entry = findFile(filename);
+    int created = entry == -1;
+    *runs = 0;
+    if(created)
+    {
+        struct stream empty = streamBuffer(NULL, 0);
+        int32_t status = insertStream(&empty, filename, 0);
+        if(status != MFS_OK)
+        {
+            return status;
+        }
+        entry = findFile(filename);
+    }
+
+    int32_t status = reserveFile(entry, size, runs);
+    if(status != MFS_OK && created)
+    {
+        removeFile(filename);
+    }
+    return status;
+}
+
+// Parse a size argument of at most MAX_FILE_SIZE bytes. Returns -1 if it is not one.
+int64_t parseSize(const char * text)
+{
+    char * end;
+    unsigned long size = strtoul(text, &end, 0);
+    return *end != '\0' || *text == '\0' || size > MAX_FILE_SIZE ? -1 : (int64_t) size;
+}
+
+void printReserve(int32_t status, uint32_t runs)
+{
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+    else if(runs > 1)
+    {
+        printf("Free space is fragmented, the reservation is in %u pieces\n", runs);
+    }
+    last_status = status;
+}
+
+// fallocate <file> <size>
+void fallocatecmd(char * filename, char * size_text)
+{
+    int64_t size = parseSize(size_text);
+    if(size == -1)
+    {
+        printf("ERROR: Invalid size %s\n", size_text);
+        last_status = MFS_ERR_RANGE;
+        return;
+    }
+
+    uint32_t runs;
+    int32_t status = fallocateFile(filename, size, &runs);
+    printReserve(status, runs);
+}
+
+// insert --reserve <size> <file>: reserve size bytes for the new file first, so it and what
+// is later appended to it lie in one run
+void insertReserve(char * size_text, char * filename)
+{
+    struct stat buf;
+    if(stat(filename, &buf) == -1)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+    if(buf.st_size > MAX_FILE_SIZE)
+    {
+        printf("ERROR: File is too large.\n");
+        last_status = MFS_ERR_TOO_LARGE;
+        return;
+    }
+    if(findFile(filename) != -1)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(MFS_ERR_EXISTS));
+        last_status = MFS_ERR_EXISTS;
+        return;
+    }
+
+    // The reservation covers at least the file itself
+    int64_t size = parseSize(size_text);
+    if(size == -1)
+    {
+        printf("ERROR: Invalid size %s\n", size_text);
+        last_status = MFS_ERR_RANGE;
+        return;
+    }
+
+    uint32_t runs;
+    int32_t status = fallocateFile(filename, size > buf.st_size ? size : buf.st_size, &runs);
+    printReserve(status, runs);
+    if(last_status != MFS_OK)
+    {
+        return;
+    }
+
+    int ifd = open(filename, O_RDONLY);
+    status = MFS_ERR_IO;
+    if(ifd != -1)
+    {
+        printf("Reading %d bytes from %s\n", (int) buf.st_size, filename);
+        status = writeData(findFile(filename), 0, NULL, ifd, buf.st_size);
+        close(ifd);
+    }
+
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        removeFile(filename);
+    }
+    last_status = status;
+}
+
+// Run fn over [first, last) split into one contiguous range per core
+struct parallelJob
+{
+    int32_t first;
+    int32_t last;
+    void  (*fn)(int32_t first, int32_t last, void * arg);
+    void  * arg;
+};
+
+#define MAX_WORKERS 64
+
+int numWorkers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : (cpus > MAX_WORKERS ? MAX_WORKERS : cpus);
+}
+
+void * parallelRun(void * arg)
+{
+    struct parallelJob * job = arg;
+    job->fn(job->first, job->last, job->arg);
+    return NULL;
+}
+
+int parallelFor(int32_t first, int32_t last, void (*fn)(int32_t, int32_t, void *), void * arg)
+{
+    int num_threads = numWorkers();
+    if(num_threads > last - first)
+    {
+        num_threads = last - first > 0 ? last - first : 1;
+    }
+
+    pthread_t threads[MAX_WORKERS];
+    struct parallelJob jobs[MAX_WORKERS];
+    int started[MAX_WORKERS];
+    int t;
+
+    for(t = 0; t < num_threads; t++)
+    {
+        jobs[t].first = first + (int64_t) (last - first) * t / num_threads;
+        jobs[t].last = first + (int64_t) (last - first) * (t + 1) / num_threads;
+        jobs[t].fn = fn;
+        jobs[t].arg = arg;
+
+        // The last range runs on the calling thread, as does any that can not get a thread
+        started[t] = t < num_threads - 1 &&
+                     pthread_create(&threads[t], NULL, parallelRun, &jobs[t]) == 0;
+        if(!started[t])
+        {
+            parallelRun(&jobs[t]);
+        }
+    }
+
+    for(t = 0; t < num_threads; t++)
+    {
+        if(started[t])
+        {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    return num_threads;
+}
+
+struct scrubState
+{
+    uint8_t * bad;
+    uint32_t  checked;
+};
+
+// Contents of block for a scan that runs on several threads at once. With a block cache the
+// block is read straight from the image or the scratch file into buf, so the threads do not
+// contend for the cache; the cache has to be flushed before the scan starts. Returns NULL if
+// the read fails.
+const uint8_t * peekBlock(int32_t block, uint8_t * buf)
+{
+    if(!cache_mode || isPinned(block))
+    {
+        return data[block];
+    }
+    return cacheRead(block, buf) == -1 ? NULL : buf;
+}
+
+// The bytes of block number index of inode, through peekBlock()
+const uint8_t * peekFileBytes(int32_t inode, uint32_t index, uint8_t * buf)
+{
+    if(isInline(inode))
+    {
+        return inlineData(inode) + index * BLOCK_SIZE;
+    }
+
+    const uint8_t * p = peekBlock(fileBlock(inode, index), buf);
+    return p == NULL ? NULL : p + blockStart(inode, index);
+}
+
+// Check the in-use blocks from first up to last against their checksums
+void scrubRange(int32_t first, int32_t last, void * arg)
+{
+    struct scrubState * state = arg;
+    uint8_t buf[BLOCK_SIZE];
+    uint32_t checked = 0;
+    int32_t block;
+
+    for(block = first; block < last; block++)
+    {
+        if(free_blocks[block])
+        {
+            continue;
+        }
+
+        const uint8_t * p = peekBlock(block, buf);
+        if(p == NULL)
+        {
+            state->bad[block] = 1;
+            continue;
+        }
+
+        if(crc32c(p, BLOCK_SIZE) != block_crc[block])
+        {
+            state->bad[block] = 1;
+        }
+        checked++;
+    }
+
+    __atomic_fetch_add(&state->checked, checked, __ATOMIC_RELAXED);
+}
+
+// scrub: verify every in-use data block on all cores and name the files that are damaged
+void scrub()
+{
+    if(block_crc == NULL)
+    {
+        printf("ERROR: This image has no block checksums\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    // The scan reads blocks with peekBlock(), past the cache
+    if(cache_mode && cacheFlush() == -1)
+    {
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    struct scrubState state = { calloc(NUM_BLOCKS, 1), 0 };
+    uint8_t * bad = state.bad;
+    if(bad == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        return;
+    }
+
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int num_threads = parallelFor(FIRST_DATA_BLOCK, superblock->meta_top, scrubRange, &state);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Report damaged blocks by the file that owns them
+    uint32_t damaged = 0;
+    int i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(!entryLive(i))
+        {
+            continue;
+        }
+
+        int32_t inode = dirEntry(i)->inode;
+        uint32_t index;
+        for(index = 0; index < blockCount(inode); index++)
+        {
+            int32_t block = fileBlock(inode, index);
+            if(bad[block])
+            {
+                printf("%.64s: block %u (image block %d) is damaged\n",
+                       dirEntry(i)->filename, index, block);
+                bad[block] = 0;
+                damaged++;
+            }
+        }
+    }
+
+    int32_t block;
+    for(block = FIRST_DATA_BLOCK; block < superblock->meta_top; block++)
+    {
+        if(bad[block])
+        {
+            printf("image block %d is damaged and belongs to no file\n", block);
+            damaged++;
+        }
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("scrub: %u blocks checked in %.3f s on %d threads, %u damaged\n",
+           state.checked, seconds, num_threads, damaged);
+
+    free(bad);
+}
+
+// First occurrence of needle in hay, or NULL. With SSE2 sixteen starting positions are
+// tested at once against the first and last byte of the needle, and only positions where
+// both match are compared in full.
+const uint8_t * findBytes(const uint8_t * hay, size_t len, const uint8_t * needle, size_t nlen)
+{
+    if(nlen > len)
+    {
+        return NULL;
+    }
+    if(nlen == 1)
+    {
+        return memchr(hay, needle[0], len);
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    for(; i + nlen - 1 + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) (hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (hay + i + nlen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while(mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if(!memcmp(hay + i + bit + 1, needle + 1, nlen - 2))
+            {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(hay + i, len - i, needle, nlen);
+}
+
+#define GREP_MAX_PATTERN 128
+#define GREP_CONTEXT     40
+
+struct grepState
+{
+    const uint8_t * pattern;
+    uint32_t        len;
+    int32_t       * entries;    // directory entries to search
+    char         ** out;        // the lines printed for each entry
+    size_t        * out_len;
+    uint32_t        matches;
+    uint64_t        bytes;
+};
+
+// Copy len bytes at offset of inode into out, a block at a time through peekFileBytes()
+int grepBytes(int32_t inode, uint32_t offset, uint32_t len, uint8_t * out)
+{
+    uint8_t buf[BLOCK_SIZE];
+    while(len > 0)
+    {
+        uint32_t block_offset = offset % BLOCK_SIZE;
+        uint32_t bytes = BLOCK_SIZE - block_offset < len ? BLOCK_SIZE - block_offset : len;
+        const uint8_t * p = peekFileBytes(inode, offset / BLOCK_SIZE, buf);
+        if(p == NULL)
+        {
+            return -1;
+        }
+        memcpy(out, p + block_offset, bytes);
+        out += bytes;
+        offset += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+// Print a match at offset with the rest of its line, up to GREP_CONTEXT bytes either side
+void grepMatch(FILE * out, int32_t entry, uint32_t offset, struct grepState * state)
+{
+    int32_t inode = dirEntry(entry)->inode;
+    uint32_t size = inodeInfo(inode)->file_size;
+    uint32_t start = offset > GREP_CONTEXT ? offset - GREP_CONTEXT : 0;
+    uint32_t end = offset + state->len + GREP_CONTEXT;
+    end = end < size ? end : size;
+
+    uint8_t line[2 * GREP_CONTEXT + GREP_MAX_PATTERN];
+    if(grepBytes(inode, start, end - start, line) == -1)
+    {
+        fprintf(out, "%.64s:%u: (unreadable)\n", dirEntry(entry)->filename, offset);
+        return;
+    }
+
+    uint32_t from = offset - start;
+    uint32_t to = from + state->len;
+    while(from > 0 && line[from - 1] != '\n')
+    {
+        from--;
+    }
+    while(to < end - start && line[to] != '\n')
+    {
+        to++;
+    }
+
+    fprintf(out, "%.64s:%u:", dirEntry(entry)->filename, offset);
+    uint32_t i;
+    for(i = from; i < to; i++)
+    {
+        fputc(isprint(line[i]) ? line[i] : '.', out);
+    }
+    fputc('\n', out);
+}
+
+// Scan one file block by block. A match that crosses into a block is found in a small window
+// of the previous block's last len - 1 bytes followed by this block's first len - 1 bytes.
+uint32_t grepFile(int32_t entry, struct grepState * state, FILE * out)
+{
+    int32_t inode = dirEntry(entry)->inode;
+    uint32_t size = inodeInfo(inode)->file_size;
+    uint32_t len = state->len;
+    uint8_t window[2 * GREP_MAX_PATTERN];
+    uint8_t buf[BLOCK_SIZE];
+    uint32_t tail = 0;
+    uint32_t matches = 0;
+    uint32_t base;
+
+    for(base = 0; base < size; base += BLOCK_SIZE)
+    {
+        uint32_t n = size - base < BLOCK_SIZE ? size - base : BLOCK_SIZE;
+        const uint8_t * p = peekFileBytes(inode, base / BLOCK_SIZE, buf);
+        if(p == NULL)
+        {
+            fprintf(out, "%.64s: block %u can not be read\n", dirEntry(entry)->filename,
+                    base / BLOCK_SIZE);
+            break;
+        }
+
+        if(tail)
+        {
+            uint32_t head = n < len - 1 ? n : len - 1;
+            memcpy(window + tail, p, head);
+            const uint8_t * hit = window;
+            while((hit = findBytes(hit, window + tail + head - hit, state->pattern, len)))
+            {
+                grepMatch(out, entry, base - tail + (hit - window), state);
+                matches++;
+                hit++;
+            }
+        }
+
+        const uint8_t * hit = p;
+        while((hit = findBytes(hit, p + n - hit, state->pattern, len)))
+        {
+            grepMatch(out, entry, base + (hit - p), state);
+            matches++;
+            hit++;
+        }
+
+        // Keep the last len - 1 bytes seen for the next block's window
+        if(n >= len - 1)
+        {
+            tail = len - 1;
+            memcpy(window, p + n - tail, tail);
+        }
+        else
+        {
+            uint32_t keep = tail + n > len - 1 ? len - 1 - n : tail;
+            memmove(window, window + tail - keep, keep);
+            memcpy(window + keep, p, n);
+            tail = keep + n;
+        }
+    }
+
+    __atomic_fetch_add(&state->bytes, size, __ATOMIC_RELAXED);
+    return matches;
+}
+
+void grepRange(int32_t first, int32_t last, void * arg)
+{
+    struct grepState * state = arg;
+    int32_t k;
+    for(k = first; k < last; k++)
+    {
+        FILE * out = open_memstream(&state->out[k], &state->out_len[k]);
+        if(out == NULL)
+        {
+            continue;
+        }
+        uint32_t matches = grepFile(state->entries[k], state, out);
+        fclose(out);
+        __atomic_fetch_add(&state->matches, matches, __ATOMIC_RELAXED);
+    }
+}
+
+// grep [-x] <pattern> [files...]: print file:offset:context for every occurrence of pattern,
+// given as text or with -x as hex bytes, in the named files or all files. Files are spread
+// over all cores and printed in directory order.
+void grep(char ** token)
+{
+    int arg = 1;
+    int hex = token[arg] != NULL && !strcmp(token[arg], "-x");
+    arg += hex;
+    if(token[arg] == NULL)
+    {
+        printf("ERROR: grep needs a pattern\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    uint8_t pattern[GREP_MAX_PATTERN];
+    int32_t len = hex ? parseHex(token[arg], pattern, GREP_MAX_PATTERN)
+                      : (int32_t) strlen(token[arg]);
+    if(len <= 0 || len > GREP_MAX_PATTERN)
+    {
+        printf("ERROR: The pattern must be 1 to %d bytes\n", GREP_MAX_PATTERN);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+    if(!hex)
+    {
+        memcpy(pattern, token[arg], len);
+    }
+    arg++;
+
+    struct grepState state;
+    memset(&state, 0, sizeof(state));
+    state.pattern = pattern;
+    state.len = len;
+    if(cache_mode && cacheFlush() == -1)
+    {
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    state.entries = malloc(num_files * sizeof(int32_t));
+    int32_t count = 0;
+    int32_t i;
+    if(state.entries == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        return;
+    }
+
+    if(token[arg] == NULL)
+    {
+        for(i = 0; i < num_files; i++)
+        {
+            if(entryLive(i))
+            {
+                state.entries[count++] = i;
+            }
+        }
+    }
+    for(; arg < MAX_NUM_ARGUMENTS && token[arg] != NULL; arg++)
+    {
+        int32_t entry = findFile(token[arg]);
+        if(entry == -1)
+        {
+            printf("ERROR: %s not found\n", token[arg]);
+            last_status = MFS_ERR_NOT_FOUND;
+            continue;
+        }
+        state.entries[count++] = entry;
+    }
+
+    state.out = calloc(count + 1, sizeof(char*));
+    state.out_len = calloc(count + 1, sizeof(size_t));
+    if(state.out == NULL || state.out_len == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        free(state.entries);
+        free(state.out);
+        free(state.out_len);
+        return;
+    }
+
+    parallelFor(0, count, grepRange, &state);
+
+    for(i = 0; i < count; i++)
+    {
+        if(state.out[i] != NULL)
+        {
+            fwrite(state.out[i], 1, state.out_len[i], stdout);
+            free(state.out[i]);
+        }
+    }
+
+    last_status = state.matches ? MFS_OK : MFS_ERR_NOT_FOUND;
+    free(state.entries);
+    free(state.out);
+    free(state.out_len);
+}
+
+// Digests for the sum command. Each keeps a running state so a file can be hashed a block at
+// a time. xxHash64 runs four independent lanes of multiply-rotate rounds, which keeps the
+// pipeline busy at several bytes per cycle; SHA-256 is there to check against published
+// digests and CRC32C reuses the checksum code.
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+struct xxh64State
+{
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t  buf[32];
+    uint32_t buf_len;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t * p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+void xxh64Init(struct xxh64State * st)
+{
+    memset(st, 0, sizeof(*st));
+    st->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    st->v[1] = XXH_PRIME2;
+    st->v[2] = 0;
+    st->v[3] = -XXH_PRIME1;
+}
+
+void xxh64Update(struct xxh64State * st, const uint8_t * p, size_t len)
+{
+    st->total += len;
+    if(st->buf_len)
+    {
+        size_t take = 32 - st->buf_len < len ? 32 - st->buf_len : len;
+        memcpy(st->buf + st->buf_len, p, take);
+        st->buf_len += take;
+        p += take;
+        len -= take;
+        if(st->buf_len < 32)
+        {
+            return;
+        }
+        int i;
+        for(i = 0; i < 4; i++)
+        {
+            st->v[i] = xxhRound(st->v[i], read64(st->buf + 8 * i));
+        }
+        st->buf_len = 0;
+    }
+
+    uint64_t v0 = st->v[0], v1 = st->v[1], v2 = st->v[2], v3 = st->v[3];
+    for(; len >= 32; p += 32, len -= 32)
+    {
+        v0 = xxhRound(v0, read64(p));
+        v1 = xxhRound(v1, read64(p + 8));
+        v2 = xxhRound(v2, read64(p + 16));
+        v3 = xxhRound(v3, read64(p + 24));
+    }
+    st->v[0] = v0;
+    st->v[1] = v1;
+    st->v[2] = v2;
+    st->v[3] = v3;
+
+    memcpy(st->buf, p, len);
+    st->buf_len = len;
+}
+
+uint64_t xxh64Final(struct xxh64State * st)
+{
+    uint64_t h;
+    int i;
+    if(st->total >= 32)
+    {
+        h = rotl64(st->v[0], 1) + rotl64(st->v[1], 7) + rotl64(st->v[2], 12) +
+            rotl64(st->v[3], 18);
+        for(i = 0; i < 4; i++)
+        {
+            h = (h ^ xxhRound(0, st->v[i])) * XXH_PRIME1 + XXH_PRIME4;
+        }
+    }
+    else
+    {
+        h = XXH_PRIME5;
+    }
+    h += st->total;
+
+    const uint8_t * p = st->buf;
+    uint32_t len = st->buf_len;
+    for(; len >= 8; p += 8, len -= 8)
+    {
+        h = rotl64(h ^ xxhRound(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if(len >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        h = rotl64(h ^ (word * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for(; len > 0; p++, len--)
+    {
+        h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+struct sha256State
+{
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t  buf[64];
+    uint32_t buf_len;
+};
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+void sha256Block(struct sha256State * st, const uint8_t * p)
+{
+    uint32_t w[64];
+    int i;
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for(i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = st->h[0], b = st->h[1], c = st->h[2], d = st->h[3];
+    uint32_t e = st->h[4], f = st->h[5], g = st->h[6], h = st->h[7];
+    for(i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    st->h[0] += a;
+    st->h[1] += b;
+    st->h[2] += c;
+    st->h[3] += d;
+    st->h[4] += e;
+    st->h[5] += f;
+    st->h[6] += g;
+    st->h[7] += h;
+}
+
+void sha256Init(struct sha256State * st)
+{
+    static const uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memset(st, 0, sizeof(*st));
+    memcpy(st->h, h0, sizeof(h0));
+}
+
+void sha256Update(struct sha256State * st, const uint8_t * p, size_t len)
+{
+    st->total += len;
+    while(len > 0)
+    {
+        if(st->buf_len == 0 && len >= 64)
+        {
+            sha256Block(st, p);
+            p += 64;
+            len -= 64;
+            continue;
+        }
+
+        size_t take = 64 - st->buf_len < len ? 64 - st->buf_len : len;
+        memcpy(st->buf + st->buf_len, p, take);
+        st->buf_len += take;
+        p += take;
+        len -= take;
+        if(st->buf_len == 64)
+        {
+            sha256Block(st, st->buf);
+            st->buf_len = 0;
+        }
+    }
+}
+
+void sha256Final(struct sha256State * st, uint8_t * digest)
+{
+    uint64_t bits = st->total * 8;
+    uint8_t pad[72] = { 0x80 };
+    uint32_t pad_len = (st->buf_len < 56 ? 56 : 120) - st->buf_len;
+    int i;
+    for(i = 0; i < 8; i++)
+    {
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    }
+    sha256Update(st, pad, pad_len + 8);
+
+    for(i = 0; i < 32; i++)
+    {
+        digest[i] = st->h[i / 4] >> (24 - 8 * (i % 4));
+    }
+}
+
+#define SUM_XXH64  0
+#define SUM_SHA256 1
+#define SUM_CRC32C 2
+
+const char * sum_algorithms[] = { "xxh64", "sha256", "crc32c", NULL };
+
+struct sumState
+{
+    int                  algo;
+    uint32_t             crc;
+    struct xxh64State    xxh;
+    struct sha256State   sha;
+};
+
+void sumInit(struct sumState * st, int algo)
+{
+    st->algo = algo;
+    st->crc = ~0U;
+    xxh64Init(&st->xxh);
+    sha256Init(&st->sha);
+}
+
+void sumUpdate(struct sumState * st, const uint8_t * p, size_t len)
+{
+    switch(st->algo)
+    {
+        case SUM_XXH64:  xxh64Update(&st->xxh, p, len); break;
+        case SUM_SHA256: sha256Update(&st->sha, p, len); break;
+        case SUM_CRC32C: st->crc = crc32cUpdate(st->crc, p, len); break;
+    }
+}
+
+// Write the digest as lower case hex, the way the *sum tools print it
+void sumFinal(struct sumState * st, char * hex)
+{
+    uint8_t digest[32];
+    int i;
+    switch(st->algo)
+    {
+        case SUM_XXH64:
+            sprintf(hex, "%016llx", (unsigned long long) xxh64Final(&st->xxh));
+            return;
+        case SUM_SHA256:
+            sha256Final(&st->sha, digest);
+            for(i = 0; i < 32; i++)
+            {
+                sprintf(hex + 2 * i, "%02x", digest[i]);
+            }
+            return;
+        case SUM_CRC32C:
+            sprintf(hex, "%08x", ~st->crc);
+            return;
+    }
+}
+
+#define SUM_HEX 65
+
+struct sumJob
+{
+    int       algo;
+    int32_t * entries;
+    char    (*digests)[SUM_HEX];    // empty when the file could not be read
+};
+
+void sumRange(int32_t first, int32_t last, void * arg)
+{
+    struct sumJob * job = arg;
+    uint8_t buf[BLOCK_SIZE];
+    int32_t k;
+    for(k = first; k < last; k++)
+    {
+        int32_t inode = dirEntry(job->entries[k])->inode;
+        uint32_t size = inodeInfo(inode)->file_size;
+        struct sumState st;
+        sumInit(&st, job->algo);
+
+        uint32_t offset;
+        for(offset = 0; offset < size; offset += BLOCK_SIZE)
+        {
+            const uint8_t * p = peekFileBytes(inode, offset / BLOCK_SIZE, buf);
+            if(p == NULL)
+            {
+                break;
+            }
+            sumUpdate(&st, p, size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE);
+        }
+
+        job->digests[k][0] = '\0';
+        if(offset >= size)
+        {
+            sumFinal(&st, job->digests[k]);
+        }
+    }
+}
+
+// sum [-a algorithm] [files...]: print a digest of every named file, or of every file, as
+// "digest  name" lines the way sha256sum does. Files are hashed on all cores.
+void sum(char ** token)
+{
+    int arg = 1;
+    int algo = SUM_XXH64;
+    if(token[arg] != NULL && !strcmp(token[arg], "-a"))
+    {
+        for(algo = 0; sum_algorithms[algo] != NULL; algo++)
+        {
+            if(token[arg + 1] != NULL && !strcmp(token[arg + 1], sum_algorithms[algo]))
+            {
+                break;
+            }
+        }
+        if(sum_algorithms[algo] == NULL)
+        {
+            printf("ERROR: sum -a takes xxh64, sha256 or crc32c\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            return;
+        }
+        arg += 2;
+    }
+
+    if(cache_mode && cacheFlush() == -1)
+    {
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    struct sumJob job;
+    job.algo = algo;
+    job.entries = malloc(num_files * sizeof(int32_t));
+    job.digests = malloc((num_files + 1) * SUM_HEX);
+    if(job.entries == NULL || job.digests == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        free(job.entries);
+        free(job.digests);
+        return;
+    }
+
+    int32_t count = 0;
+    int32_t i;
+    int32_t status = MFS_OK;
+    if(token[arg] == NULL)
+    {
+        for(i = 0; i < num_files; i++)
+        {
+            if(entryLive(i))
+            {
+                job.entries[count++] = i;
+            }
+        }
+    }
+    for(; arg < MAX_NUM_ARGUMENTS && token[arg] != NULL; arg++)
+    {
+        int32_t entry = findFile(token[arg]);
+        if(entry == -1)
+        {
+            printf("ERROR: %s not found\n", token[arg]);
+            status = MFS_ERR_NOT_FOUND;
+            continue;
+        }
+        job.entries[count++] = entry;
+    }
+
+    parallelFor(0, count, sumRange, &job);
+
+    for(i = 0; i < count; i++)
+    {
+        const char * name = dirEntry(job.entries[i])->filename;
+        if(job.digests[i][0] == '\0')
+        {
+            printf("ERROR: %.64s can not be read\n", name);
+            status = MFS_ERR_IO;
+            continue;
+        }
+        printf("%s  %.64s\n", job.digests[i], name);
+    }
+
+    last_status = status;
+    free(job.entries);
+    free(job.digests);
+}
+
+// Block-level sync. The signature of an image is the xxHash64 of each of its blocks; two images
+// differ exactly in the blocks whose hashes differ. syncfs writes those blocks of the current
+// image into a target image file and keeps the target's signature beside it in <target>.sig,
+// trusted while the target's size and modification time still match, so an unchanged target is
+// not read at all. signature, delta and apply do the same in three steps over pipes.
+#define SIG_MAGIC   "MFSSIG1"
+#define DELTA_MAGIC "MFSDLT1"
+
+struct sigHeader
+{
+    char     magic[8];
+    uint64_t size;          // of the image file the signature was taken from
+    int64_t  mtime_sec;     // 0 unless the signature is a syncfs cache
+    int64_t  mtime_nsec;
+};
+
+// A delta is this header and then blocks records of a block number and the block's bytes
+struct deltaHeader
+{
+    char     magic[8];
+    uint64_t base;          // sigCheck() of the image the delta applies to
+    uint64_t result;        // and of the image it turns that into
+    uint32_t blocks;
+    uint32_t pad;
+};
+
+#define SIG_BYTES ((size_t) NUM_BLOCKS * sizeof(uint64_t))
+
+struct hashJob
+{
+    uint64_t      * hashes;
+    const uint8_t * base;       // image to hash, NULL for the current one
+    int             failed;
+};
+
+void hashRange(int32_t first, int32_t last, void * arg)
+{
+    struct hashJob * job = arg;
+    uint8_t buf[BLOCK_SIZE];
+    int32_t block;
+    for(block = first; block < last; block++)
+    {
+        const uint8_t * p = job->base ? job->base + (size_t) block * BLOCK_SIZE
+                                      : peekBlock(block, buf);
+        if(p == NULL)
+        {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        struct xxh64State st;
+        xxh64Init(&st);
+        xxh64Update(&st, p, BLOCK_SIZE);
+        job->hashes[block] = xxh64Final(&st);
+    }
+}
+
+// Hash every block of the image at base, or of the current image, on all cores. Returns -1 if
+// a block can not be read.
+int hashImage(const uint8_t * base, uint64_t * hashes)
+{
+    struct hashJob job = { hashes, base, 0 };
+    if(base == NULL && cache_mode && cacheFlush() == -1)
+    {
+        return -1;
+    }
+    parallelFor(0, NUM_BLOCKS, hashRange, &job);
+    return job.failed ? -1 : 0;
+}
+
+// One hash naming a whole signature, to check that a delta meets the image it was made for
+uint64_t sigCheck(const uint64_t * hashes)
+{
+    struct xxh64State st;
+    xxh64Init(&st);
+    xxh64Update(&st, (const uint8_t*) hashes, SIG_BYTES);
+    return xxh64Final(&st);
+}
+
+// Name of the signature cache of target. Returns -1 if it would not fit in size bytes, so the
+// cache can never be written under the name of the target itself.
+int sigPath(char * path, size_t size, const char * target)
+{
+    int len = snprintf(path, size, "%s.sig", target);
+    return len < 0 || (size_t) len >= size ? -1 : 0;
+}
+
+// Read the cached signature of target into hashes if it still describes the file as it is in
+// st. Returns 0 when it does.
+int sigLoad(const char * target, const struct stat * st, uint64_t * hashes)
+{
+    char path[PATH_MAX];
+    int fd = sigPath(path, sizeof(path), target) == -1 ? -1 : open(path, O_RDONLY);
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    struct sigHeader header;
+    int ok = readFull(fd, &header, sizeof(header)) == sizeof(header) &&
+             !memcmp(header.magic, SIG_MAGIC, sizeof(header.magic)) &&
+             header.size == (uint64_t) st->st_size &&
+             header.mtime_sec == st->st_mtim.tv_sec &&
+             header.mtime_nsec == st->st_mtim.tv_nsec &&
+             readFull(fd, hashes, SIG_BYTES) == (ssize_t) SIG_BYTES;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+void sigSave(const char * target, const struct stat * st, const uint64_t * hashes)
+{
+    char path[PATH_MAX];
+    if(sigPath(path, sizeof(path), target) == -1)
+    {
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+    {
+        return;
+    }
+
+    struct sigHeader header = { SIG_MAGIC, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    if(writeFull(fd, &header, sizeof(header)) == -1 || writeFull(fd, hashes, SIG_BYTES) == -1)
+    {
+        // A short file is never taken for a valid cache
+        if(ftruncate(fd, 0) == -1)
+        {
+            unlink(path);
+        }
+    }
+    close(fd);
+}
+
+// syncfs <target>: make the image file target a copy of the current image, writing only the
+// blocks that differ
+void syncImage(char * target)
+{
+    if(imageFind(target) != -1)
+    {
+        printf("ERROR: %s is open; syncfs needs an image file that is not\n", target);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    char sig[PATH_MAX];
+    if(sigPath(sig, sizeof(sig), target) == -1)
+    {
+        printf("ERROR: %.64s...: %s\n", target, mfs_strerror(MFS_ERR_NAME));
+        last_status = MFS_ERR_NAME;
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t len = (size_t) NUM_BLOCKS * BLOCK_SIZE;
+    uint64_t * source = malloc(SIG_BYTES);
+    uint64_t * dest = malloc(SIG_BYTES);
+    int fd = open(target, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    int32_t status = MFS_OK;
+    if(source == NULL || dest == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        status = MFS_ERR_NO_SPACE;
+    }
+    else if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        printf("ERROR: Can not open %s\n", target);
+        status = MFS_ERR_IO;
+    }
+    else if(isCompressedFile(fd))
+    {
+        printf("ERROR: %s is compressed; syncfs needs an uncompressed image\n", target);
+        status = MFS_ERR_BAD_REQUEST;
+    }
+    else if(st.st_size < (off_t) len && ftruncate(fd, len) == -1)
+    {
+        printf("ERROR: Can not write %s\n", target);
+        status = MFS_ERR_IO;
+    }
+    else if(hashImage(NULL, source) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+
+    // Without a cache matching the target the target is hashed from a read-only mapping
+    int cached = 0;
+    if(status == MFS_OK)
+    {
+        cached = st.st_size >= (off_t) len && sigLoad(target, &st, dest) == 0;
+    }
+    if(status == MFS_OK && !cached)
+    {
+        void * map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED)
+        {
+            printf("ERROR: Can not read %s\n", target);
+            status = MFS_ERR_IO;
+        }
+        else
+        {
+            hashImage(map, dest);
+            munmap(map, len);
+        }
+    }
+
+    // Runs of differing blocks go out in one write each; a cached image reads them one by one
+    uint32_t changed = 0;
+    int32_t block = 0;
+    while(status == MFS_OK && block < NUM_BLOCKS)
+    {
+        if(source[block] == dest[block])
+        {
+            block++;
+            continue;
+        }
+
+        int32_t run = 1;
+        while(!cache_mode && block + run < NUM_BLOCKS && source[block + run] != dest[block + run])
+        {
+            run++;
+        }
+
+        uint8_t buf[BLOCK_SIZE];
+        const uint8_t * p = peekBlock(block, buf);
+        if(p == NULL ||
+           pwrite(fd, p, (size_t) run * BLOCK_SIZE, (off_t) block * BLOCK_SIZE) !=
+           (ssize_t) run * BLOCK_SIZE)
+        {
+            printf("ERROR: Can not write block %d to %s\n", block, target);
+            status = MFS_ERR_IO;
+            break;
+        }
+        changed += run;
+        block += run;
+    }
+
+    if(status == MFS_OK && (fsync(fd) == -1 || fstat(fd, &st) == -1))
+    {
+        printf("ERROR: Can not write %s\n", target);
+        status = MFS_ERR_IO;
+    }
+    if(status == MFS_OK)
+    {
+        sigSave(target, &st, source);
+    }
+    if(fd != -1)
+    {
+        close(fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if(status == MFS_OK)
+    {
+        printf("syncfs: %u of %d blocks differed, %u KB written in %.3f s (target signature %s)\n",
+               changed, NUM_BLOCKS, changed * (BLOCK_SIZE / 1024), secs,
+               cached ? "cached" : "computed");
+    }
+    free(source);
+    free(dest);
+    last_status = status;
+}
+
+// Open path for a pipe command: "-" is standard input or output
+int syncOpen(const char * path, int output)
+{
+    if(!strcmp(path, "-"))
+    {
+        return output ? stdout_fd : STDIN_FILENO;
+    }
+    return output ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+}
+
+void syncClose(const char * path, int fd)
+{
+    if(strcmp(path, "-") && fd != -1)
+    {
+        close(fd);
+    }
+}
+
+// signature <file|->: write the signature of the current image for delta
+void signature(char * path)
+{
+    uint64_t * hashes = malloc(SIG_BYTES);
+    int fd = syncOpen(path, 1);
+    int32_t status = MFS_OK;
+    if(hashes == NULL || fd == -1)
+    {
+        printf("ERROR: Can not open %s\n", path);
+        status = MFS_ERR_IO;
+    }
+    else if(hashImage(NULL, hashes) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+    else
+    {
+        struct sigHeader header = { SIG_MAGIC, (uint64_t) NUM_BLOCKS * BLOCK_SIZE, 0, 0 };
+        if(writeFull(fd, &header, sizeof(header)) == -1 ||
+           writeFull(fd, hashes, SIG_BYTES) == -1)
+        {
+            printf("ERROR: Can not write %s\n", path);
+            status = MFS_ERR_IO;
+        }
+    }
+
+    syncClose(path, fd);
+    free(hashes);
+    last_status = status;
+}
+
+// delta <signature|-> <file|->: write the blocks of the current image that differ from the
+// image the signature was taken of
+void delta(char * sig_path, char * path)
+{
+    uint64_t * theirs = malloc(SIG_BYTES);
+    uint64_t * ours = malloc(SIG_BYTES);
+    int in = syncOpen(sig_path, 0);
+    struct sigHeader sig;
+    int32_t status = MFS_OK;
+    if(theirs == NULL || ours == NULL || in == -1)
+    {
+        printf("ERROR: Can not open %s\n", sig_path);
+        status = MFS_ERR_IO;
+    }
+    else if(readFull(in, &sig, sizeof(sig)) != sizeof(sig) ||
+            memcmp(sig.magic, SIG_MAGIC, sizeof(sig.magic)) ||
+            readFull(in, theirs, SIG_BYTES) != (ssize_t) SIG_BYTES)
+    {
+        printf("ERROR: %s is not an image signature\n", sig_path);
+        status = MFS_ERR_BAD_REQUEST;
+    }
+    else if(hashImage(NULL, ours) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+    syncClose(sig_path, in);
+
+    int out = status == MFS_OK ? syncOpen(path, 1) : -1;
+    if(status == MFS_OK && out == -1)
+    {
+        printf("ERROR: Can not open %s\n", path);
+        status = MFS_ERR_IO;
+    }
+
+    struct deltaHeader header = { DELTA_MAGIC, 0, 0, 0, 0 };
+    int32_t block;
+    if(status == MFS_OK)
+    {
+        header.base = sigCheck(theirs);
+        header.result = sigCheck(ours);
+        for(block = 0; block < NUM_BLOCKS; block++)
+        {
+            header.blocks += ours[block] != theirs[block];
+        }
+    }
+
+    struct stream st = streamOpen(out);
+    if(status == MFS_OK && streamWrite(&st, &header, sizeof(header)) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+    for(block = 0; status == MFS_OK && block < NUM_BLOCKS; block++)
+    {
+        uint8_t buf[BLOCK_SIZE];
+        const uint8_t * p;
+        if(ours[block] == theirs[block])
+        {
+            continue;
+        }
+        if((p = peekBlock(block, buf)) == NULL || streamWrite(&st, &block, sizeof(block)) == -1 ||
+           streamWrite(&st, p, BLOCK_SIZE) == -1)
+        {
+            status = MFS_ERR_IO;
+        }
+    }
+    if(status == MFS_OK && streamFlush(&st) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+    streamClose(&st);
+    syncClose(path, out);
+
+    if(status == MFS_ERR_IO && out != -1)
+    {
+        printf("ERROR: Can not write %s\n", path);
+        last_status = MFS_ERR_IO;
+    }
+    if(status == MFS_OK)
+    {
+        printf("delta: %u of %d blocks differ\n", header.blocks, NUM_BLOCKS);
+    }
+    free(theirs);
+    free(ours);
+    last_status = status;
+}
+
+// apply <delta|->: bring the current image to the state a delta was made from. The whole delta
+// is read before any block changes, and the image must be the one the delta's signature was
+// taken of; if the result is not what the delta describes the old blocks are put back.
+void apply(char * path)
+{
+    if(cache_mode)
+    {
+        printf("ERROR: apply needs the whole image in memory; open %s without --cache\n",
+               image_name);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    int in = syncOpen(path, 0);
+    if(in == -1)
+    {
+        printf("ERROR: Can not open %s\n", path);
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    struct stream st = streamOpen(in);
+    struct deltaHeader header;
+    uint8_t * records = NULL;
+    size_t record = sizeof(int32_t) + BLOCK_SIZE;
+    uint64_t * hashes = malloc(SIG_BYTES);
+    int32_t status = MFS_OK;
+    if(streamRead(&st, &header, sizeof(header)) != sizeof(header) ||
+       memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) || header.blocks > NUM_BLOCKS)
+    {
+        printf("ERROR: %s is not an image delta\n", path);
+        status = MFS_ERR_BAD_REQUEST;
+    }
+    else if(hashes == NULL || (records = malloc(header.blocks * record + 1)) == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        status = MFS_ERR_NO_SPACE;
+    }
+    else if(streamRead(&st, records, header.blocks * record) != (ssize_t) (header.blocks * record))
+    {
+        printf("ERROR: %s ends early\n", path);
+        status = MFS_ERR_CORRUPT;
+    }
+    streamClose(&st);
+    syncClose(path, in);
+
+    if(status == MFS_OK && (hashImage(NULL, hashes) == -1 || sigCheck(hashes) != header.base))
+    {
+        printf("ERROR: %s was made for another image, or %s has changed since\n", path,
+               image_name);
+        status = MFS_ERR_BAD_REQUEST;
+    }
+
+    // Swap each block with its record, so the records end up holding the old blocks
+    uint64_t generation = superblock->generation;
+    uint32_t i;
+    for(i = 0; status == MFS_OK && i < header.blocks; i++)
+    {
+        int32_t block;
+        memcpy(&block, records + i * record, sizeof(block));
+        if(block < 0 || block >= NUM_BLOCKS)
+        {
+            printf("ERROR: %s names block %d\n", path, block);
+            status = MFS_ERR_CORRUPT;
+            break;
+        }
+
+        uint8_t old[BLOCK_SIZE];
+        memcpy(old, data[block], BLOCK_SIZE);
+        memcpy(data[block], records + i * record + sizeof(block), BLOCK_SIZE);
+        memcpy(records + i * record + sizeof(block), old, BLOCK_SIZE);
+    }
+
+    if(status == MFS_OK && (hashImage(NULL, hashes) == -1 || sigCheck(hashes) != header.result))
+    {
+        printf("ERROR: %s is damaged\n", path);
+        status = MFS_ERR_CORRUPT;
+    }
+    if(status != MFS_OK)
+    {
+        while(i-- > 0)
+        {
+            int32_t block;
+            memcpy(&block, records + i * record, sizeof(block));
+            memcpy(data[block], records + i * record + sizeof(block), BLOCK_SIZE);
+        }
+    }
+
+    imagePointers();
+    if(status == MFS_OK)
+    {
+        // The other processes sharing the image count on from its own generation
+        if(shared_mode)
+        {
+            superblock->generation = generation;
+        }
+        loadExtensions();
+        printf("apply: %u blocks written\n", header.blocks);
+    }
+
+    free(records);
+    free(hashes);
+    last_status = status;
+}
+
+// A snapshot's frozen metadata is a byte stream spread over a chain of data blocks. Each
+// block starts with a snapHeader naming the next block in the chain (0 at the end) and how
+// many payload bytes it holds. The stream is one snapFile record per file, each followed by
+// the file's block numbers.
+struct snapHeader
+{
+    int32_t  next;
+    uint32_t used;
+};
+
+#define SNAP_PAYLOAD (BLOCK_SIZE - sizeof(struct snapHeader))
+
+struct snapFile
+{
+    char     filename[MAX_FILENAME];
+    uint32_t file_size;
+    uint8_t  attribute;
+    uint8_t  tail;
+    uint8_t  reserved[2];
+};
+
+// Block numbers of a frozen file, which follow its record
+uint32_t snapBlocks(struct snapFile * file)
+{
+    return file->tail == TAIL_INLINE ? 0 : BLOCKS_FOR(file->file_size);
+}
+
+// Words following the record: the block numbers, or the bytes of an inline file
+uint32_t snapWords(struct snapFile * file)
+{
+    return file->tail == TAIL_INLINE ? (file->file_size + 3) / 4 : BLOCKS_FOR(file->file_size);
+}
+
+struct snapStream
+{
+    int32_t            first;
+    int32_t            block;     // current chain block, held with getBlock while open
+    uint8_t          * p;
+    struct snapHeader  header;
+    uint32_t           pos;
+    uint32_t           blocks;
+    int                dirty;     // the current block was written through snapCopy()
+};
+
+int snapOpenWrite(struct snapStream * st)
+{
+    memset(st, 0, sizeof(*st));
+    st->block = findFreeBlock();
+    if(st->block == -1)
+    {
+        return -1;
+    }
+    st->first = st->block;
+    st->p = newBlock(st->block);
+    if(st->p == NULL)
+    {
+        releaseBlock(st->block);
+        return -1;
+    }
+    st->blocks = 1;
+    return 0;
+}
+
+void snapFinishBlock(struct snapStream * st)
+{
+    st->header.used = st->pos;
+    memcpy(st->p, &st->header, sizeof(st->header));
+    putBlock(st->block, 1);
+}
+
+int snapWrite(struct snapStream * st, const void * buf, uint32_t len)
+{
+    const uint8_t * src = buf;
+    while(len > 0)
+    {
+        if(st->pos == SNAP_PAYLOAD)
+        {
+            int32_t next = findFreeBlock();
+            uint8_t * p = next == -1 ? NULL : newBlock(next);
+            if(p == NULL)
+            {
+                if(next != -1)
+                {
+                    releaseBlock(next);
+                }
+                return -1;
+            }
+            st->header.next = next;
+            snapFinishBlock(st);
+
+            st->block = next;
+            st->p = p;
+            st->header.next = 0;
+            st->pos = 0;
+            st->blocks++;
+        }
+
+        uint32_t bytes = SNAP_PAYLOAD - st->pos < len ? SNAP_PAYLOAD - st->pos : len;
+        memcpy(st->p + sizeof(struct snapHeader) + st->pos, src, bytes);
+        st->pos += bytes;
+        src += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+int snapOpenRead(struct snapStream * st, int32_t first)
+{
+    memset(st, 0, sizeof(*st));
+    if(!validDataBlock(first))
+    {
+        return -1;
+    }
+    st->first = first;
+    st->block = first;
+    st->p = getBlock(first);
+    if(st->p == NULL)
+    {
+        return -1;
+    }
+    memcpy(&st->header, st->p, sizeof(st->header));
+    st->blocks = 1;
+    return 0;
+}
+
+// Read len bytes from the stream into buf, or with write set, write buf over the next len bytes
+// in place
+int snapCopy(struct snapStream * st, void * buf, uint32_t len, int write)
+{
+    uint8_t * dst = buf;
+    while(len > 0)
+    {
+        if(st->pos >= st->header.used || st->header.used > SNAP_PAYLOAD)
+        {
+            // Follow the chain, refusing anything that loops or leaves the data region
+            int32_t next = st->header.next;
+            if(!validDataBlock(next) || st->blocks >= NUM_BLOCKS)
+            {
+                return -1;
+            }
+            putBlock(st->block, st->dirty);
+            st->dirty = 0;
+            st->block = next;
+            st->p = getBlock(next);
+            if(st->p == NULL)
+            {
+                return -1;
+            }
+            memcpy(&st->header, st->p, sizeof(st->header));
+            st->pos = 0;
+            st->blocks++;
+            continue;
+        }
+
+        uint32_t bytes = st->header.used - st->pos < len ? st->header.used - st->pos : len;
+        if(write)
+        {
+            memcpy(st->p + sizeof(struct snapHeader) + st->pos, dst, bytes);
+            st->dirty = 1;
+        }
+        else
+        {
+            memcpy(dst, st->p + sizeof(struct snapHeader) + st->pos, bytes);
+        }
+        st->pos += bytes;
+        dst += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+int snapRead(struct snapStream * st, void * buf, uint32_t len)
+{
+    return snapCopy(st, buf, len, 0);
+}
+
+void snapClose(struct snapStream * st)
+{
+    putBlock(st->block, st->dirty);
+}
+
+// Give back every block of the chain starting at first
+void snapReleaseChain(int32_t first)
+{
+    uint32_t count = 0;
+    while(validDataBlock(first) && count++ < NUM_BLOCKS)
+    {
+        // A block that can not be read ends the walk; fsck -r frees the rest of the chain
+        struct snapHeader header;
+        const uint8_t * p = getBlock(first);
+        if(p == NULL)
+        {
+            break;
+        }
+        memcpy(&header, p, sizeof(header));
+        putBlock(first, 0);
+        releaseBlock(first);
+        first = header.next;
+    }
+}
+
+// Call fn for every file frozen in snapshot slot, stopping early if fn returns non-zero.
+// The chain blocks are passed to chain() when it is given. Returns -1 if the snapshot is
+// damaged, otherwise what fn last returned.
+int snapshotWalk(int slot, int (*fn)(struct snapFile *, int32_t *, void *),
+                 void (*chain)(int32_t, void *), void * arg)
+{
+    struct snapshotEntry * snap = &superblock->snapshots[slot];
+    struct snapStream st;
+    int32_t blocks[BLOCKS_PER_FILE];
+    int ret = 0;
+
+    if(snapOpenRead(&st, snap->first_block) == -1)
+    {
+        return -1;
+    }
+
+    uint32_t f;
+    for(f = 0; f < snap->files && ret == 0; f++)
+    {
+        struct snapFile file;
+        if(snapRead(&st, &file, sizeof(file)) == -1 || file.file_size > MAX_FILE_SIZE ||
+           (file.tail == TAIL_INLINE && file.file_size > BLOCK_SIZE) ||
+           snapRead(&st, blocks, snapWords(&file) * sizeof(int32_t)) == -1)
+        {
+            ret = -1;
+            break;
+        }
+
+        uint32_t index;
+        for(index = 0; index < snapBlocks(&file); index++)
+        {
+            if(!validDataBlock(blocks[index]))
+            {
+                ret = -1;
+            }
+        }
+
+        if(ret == 0)
+        {
+            ret = fn(&file, blocks, arg);
+        }
+    }
+    snapClose(&st);
+
+    if(chain != NULL && ret != -1)
+    {
+        int32_t block = snap->first_block;
+        uint32_t count = 0;
+        while(validDataBlock(block) && count++ < NUM_BLOCKS)
+        {
+            struct snapHeader header;
+            const uint8_t * p = getBlock(block);
+            if(p == NULL)
+            {
+                ret = -1;
+                break;
+            }
+            memcpy(&header, p, sizeof(header));
+            putBlock(block, 0);
+            chain(block, arg);
+            block = header.next;
+        }
+    }
+
+    return ret;
+}
+
+int snapshotCheckFile(struct snapFile * file, int32_t * blocks, void * arg)
+{
+    return 0;
+}
+
+// Point the files frozen in snapshot slot at the blocks defrag moved them to: moved[b] is where
+// the block that was at b is now. The snapshot must have passed snapshotWalk(). Returns -1 if
+// a chain block can not be brought in.
+int snapshotRemap(int slot, const int32_t * moved)
+{
+    struct snapshotEntry * snap = &superblock->snapshots[slot];
+    struct snapStream st;
+    int32_t blocks[BLOCKS_PER_FILE];
+    int ret = 0;
+
+    if(snapOpenRead(&st, snap->first_block) == -1)
+    {
+        return -1;
+    }
+
+    uint32_t f;
+    for(f = 0; f < snap->files && ret == 0; f++)
+    {
+        struct snapFile file;
+        if(snapRead(&st, &file, sizeof(file)) == -1)
+        {
+            ret = -1;
+            break;
+        }
+
+        // A second hold on the block the words start in, to write them back where they were
+        struct snapStream back = st;
+        if(getBlock(back.block) == NULL)
+        {
+            ret = -1;
+            break;
+        }
+
+        uint32_t bytes = snapWords(&file) * sizeof(int32_t);
+        if(snapRead(&st, blocks, bytes) == -1)
+        {
+            ret = -1;
+        }
+        else if(file.tail != TAIL_INLINE)
+        {
+            uint32_t index;
+            for(index = 0; index < snapBlocks(&file); index++)
+            {
+                blocks[index] = moved[blocks[index]];
+            }
+            ret = snapCopy(&back, blocks, bytes, 1);
+        }
+        snapClose(&back);
+    }
+    snapClose(&st);
+    return ret;
+}
+
+int32_t findSnapshot(const char * name)
+{
+    int slot;
+    for(slot = 0; slot < MAX_SNAPSHOTS; slot++)
+    {
+        if(superblock->snapshots[slot].first_block &&
+           !strncmp(superblock->snapshots[slot].name, name, SNAPSHOT_NAME))
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// State shared by the fsck workers. owner[] holds the lowest numbered inode (plus one)
+// that claims each block, so a block claimed twice is charged to the higher inode no matter
+// which thread got there first.
+struct fsckState
+{
+    int32_t  * owner;
+    uint32_t * file_refs;     // live block pointers and map entries naming each block
+    uint8_t  * is_map;        // blocks some extension inode uses as a map block
+    uint16_t * refs;          // in-use directory entries naming each inode
+    int32_t  * first_bad;     // first block index of each inode that is out of range or taken
+    uint32_t * stale;         // block pointers past the end of each file
+    uint32_t   checked;
+};
+
+int fsckWanted(struct fsckState * state, int32_t inode)
+{
+    return state->refs[inode] && inodeInfo(inode)->in_use;
+}
+
+// The lowest numbered inode wins a block claimed more than once. Files may still share data
+// blocks (clones), as long as the reference counts say so.
+void fsckClaimBlock(struct fsckState * state, int32_t block, int32_t inode)
+{
+    __atomic_fetch_add(&state->file_refs[block], 1, __ATOMIC_RELAXED);
+
+    int32_t mine = inode + 1;
+    int32_t seen = __atomic_load_n(&state->owner[block], __ATOMIC_RELAXED);
+    while((seen == 0 || seen > mine) &&
+          !__atomic_compare_exchange_n(&state->owner[block], &seen, mine, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+// Map blocks an extension inode of count blocks needs, capped at what it can hold
+uint32_t fsckMaps(int32_t inode, uint32_t count)
+{
+    uint32_t maps = mapsFor(inode, count);
+    return maps < EXT_MAPS ? maps : EXT_MAPS;
+}
+
+// First pass: every block of every live inode claims its block, as do the map blocks of
+// extension inodes
+void fsckClaim(int32_t first, int32_t last, void * arg)
+{
+    struct fsckState * state = arg;
+    int32_t inode;
+    for(inode = first; inode < last; inode++)
+    {
+        if(!fsckWanted(state, inode))
+        {
+            continue;
+        }
+
+        uint32_t count = blockCount(inode) + reservedBlocks(inode);
+        uint32_t index;
+        for(index = 0; index < count && index < BLOCKS_PER_FILE; index++)
+        {
+            int32_t block = fileBlock(inode, index);
+            if(validDataBlock(block))
+            {
+                fsckClaimBlock(state, block, inode);
+            }
+        }
+
+        for(index = 0; index < fsckMaps(inode, count); index++)
+        {
+            if(validDataBlock(extFile(inode)->maps[index]))
+            {
+                fsckClaimBlock(state, extFile(inode)->maps[index], inode);
+                __atomic_store_n(&state->is_map[extFile(inode)->maps[index]], 1,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+// Second pass: find the first block each inode can not keep and any stale pointers
+void fsckCheck(int32_t first, int32_t last, void * arg)
+{
+    struct fsckState * state = arg;
+    uint32_t checked = 0;
+    int32_t inode;
+    for(inode = first; inode < last; inode++)
+    {
+        state->first_bad[inode] = -1;
+        state->stale[inode] = 0;
+        if(!fsckWanted(state, inode) || isInline(inode))
+        {
+            continue;
+        }
+
+        // Block numbers an extension inode has no map block for are -1 and need no look
+        uint32_t count = BLOCKS_FOR(inodeInfo(inode)->file_size);
+        uint32_t reserved = count + reservedBlocks(inode);
+        uint32_t limit = BLOCKS_PER_FILE;
+        uint32_t index;
+        if(inode >= NUM_FILES)
+        {
+            limit = EXT_DIRECT;
+            for(index = 0; index < EXT_MAPS; index++)
+            {
+                limit = validDataBlock(extFile(inode)->maps[index])
+                        ? EXT_DIRECT + (index + 1) * MAP_ENTRIES : limit;
+            }
+            limit = limit < BLOCKS_PER_FILE ? limit : BLOCKS_PER_FILE;
+        }
+
+        for(index = 0; index < limit; index++)
+        {
+            int32_t block = fileBlock(inode, index);
+            if(index >= reserved)
+            {
+                state->stale[inode] += (block != -1);
+                continue;
+            }
+
+            // A reserved block must be the file's alone; a bad one counts as stale so repair
+            // drops the reservation
+            if(index >= count)
+            {
+                state->stale[inode] += !validDataBlock(block) || state->is_map[block] ||
+                                       state->owner[block] != inode + 1 ||
+                                       state->file_refs[block] != 1;
+                continue;
+            }
+
+            // A data block may be shared when there are reference counts to track it, but
+            // never with a map block
+            checked++;
+            if(state->first_bad[inode] == -1 &&
+               (!validDataBlock(block) || state->is_map[block] ||
+                (block_refs == NULL && state->owner[block] != inode + 1)))
+            {
+                state->first_bad[inode] = index;
+            }
+        }
+
+        // A lost map block loses every block number it holds
+        uint32_t maps = fsckMaps(inode, reserved);
+        for(index = 0; inode >= NUM_FILES && index < EXT_MAPS; index++)
+        {
+            int32_t map = extFile(inode)->maps[index];
+            if(index >= maps)
+            {
+                state->stale[inode] += (map != 0);
+                continue;
+            }
+
+            int32_t lost = EXT_DIRECT + index * MAP_ENTRIES;
+            if((!validDataBlock(map) || state->owner[map] != inode + 1 ||
+                state->file_refs[map] != 1) &&
+               (state->first_bad[inode] == -1 || state->first_bad[inode] > lost))
+            {
+                state->first_bad[inode] = lost;
+            }
+        }
+    }
+
+    __atomic_fetch_add(&state->checked, checked, __ATOMIC_RELAXED);
+}
+
+int fsckSnapFile(struct snapFile * file, int32_t * blocks, void * arg)
+{
+    uint16_t * refs = arg;
+    uint32_t index;
+    for(index = 0; refs != NULL && index < snapBlocks(file); index++)
+    {
+        refs[blocks[index]]++;
+    }
+    return 0;
+}
+
+void fsckSnapChain(int32_t block, void * arg)
+{
+    uint16_t * refs = arg;
+    if(refs != NULL)
+    {
+        refs[block]++;
+    }
+}
+
+int compareEntryNames(const void * a, const void * b)
+{
+    return strncmp(dirEntry(*(const int32_t*) a)->filename,
+                   dirEntry(*(const int32_t*) b)->filename, MAX_FILENAME);
+}
+
+// Cross-check the directory, inodes and both free maps. Every problem is printed unless quiet
+// is set, and fixed when repair is set. Returns the number of problems found.
+uint32_t fsck(int quiet, int repair)
+{
+    struct fsckState state;
+    memset(&state, 0, sizeof(state));
+    state.owner = calloc(NUM_BLOCKS, sizeof(int32_t));
+    state.file_refs = calloc(NUM_BLOCKS, sizeof(uint32_t));
+    state.is_map = calloc(NUM_BLOCKS, 1);
+    state.refs = calloc(num_files, sizeof(uint16_t));
+    state.first_bad = calloc(num_files, sizeof(int32_t));
+    state.stale = calloc(num_files, sizeof(uint32_t));
+    int32_t * names = calloc(num_files, sizeof(int32_t));
+    uint16_t * snap_refs = calloc(NUM_BLOCKS, sizeof(uint16_t));
+
+    uint32_t problems = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(state.owner == NULL || state.file_refs == NULL || state.is_map == NULL ||
+       state.refs == NULL || state.first_bad == NULL ||
+       state.stale == NULL || names == NULL || snap_refs == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        goto done;
+    }
+
+#define FSCK_REPORT(...) do { problems++; if(!quiet) printf(__VA_ARGS__); } while(0)
+
+    // Everything below walks the data region and the tables the superblock points at
+    if(!validMetaTop())
+    {
+        FSCK_REPORT("the superblock puts the end of the data region at block %d\n",
+                    superblock->meta_top);
+        goto done;
+    }
+    int bad_tables = 0;
+    if(!validTable(superblock->crc_table, CRC_BLOCKS))
+    {
+        FSCK_REPORT("the checksum table at block %d is out of range\n", superblock->crc_table);
+        bad_tables++;
+        if(repair)
+        {
+            superblock->crc_table = 0;
+            block_crc = NULL;
+        }
+    }
+    if(!validTable(superblock->ref_table, REF_BLOCKS))
+    {
+        FSCK_REPORT("the reference count table at block %d is out of range\n",
+                    superblock->ref_table);
+        bad_tables++;
+        if(repair)
+        {
+            superblock->ref_table = 0;
+            block_refs = NULL;
+        }
+    }
+    if(bad_tables && !repair)
+    {
+        goto done;
+    }
+
+    // Directory entries must name a live inode, and each inode only once
+    int32_t i;
+    int32_t num_names = 0;
+    for(i = 0; i < num_files; i++)
+    {
+        if(!dirEntry(i)->in_use)
+        {
+            continue;
+        }
+
+        int32_t inode = dirEntry(i)->inode;
+        if(inode < 0 || inode >= num_files || !inodeInfo(inode)->in_use)
+        {
+            FSCK_REPORT("entry %d (%.64s) points at free or invalid inode %d\n",
+                        i, dirEntry(i)->filename, inode);
+            if(repair)
+            {
+                dirEntry(i)->in_use = 0;
+            }
+            continue;
+        }
+
+        if(state.refs[inode])
+        {
+            FSCK_REPORT("entry %d (%.64s) shares inode %d with another entry\n",
+                        i, dirEntry(i)->filename, inode);
+            if(repair)
+            {
+                dirEntry(i)->in_use = 0;
+                continue;
+            }
+        }
+
+        state.refs[inode]++;
+        names[num_names++] = i;
+
+        if(inodeInfo(inode)->file_size > MAX_FILE_SIZE)
+        {
+            FSCK_REPORT("inode %d is %u bytes, over the %d byte limit\n", inode,
+                        inodeInfo(inode)->file_size, MAX_FILE_SIZE);
+            if(repair)
+            {
+                inodeInfo(inode)->file_size = MAX_FILE_SIZE;
+            }
+        }
+
+        // An inline file must fit in its inode, and a packed tail in its tail block
+        struct inodeInfo * info = inodeInfo(inode);
+        uint32_t partial = info->file_size % BLOCK_SIZE;
+        if(info->tail == TAIL_INLINE && info->file_size > inlineMax(inode))
+        {
+            FSCK_REPORT("inode %d is %u bytes, too large to be inline\n", inode,
+                        info->file_size);
+            if(repair)
+            {
+                info->file_size = inlineMax(inode);
+            }
+        }
+        else if(info->tail && info->tail != TAIL_INLINE &&
+                (info->tail > TAIL_SLOTS || partial == 0 || partial > TAIL_MAX ||
+                 (info->tail - 1) * TAIL_SLOT + partial > BLOCK_SIZE))
+        {
+            FSCK_REPORT("inode %d has a bad tail slot, %u bytes are lost\n", inode, partial);
+            if(repair)
+            {
+                info->file_size -= partial ? partial : BLOCK_SIZE;
+                info->tail = 0;
+            }
+        }
+    }
+
+    // Names must be unique; later duplicates are renamed with a numeric suffix
+    qsort(names, num_names, sizeof(int32_t), compareEntryNames);
+    for(i = 1; i < num_names; i++)
+    {
+        if(compareEntryNames(&names[i - 1], &names[i]) != 0)
+        {
+            continue;
+        }
+
+        char * filename = dirEntry(names[i])->filename;
+        FSCK_REPORT("entry %d duplicates the name %.64s\n", names[i], filename);
+        if(repair)
+        {
+            char renamed[MAX_FILENAME + 16];
+            int n;
+            int len = 0;
+            for(n = 1; n < 1000; n++)
+            {
+                len = snprintf(renamed, sizeof(renamed), "%.*s.%d", MAX_FILENAME - 4, filename,
+                               n);
+                if(findFile(renamed) == -1)
+                {
+                    break;
+                }
+            }
+
+            // A new name is only stored whole, so with no free suffix the entry keeps its name
+            if(n == 1000 || len > MAX_FILENAME)
+            {
+                printf("ERROR: entry %d can not be renamed: %s\n", names[i],
+                       mfs_strerror(MFS_ERR_NAME));
+                last_status = MFS_ERR_NAME;
+                continue;
+            }
+            memset(filename, 0, MAX_FILENAME);
+            memcpy(filename, renamed, len);
+        }
+    }
+
+    // Block ownership is worked out per inode on all cores
+    parallelFor(0, num_files, fsckClaim, &state);
+    parallelFor(0, num_files, fsckCheck, &state);
+
+    for(i = 0; i < num_files; i++)
+    {
+        if(inodeInfo(i)->in_use && !state.refs[i])
+        {
+            FSCK_REPORT("inode %d is in use but no directory entry names it\n", i);
+            if(repair)
+            {
+                inodeInfo(i)->in_use = 0;
+            }
+        }
+        else if(i < NUM_FILES && (free_inodes[i] != 0) == (inodeInfo(i)->in_use != 0))
+        {
+            FSCK_REPORT("inode %d is %s in the free inode map\n", i,
+                        free_inodes[i] ? "free" : "in use");
+        }
+
+        if(state.first_bad[i] != -1)
+        {
+            FSCK_REPORT("inode %d: block %d is out of range or belongs to another file, "
+                        "%u bytes are lost\n", i, state.first_bad[i],
+                        inodeInfo(i)->file_size - state.first_bad[i] * BLOCK_SIZE);
+            if(repair)
+            {
+                inodeInfo(i)->file_size = state.first_bad[i] * BLOCK_SIZE;
+                inodeInfo(i)->tail = 0;
+            }
+        }
+
+        if(state.stale[i])
+        {
+            FSCK_REPORT("inode %d has %u block pointers past the end of the file\n",
+                        i, state.stale[i]);
+        }
+
+        // A sound reservation is kept; anything wrong with it drops all of it
+        if(repair && inodeInfo(i)->in_use && !isInline(i))
+        {
+            uint32_t keep = BLOCKS_FOR(inodeInfo(i)->file_size);
+            keep += state.first_bad[i] == -1 && !state.stale[i] ? reservedBlocks(i) : 0;
+            uint32_t index;
+            for(index = keep; index < BLOCKS_PER_FILE; index++)
+            {
+                setFileBlock(i, index, -1);
+            }
+            for(index = mapsFor(i, keep); i >= NUM_FILES && index < EXT_MAPS; index++)
+            {
+                extFile(i)->maps[index] = 0;
+            }
+        }
+    }
+
+    // Snapshots hold their chain blocks and one reference to every block they froze.
+    // A damaged snapshot is checked without counting so it can be dropped as a whole.
+    for(i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if(!superblock->snapshots[i].first_block)
+        {
+            continue;
+        }
+
+        if(snapshotWalk(i, fsckSnapFile, fsckSnapChain, NULL) == -1)
+        {
+            FSCK_REPORT("snapshot %.32s is damaged\n", superblock->snapshots[i].name);
+            if(repair)
+            {
+                memset(&superblock->snapshots[i], 0, sizeof(struct snapshotEntry));
+            }
+            continue;
+        }
+        snapshotWalk(i, fsckSnapFile, fsckSnapChain, snap_refs);
+    }
+
+    // A block is in use exactly when a file or snapshot refers to it
+    int32_t block;
+    uint32_t leaked = 0;
+    uint32_t unmarked = 0;
+    uint32_t miscounted = 0;
+    if(repair)
+    {
+        // Recount references from the repaired inodes, truncated files give up their blocks
+        memset(state.file_refs, 0, NUM_BLOCKS * sizeof(uint32_t));
+        for(i = 0; i < num_files; i++)
+        {
+            if(inodeInfo(i)->in_use)
+            {
+                uint32_t count = blockCount(i) + reservedBlocks(i);
+                uint32_t index;
+                for(index = 0; index < count; index++)
+                {
+                    state.file_refs[fileBlock(i, index)]++;
+                }
+                for(index = 0; index < mapsFor(i, count); index++)
+                {
+                    state.file_refs[extFile(i)->maps[index]]++;
+                }
+            }
+        }
+    }
+
+    for(block = FIRST_DATA_BLOCK; block < superblock->meta_top; block++)
+    {
+        uint32_t refs = state.file_refs[block] + snap_refs[block];
+        int owned = refs != 0;
+        if(block_refs != NULL && block_refs[block] != refs)
+        {
+            miscounted++;
+            if(repair)
+            {
+                block_refs[block] = refs;
+            }
+        }
+
+        if(owned && free_blocks[block])
+        {
+            unmarked++;
+        }
+        else if(!owned && !free_blocks[block])
+        {
+            leaked++;
+        }
+
+        if(repair)
+        {
+            free_blocks[block] = !owned;
+        }
+    }
+
+    for(block = superblock->meta_top; block < NUM_BLOCKS; block++)
+    {
+        if(free_blocks[block])
+        {
+            unmarked++;
+            if(repair)
+            {
+                free_blocks[block] = 0;
+            }
+        }
+    }
+
+    if(unmarked)
+    {
+        FSCK_REPORT("%u blocks in use are marked free in the free block map\n", unmarked);
+    }
+    if(leaked)
+    {
+        FSCK_REPORT("%u blocks are marked in use but no file owns them\n", leaked);
+    }
+    if(miscounted)
+    {
+        FSCK_REPORT("%u blocks have the wrong reference count\n", miscounted);
+    }
+
+    if(repair)
+    {
+        for(i = 0; i < NUM_FILES; i++)
+        {
+            free_inodes[i] = !inodeInfo(i)->in_use;
+        }
+        pinMaps(0);
+        indexRebuild();
+        ext_free = NUM_FILES;
+        tail_block = -1;
+    }
+
+#undef FSCK_REPORT
+
+done:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(!quiet)
+    {
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("fsck: %u block pointers checked in %.2f ms, %u problems%s\n", state.checked,
+               ms, problems, repair && problems ? " repaired, savefs to keep the repairs" : "");
+    }
+
+    free(state.owner);
+    free(state.file_refs);
+    free(state.is_map);
+    free(state.refs);
+    free(state.first_bad);
+    free(state.stale);
+    free(names);
+    free(snap_refs);
+    return problems;
+}
+
+struct fragStats
+{
+    uint32_t files;
+    uint32_t fragmented_files;
+    uint32_t fragments;
+    uint32_t free_runs;
+    uint32_t largest_free_run;
+};
+
+// Contiguous runs making up the blocks of inode that are its own. A packed tail is elsewhere by
+// design and is not counted as a fragment.
+uint32_t fileRuns(int32_t inode)
+{
+    uint32_t count = ownBlocks(inode);
+    uint32_t runs = count > 0;
+    uint32_t index;
+    for(index = 1; index < count; index++)
+    {
+        runs += fileBlock(inode, index) != fileBlock(inode, index - 1) + 1;
+    }
+    return runs;
+}
+
+// Count the contiguous runs making up each file and the runs of free blocks
+void fragStats(struct fragStats * stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    int i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(!entryLive(i))
+        {
+            continue;
+        }
+
+        uint32_t runs = fileRuns(dirEntry(i)->inode);
+
+        stats->files++;
+        stats->fragments += runs;
+        stats->fragmented_files += runs > 1;
+    }
+
+    uint32_t run = 0;
+    int32_t block;
+    for(block = FIRST_DATA_BLOCK; block <= superblock->meta_top; block++)
+    {
+        if(block < superblock->meta_top && free_blocks[block])
+        {
+            run++;
+            continue;
+        }
+        if(run)
+        {
+            stats->free_runs++;
+            if(run > stats->largest_free_run)
+            {
+                stats->largest_free_run = run;
+            }
+        }
+        run = 0;
+    }
+}
+
+void printFragStats(const char * label, struct fragStats * stats)
+{
+    printf("%s: %u files in %u fragments, %u fragmented; free space in %u runs, "
+           "largest %u blocks\n", label, stats->files, stats->fragments,
+           stats->fragmented_files, stats->free_runs, stats->largest_free_run);
+}
+
+// Owner in defragSteps() of a block that holds packed tails
+#define DEFRAG_TAILS -2
+
+// Where a round of defrag stands. owner is the inode a block is placed for, DEFRAG_TAILS, or -1
+// for a block that stays put. moved and at follow the blocks as they trade places, so that
+// everything referring to them can be pointed at their new places once the round is over.
+struct defragState
+{
+    int32_t * owner;
+    int32_t * tails;        // tails packed in each tail block, counted before anything moves
+    int32_t * moved;        // where the block that was at b is now
+    int32_t * at;           // where the block now at b was
+};
+
+// Put the block at from where the block at to is. That one is free or can move too, and goes to
+// from in exchange. Returns the number of blocks written, or -1 if the cache can not take in a
+// block.
+int32_t defragMove(struct defragState * st, int32_t from, int32_t to)
+{
+    uint8_t tmp[BLOCK_SIZE];
+    uint8_t * src = getBlock(from);
+    uint8_t * dst = src == NULL ? NULL : free_blocks[to] ? newBlock(to) : getBlock(to);
+    if(dst == NULL)
+    {
+        if(src != NULL)
+        {
+            putBlock(from, 0);
+        }
+        return -1;
+    }
+
+    int32_t other = free_blocks[to] ? -1 : st->owner[to];
+    int32_t written;
+
+    if(free_blocks[to])
+    {
+        memcpy(dst, src, BLOCK_SIZE);
+        putBlock(to, 1);
+        putBlock(from, 0);
+
+        // Everything that refers to the block keeps its reference
+        refBlock(to);
+        if(block_refs != NULL)
+        {
+            block_refs[to] = block_refs[from];
+            block_refs[from] = 1;
+        }
+        releaseBlock(from);
+        written = 1;
+    }
+    else
+    {
+        memcpy(tmp, dst, BLOCK_SIZE);
+        memcpy(dst, src, BLOCK_SIZE);
+        memcpy(src, tmp, BLOCK_SIZE);
+        putBlock(to, 1);
+        putBlock(from, 1);
+
+        if(block_refs != NULL)
+        {
+            uint16_t refs = block_refs[to];
+            block_refs[to] = block_refs[from];
+            block_refs[from] = refs;
+        }
+        written = 2;
+    }
+
+    int32_t was = st->at[from];
+    st->at[from] = st->at[to];
+    st->moved[st->at[from]] = from;
+    st->at[to] = was;
+    st->moved[was] = to;
+
+    st->owner[to] = st->owner[from];
+    st->owner[from] = other;
+    return written;
+}
+
+// Point every file and every snapshot at where its blocks are now. Returns -1 if a snapshot
+// could not be rewritten.
+int defragRemap(struct defragState * st)
+{
+    int32_t inode;
+    for(inode = 0; inode < num_files; inode++)
+    {
+        if(!inodeInfo(inode)->in_use)
+        {
+            continue;
+        }
+
+        uint32_t count = blockCount(inode) + reservedBlocks(inode);
+        uint32_t index;
+        for(index = 0; index < count; index++)
+        {
+            int32_t block = fileBlock(inode, index);
+            if(validDataBlock(block) && st->moved[block] != block)
+            {
+                setFileBlock(inode, index, st->moved[block]);
+            }
+        }
+    }
+
+    int ret = 0;
+    int i;
+    for(i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if(superblock->snapshots[i].first_block != 0 && snapshotRemap(i, st->moved) == -1)
+        {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// First block from target on that is free or can be moved out of the way
+int32_t defragTarget(int32_t target, int32_t * owner)
+{
+    while(target < superblock->meta_top && !free_blocks[target] && owner[target] == -1)
+    {
+        target++;
+    }
+    return target;
+}
+
+// Move up to budget blocks so that files lie in directory order, each in one contiguous run,
+// starting at the first data block, followed by the blocks packed tails live in, and the free
+// space collects at the end. Files already in place are skipped, so calling this again picks
+// up where the last call stopped. A block in the way is swapped with the one being placed, so
+// no free space is needed. A block two files share is placed with the first of them, and the
+// other one stays where it is; if a snapshot can not be read, so does every file with a shared
+// block, as the snapshot could not be pointed at where it went. Blocks no file owns stay put,
+// and a file only moves into a stretch with none of those in it that is long enough for all
+// of it. Returns the number of blocks written, and counts the files kept in place by sharing
+// in held.
+uint32_t defragSteps(uint32_t budget, uint32_t * held)
+{
+    struct defragState st;
+    int32_t * maps = malloc(4 * NUM_BLOCKS * sizeof(int32_t));
+    if(maps == NULL)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        return 0;
+    }
+
+    st.owner = maps;
+    st.tails = maps + NUM_BLOCKS;
+    st.moved = maps + 2 * NUM_BLOCKS;
+    st.at = maps + 3 * NUM_BLOCKS;
+    memset(st.owner, 0xff, NUM_BLOCKS * sizeof(int32_t));
+    memset(st.tails, 0, NUM_BLOCKS * sizeof(int32_t));
+
+    int32_t block;
+    for(block = 0; block < NUM_BLOCKS; block++)
+    {
+        st.moved[block] = block;
+        st.at[block] = block;
+    }
+    *held = 0;
+
+    // The tail block being filled may be moved, so later tails start a new one
+    tail_block = -1;
+
+    // Shared blocks can only move when every snapshot referring to them can be rewritten
+    int remap = 1;
+    int i;
+    for(i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if(superblock->snapshots[i].first_block != 0 &&
+           snapshotWalk(i, snapshotCheckFile, NULL, NULL) == -1)
+        {
+            remap = 0;
+        }
+    }
+
+    // Only blocks of files that can move get an owner; the rest are in the way of every file
+    for(i = 0; i < num_files; i++)
+    {
+        if(!entryLive(i))
+        {
+            continue;
+        }
+
+        int32_t inode = dirEntry(i)->inode;
+        uint32_t count = ownBlocks(inode) + reservedBlocks(inode);
+        uint32_t index;
+        if(inodeInfo(inode)->tail && blockCount(inode))
+        {
+            int32_t tail = fileBlock(inode, blockCount(inode) - 1);
+            st.owner[tail] = DEFRAG_TAILS;
+            st.tails[tail]++;
+        }
+
+        for(index = 0; index < count && (remap || !isShared(fileBlock(inode, index))); index++)
+        {
+        }
+        if(index < count)
+        {
+            continue;
+        }
+
+        for(index = 0; index < count; index++)
+        {
+            if(st.owner[fileBlock(inode, index)] == -1)
+            {
+                st.owner[fileBlock(inode, index)] = inode;
+            }
+        }
+    }
+
+    // Without a way to rewrite the snapshots, a tail block only moves when the tails packed in
+    // it are all that refer to it
+    for(block = FIRST_DATA_BLOCK; block < superblock->meta_top && !remap; block++)
+    {
+        if(st.owner[block] == DEFRAG_TAILS && block_refs != NULL &&
+           block_refs[block] != st.tails[block])
+        {
+            st.owner[block] = -1;
+        }
+    }
+
+    uint32_t written = 0;
+    int32_t target = FIRST_DATA_BLOCK;
+
+    for(i = 0; i < num_files && written < budget; i++)
+    {
+        if(!entryLive(i))
+        {
+            continue;
+        }
+
+        // A reservation moves along with the file so it stays just after it
+        int32_t inode = dirEntry(i)->inode;
+        uint32_t blocks = ownBlocks(inode) + reservedBlocks(inode);
+        uint32_t index;
+        for(index = 0; index < blocks && st.owner[st.moved[fileBlock(inode, index)]] == inode;
+            index++)
+        {
+        }
+        if(blocks == 0)
+        {
+            continue;
+        }
+        if(index < blocks)
+        {
+            // Only a shared block keeps a file's block from being its own to place
+            (*held)++;
+            continue;
+        }
+
+        // The file goes in the first stretch from target on that has nothing fixed in it
+        int32_t start = target;
+        for(block = start; block < start + (int32_t) blocks && block < superblock->meta_top;
+            block++)
+        {
+            if(!free_blocks[block] && st.owner[block] == -1)
+            {
+                start = block + 1;
+            }
+        }
+        if(start + blocks > superblock->meta_top)
+        {
+            // Nowhere to put it whole, so it stays put and later files go around it
+            for(index = 0; index < blocks; index++)
+            {
+                st.owner[st.moved[fileBlock(inode, index)]] = -1;
+            }
+            continue;
+        }
+        target = start;
+
+        index = 0;
+        while(index < blocks && written < budget)
+        {
+            int32_t from = st.moved[fileBlock(inode, index)];
+            if(from != target)
+            {
+                // A block the cache can not take in ends the round
+                int32_t moved = defragMove(&st, from, target);
+                if(moved == -1)
+                {
+                    budget = written;
+                    break;
+                }
+                written += moved;
+            }
+            index++;
+            target++;
+        }
+    }
+
+    // The tail blocks go after the last file, lowest first
+    int32_t next = target;
+    while(written < budget)
+    {
+        target = defragTarget(target, st.owner);
+        if(next <= target)
+        {
+            next = target + 1;
+        }
+        if(target < superblock->meta_top && st.owner[target] == DEFRAG_TAILS)
+        {
+            target++;
+            continue;
+        }
+
+        while(next < superblock->meta_top &&
+              (free_blocks[next] || st.owner[next] != DEFRAG_TAILS))
+        {
+            next++;
+        }
+        if(next >= superblock->meta_top)
+        {
+            break;
+        }
+
+        int32_t moved = defragMove(&st, next, target);
+        if(moved == -1)
+        {
+            budget = written;
+            break;
+        }
+        written += moved;
+        target++;
+        next++;
+    }
+
+    if(written > 0 && defragRemap(&st) == -1)
+    {
+        printf("ERROR: A snapshot could not be pointed at the blocks defrag moved\n");
+        last_status = MFS_ERR_IO;
+    }
+
+    free(maps);
+    return written;
+}
+
+// defrag [max blocks]: one bounded round of compaction, 8192 block writes unless told otherwise
+void defrag(char * budget_text)
+{
+    uint32_t budget = 8192;
+    if(budget_text != NULL)
+    {
+        char * end;
+        budget = strtoul(budget_text, &end, 0);
+        if(*end != '\0' || budget == 0)
+        {
+            printf("ERROR: Incorrect parameter %s.\n", budget_text);
+            last_status = MFS_ERR_BAD_REQUEST;
+            return;
+        }
+    }
+
+    struct fragStats before, after;
+    fragStats(&before);
+    printFragStats("before", &before);
+
+    uint32_t held;
+    uint32_t written = defragSteps(budget, &held);
+
+    fragStats(&after);
+    printFragStats("after", &after);
+
+    // Shared blocks and blocks no file owns can leave the image short of compact for good
+    printf("defrag: %u blocks written%s", written,
+           written >= budget ? ", run defrag again to continue" :
+           after.fragmented_files == 0 && after.free_runs <= 1 ? ", image is compact" :
+           ", blocks no file owns keep the rest in place");
+    if(held > 0)
+    {
+        printf(", %u files sharing blocks with another file or a snapshot were left in place",
+               held);
+    }
+    printf("\n");
+}
+
+// layout [--json]: where the space of the image goes. Free runs and file fragments are counted
+// in power-of-two buckets: bucket b holds lengths from 2^b up to 2^(b+1) - 1.
+#define LAYOUT_BUCKETS 17
+#define LAYOUT_WORST   5
+
+struct layoutStats
+{
+    struct fragStats frag;
+    uint32_t data_blocks;
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t run_count[LAYOUT_BUCKETS];
+    uint32_t run_blocks[LAYOUT_BUCKETS];
+    uint32_t file_count[LAYOUT_BUCKETS];        // files by number of fragments
+    int32_t  worst[LAYOUT_WORST];               // most fragmented entries, -1 when unused
+    uint32_t worst_runs[LAYOUT_WORST];
+    uint32_t entries_used;
+    uint32_t inodes_used;
+    uint32_t partial_files;     // files whose last block of their own is partly used
+    uint64_t partial_waste;
+    uint32_t packed_files;
+    uint32_t tail_blocks;
+    uint64_t tail_unused;
+    uint32_t inline_files;
+};
+
+int layoutBucket(uint32_t len)
+{
+    int b = 0;
+    while(b < LAYOUT_BUCKETS - 1 && len >> (b + 1))
+    {
+        b++;
+    }
+    return b;
+}
+
+// Returns -1 when there is no memory for the map of tail blocks
+int layoutStats(struct layoutStats * stats)
+{
+    uint8_t * tails = calloc(NUM_BLOCKS, 1);
+    if(tails == NULL)
+    {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    memset(stats->worst, 0xff, sizeof(stats->worst));
+    fragStats(&stats->frag);
+    stats->data_blocks = superblock->meta_top - FIRST_DATA_BLOCK;
+    stats->free_blocks = df() / BLOCK_SIZE;
+    stats->reserved_blocks = reservedBytes() / BLOCK_SIZE;
+
+    uint32_t run = 0;
+    int32_t block;
+    for(block = FIRST_DATA_BLOCK; block <= superblock->meta_top; block++)
+    {
+        if(block < superblock->meta_top && free_blocks[block])
+        {
+            run++;
+            continue;
+        }
+        if(run)
+        {
+            stats->run_count[layoutBucket(run)]++;
+            stats->run_blocks[layoutBucket(run)] += run;
+        }
+        run = 0;
+    }
+
+    int32_t i;
+    for(i = 0; i < num_files; i++)
+    {
+        stats->inodes_used += inodeInfo(i)->in_use != 0;
+        if(!entryLive(i))
+        {
+            continue;
+        }
+        stats->entries_used++;
+
+        int32_t inode = dirEntry(i)->inode;
+        uint32_t size = inodeInfo(inode)->file_size;
+        uint32_t count = blockCount(inode);
+        uint32_t runs = fileRuns(inode);
+        if(runs)
+        {
+            stats->file_count[layoutBucket(runs)]++;
+        }
+
+        // Keep the most fragmented files, most fragments first
+        int k = LAYOUT_WORST;
+        while(k > 0 && runs > 1 &&
+              (stats->worst[k - 1] == -1 || stats->worst_runs[k - 1] < runs))
+        {
+            k--;
+        }
+        if(k < LAYOUT_WORST)
+        {
+            size_t move = LAYOUT_WORST - k - 1;
+            memmove(&stats->worst[k + 1], &stats->worst[k], move * sizeof(int32_t));
+            memmove(&stats->worst_runs[k + 1], &stats->worst_runs[k], move * sizeof(uint32_t));
+            stats->worst[k] = i;
+            stats->worst_runs[k] = runs;
+        }
+
+        if(isInline(inode))
+        {
+            stats->inline_files++;
+        }
+        else if(inodeInfo(inode)->tail && count)
+        {
+            int32_t tail = fileBlock(inode, count - 1);
+            stats->packed_files++;
+            stats->tail_unused -= size - (count - 1) * BLOCK_SIZE;
+            if(!tails[tail])
+            {
+                tails[tail] = 1;
+                stats->tail_blocks++;
+                stats->tail_unused += BLOCK_SIZE;
+            }
+        }
+        else if(size % BLOCK_SIZE)
+        {
+            stats->partial_files++;
+            stats->partial_waste += BLOCK_SIZE - size % BLOCK_SIZE;
+        }
+    }
+
+    free(tails);
+    return 0;
+}
+
+void printLayoutText(struct layoutStats * stats)
+{
+    uint32_t free_count = stats->free_blocks;
+    printf("data blocks: %u, %u used, %u free, %u more reserved by fallocate\n",
+           stats->data_blocks, stats->data_blocks - free_count - stats->reserved_blocks,
+           free_count, stats->reserved_blocks);
+    printf("free space: %u runs, largest %u blocks (%.1f%% of free space)\n",
+           stats->frag.free_runs, stats->frag.largest_free_run,
+           free_count ? 100.0 * stats->frag.largest_free_run / free_count : 0.0);
+
+    int b;
+    printf("%-14s %10s %10s\n", "free run", "runs", "blocks");
+    for(b = 0; b < LAYOUT_BUCKETS; b++)
+    {
+        if(stats->run_count[b])
+        {
+            char range[32];
+            snprintf(range, sizeof(range), b ? "%u-%u" : "%u", 1u << b, (2u << b) - 1);
+            printf("%-14s %10u %10u\n", range, stats->run_count[b], stats->run_blocks[b]);
+        }
+    }
+
+    printf("files: %u in %u fragments, %u fragmented\n", stats->frag.files,
+           stats->frag.fragments, stats->frag.fragmented_files);
+    printf("%-14s %10s\n", "fragments", "files");
+    for(b = 0; b < LAYOUT_BUCKETS; b++)
+    {
+        if(stats->file_count[b])
+        {
+            char range[32];
+            snprintf(range, sizeof(range), b ? "%u-%u" : "%u", 1u << b, (2u << b) - 1);
+            printf("%-14s %10u\n", range, stats->file_count[b]);
+        }
+    }
+    for(b = 0; b < LAYOUT_WORST && stats->worst[b] != -1; b++)
+    {
+        struct directoryEntry * entry = dirEntry(stats->worst[b]);
+        printf("  %.64s: %u fragments in %u blocks\n", entry->filename, stats->worst_runs[b],
+               ownBlocks(entry->inode));
+    }
+
+    printf("directory: %u of %d entries used (%.1f%%), %u extension chunks\n",
+           stats->entries_used, num_files, 100.0 * stats->entries_used / num_files,
+           superblock->ext_chunks);
+    printf("inodes: %u of %d used (%.1f%%)\n", stats->inodes_used, num_files,
+           100.0 * stats->inodes_used / num_files);
+    printf("tails: %u files waste %llu bytes in partial last blocks; %u packed tails leave "
+           "%llu bytes of %u tail blocks unused; %u files inline\n", stats->partial_files,
+           (unsigned long long) stats->partial_waste, stats->packed_files,
+           (unsigned long long) stats->tail_unused, stats->tail_blocks, stats->inline_files);
+}
+
+void jsonPut(FILE * out, const char * text);
+
+void printLayoutJson(struct layoutStats * stats)
+{
+    printf("{\"image\":");
+    jsonPut(stdout, image_name);
+    printf(",\"block_size\":%d,\"data_blocks\":%u,\"free_blocks\":%u,\"reserved_blocks\":%u,",
+           BLOCK_SIZE, stats->data_blocks, stats->free_blocks, stats->reserved_blocks);
+    printf("\"free_runs\":{\"count\":%u,\"largest\":%u,\"histogram\":[", stats->frag.free_runs,
+           stats->frag.largest_free_run);
+
+    int b;
+    const char * sep = "";
+    for(b = 0; b < LAYOUT_BUCKETS; b++)
+    {
+        if(stats->run_count[b])
+        {
+            printf("%s{\"min\":%u,\"max\":%u,\"runs\":%u,\"blocks\":%u}", sep, 1u << b,
+                   (2u << b) - 1, stats->run_count[b], stats->run_blocks[b]);
+            sep = ",";
+        }
+    }
+
+    printf("]},\"files\":{\"count\":%u,\"fragments\":%u,\"fragmented\":%u,\"histogram\":[",
+           stats->frag.files, stats->frag.fragments, stats->frag.fragmented_files);
+    sep = "";
+    for(b = 0; b < LAYOUT_BUCKETS; b++)
+    {
+        if(stats->file_count[b])
+        {
+            printf("%s{\"min\":%u,\"max\":%u,\"files\":%u}", sep, 1u << b, (2u << b) - 1,
+                   stats->file_count[b]);
+            sep = ",";
+        }
+    }
+
+    // Every file, so a script can pick its own candidates for defrag
+    printf("],\"list\":[");
+    sep = "";
+    int32_t i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(entryLive(i))
+        {
+            char name[MAX_FILENAME + 1];
+            int32_t inode = dirEntry(i)->inode;
+            snprintf(name, sizeof(name), "%.64s", dirEntry(i)->filename);
+            printf("%s{\"name\":", sep);
+            jsonPut(stdout, name);
+            printf(",\"size\":%u,\"blocks\":%u,\"fragments\":%u}", inodeInfo(inode)->file_size,
+                   ownBlocks(inode), fileRuns(inode));
+            sep = ",";
+        }
+    }
+
+    printf("]},\"directory\":{\"entries\":%d,\"used\":%u,\"extension_chunks\":%u},",
+           num_files, stats->entries_used, superblock->ext_chunks);
+    printf("\"inodes\":{\"count\":%d,\"used\":%u},", num_files, stats->inodes_used);
+    printf("\"tails\":{\"partial_files\":%u,\"partial_waste\":%llu,\"packed_files\":%u,"
+           "\"tail_blocks\":%u,\"tail_unused\":%llu,\"inline_files\":%u}}\n",
+           stats->partial_files, (unsigned long long) stats->partial_waste,
+           stats->packed_files, stats->tail_blocks, (unsigned long long) stats->tail_unused,
+           stats->inline_files);
+}
+
+void layout(char * option)
+{
+    if(option != NULL && strcmp(option, "--json"))
+    {
+        printf("ERROR: Incorrect parameter %s.\n", option);
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    struct layoutStats stats;
+    if(layoutStats(&stats) == -1)
+    {
+        printf("ERROR: Out of memory\n");
+        last_status = MFS_ERR_NO_SPACE;
+        return;
+    }
+
+    if(option != NULL)
+    {
+        printLayoutJson(&stats);
+    }
+    else
+    {
+        printLayoutText(&stats);
+    }
+}
+
+// Freeze the current directory under name. Only metadata is copied: every live block gains a
+// reference and is copied the next time a live file writes to it.
+int32_t snapshotCreate(const char * name)
+{
+    if(block_refs == NULL)
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    if(strlen(name) >= SNAPSHOT_NAME)
+    {
+        return MFS_ERR_NAME;
+    }
+
+    if(findSnapshot(name) != -1)
+    {
+        return MFS_ERR_EXISTS;
+    }
+
+    int slot;
+    for(slot = 0; slot < MAX_SNAPSHOTS && superblock->snapshots[slot].first_block; slot++)
+    {
+    }
+
+    if(slot == MAX_SNAPSHOTS)
+    {
+        return MFS_ERR_NO_ENTRY;
+    }
+
+    struct snapStream st;
+    if(snapOpenWrite(&st) == -1)
+    {
+        return MFS_ERR_NO_SPACE;
+    }
+
+    uint32_t files = 0;
+    int i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(!entryLive(i))
+        {
+            continue;
+        }
+
+        int32_t inode = dirEntry(i)->inode;
+        struct snapFile file;
+        memset(&file, 0, sizeof(file));
+        memcpy(file.filename, dirEntry(i)->filename, MAX_FILENAME);
+        file.file_size = inodeInfo(inode)->file_size;
+        file.attribute = inodeInfo(inode)->attribute;
+        file.tail = inodeInfo(inode)->tail;
+
+        int32_t blocks[BLOCKS_PER_FILE];
+        uint32_t index;
+        for(index = 0; index < snapBlocks(&file); index++)
+        {
+            blocks[index] = fileBlock(inode, index);
+        }
+        if(file.tail == TAIL_INLINE)
+        {
+            memset(blocks, 0, snapWords(&file) * sizeof(int32_t));
+            memcpy(blocks, inlineData(inode), file.file_size);
+        }
+
+        if(snapWrite(&st, &file, sizeof(file)) == -1 ||
+           snapWrite(&st, blocks, snapWords(&file) * sizeof(int32_t)) == -1)
+        {
+            snapFinishBlock(&st);
+            snapReleaseChain(st.first);
+            return MFS_ERR_NO_SPACE;
+        }
+        files++;
+    }
+    snapFinishBlock(&st);
+
+    for(i = 0; i < num_files; i++)
+    {
+        if(entryLive(i))
+        {
+            int32_t inode = dirEntry(i)->inode;
+            uint32_t index;
+            for(index = 0; index < blockCount(inode); index++)
+            {
+                refBlock(fileBlock(inode, index));
+            }
+        }
+    }
+
+    struct snapshotEntry * snap = &superblock->snapshots[slot];
+    memset(snap, 0, sizeof(*snap));
+    strncpy(snap->name, name, SNAPSHOT_NAME - 1);
+    snap->created = time(NULL);
+    snap->first_block = st.first;
+    snap->files = files;
+    return MFS_OK;
+}
+
+int snapshotRelease(struct snapFile * file, int32_t * blocks, void * arg)
+{
+    uint32_t index;
+    for(index = 0; index < snapBlocks(file); index++)
+    {
+        releaseBlock(blocks[index]);
+    }
+    return 0;
+}
+
+int32_t snapshotDelete(const char * name)
+{
+    int32_t slot = findSnapshot(name);
+    if(slot == -1)
+    {
+        return MFS_ERR_NOT_FOUND;
+    }
+
+    if(snapshotWalk(slot, snapshotRelease, NULL, NULL) == -1)
+    {
+        return MFS_ERR_CORRUPT;
+    }
+    snapReleaseChain(superblock->snapshots[slot].first_block);
+    memset(&superblock->snapshots[slot], 0, sizeof(struct snapshotEntry));
+    return MFS_OK;
+}
+
+struct snapshotRestoreState
+{
+    int32_t next;       // entry and inode the next file goes into
+    int32_t status;
+};
+
+// Put a frozen file back into the next directory entry and inode, growing the tables when
+// the snapshot holds more files than they do
+int snapshotRestore(struct snapFile * file, int32_t * blocks, void * arg)
+{
+    struct snapshotRestoreState * state = arg;
+    int32_t inode = state->next;
+    if(inode == num_files && growFiles() == -1)
+    {
+        state->status = MFS_ERR_NO_ENTRY;
+        return 1;
+    }
+
+    dirEntry(inode)->in_use = 1;
+    dirEntry(inode)->inode = inode;
+    memcpy(dirEntry(inode)->filename, file->filename, MAX_FILENAME);
+
+    inodeInfo(inode)->in_use = 1;
+    inodeInfo(inode)->file_size = file->file_size;
+    inodeInfo(inode)->attribute = file->attribute;
+    inodeInfo(inode)->tail = file->tail;
+    setInodeFree(inode, 0);
+    clearFileBlocks(inode);
+
+    // An inline file may come back into an inode with less inline space than it had
+    if(file->tail == TAIL_INLINE && file->file_size > inlineMax(inode))
+    {
+        int32_t block = findFreeBlock();
+        uint8_t * p = block == -1 ? NULL : newBlock(block);
+        if(p == NULL)
+        {
+            if(block != -1)
+            {
+                releaseBlock(block);
+            }
+            inodeInfo(inode)->tail = 0;
+            inodeInfo(inode)->file_size = 0;
+            state->status = block == -1 ? MFS_ERR_NO_SPACE : MFS_ERR_IO;
+            return 1;
+        }
+        memset(p, 0, BLOCK_SIZE);
+        memcpy(p, blocks, file->file_size);
+        putBlock(block, 1);
+        inodeInfo(inode)->tail = 0;
+        setFileBlock(inode, 0, block);
+    }
+    else if(file->tail == TAIL_INLINE)
+    {
+        memcpy(inlineData(inode), blocks, file->file_size);
+    }
+
+    uint32_t index;
+    for(index = 0; index < snapBlocks(file); index++)
+    {
+        if(setFileBlock(inode, index, blocks[index]) != MFS_OK)
+        {
+            inodeInfo(inode)->file_size = index * BLOCK_SIZE;
+            inodeInfo(inode)->tail = 0;
+            state->status = MFS_ERR_NO_SPACE;
+            return 1;
+        }
+        refBlock(blocks[index]);
+    }
+
+    state->next++;
+    return 0;
+}
+
+// Replace every live file with the files frozen in the snapshot. The snapshot is kept.
+int32_t snapshotRollback(const char * name)
+{
+    int32_t slot = findSnapshot(name);
+    if(slot == -1)
+    {
+        return MFS_ERR_NOT_FOUND;
+    }
+
+    // Check the whole snapshot before touching the live files
+    if(snapshotWalk(slot, snapshotCheckFile, NULL, NULL) == -1)
+    {
+        return MFS_ERR_CORRUPT;
+    }
+
+    int i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(inodeInfo(i)->in_use)
+        {
+            releaseReserved(i);
+            uint32_t index;
+            for(index = 0; index < blockCount(i); index++)
+            {
+                releaseBlock(fileBlock(i, index));
+            }
+            releaseMaps(i, 0, 0);
+        }
+
+        dirEntry(i)->in_use = 0;
+        inodeInfo(i)->in_use = 0;
+        setInodeFree(i, 1);
+    }
+
+    struct snapshotRestoreState state = { 0, MFS_OK };
+    snapshotWalk(slot, snapshotRestore, NULL, &state);
+    indexRebuild();
+    ext_free = NUM_FILES;
+    return state.status;
+}
+
+struct snapshotFind
+{
+    const char * filename;
+    int          fd;
+    int32_t      status;
+};
+
+int snapshotCopyOut(struct snapFile * file, int32_t * blocks, void * arg)
+{
+    struct snapshotFind * find = arg;
+    if(strncmp(file->filename, find->filename, MAX_FILENAME))
+    {
+        return 0;
+    }
+
+    find->status = MFS_OK;
+    if(file->tail == TAIL_INLINE)
+    {
+        if(writeFull(find->fd, blocks, file->file_size) == -1)
+        {
+            find->status = MFS_ERR_IO;
+        }
+        return 1;
+    }
+
+    uint32_t left = file->file_size;
+    uint32_t index;
+    for(index = 0; left > 0 && find->status == MFS_OK; index++)
+    {
+        uint32_t bytes = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+        uint32_t start = file->tail && left < BLOCK_SIZE ? (file->tail - 1) * TAIL_SLOT : 0;
+        uint8_t * block = getBlock(blocks[index]);
+        if(block == NULL)
+        {
+            find->status = MFS_ERR_IO;
+            break;
+        }
+        find->status = verifyBlock(blocks[index], block);
+        if(find->status == MFS_OK && writeFull(find->fd, block + start, bytes) == -1)
+        {
+            find->status = MFS_ERR_IO;
+        }
+        putBlock(blocks[index], 0);
+        left -= bytes;
+    }
+    return 1;
+}
+
+void snapshotList()
+{
+    int found = 0;
+    int slot;
+    for(slot = 0; slot < MAX_SNAPSHOTS; slot++)
+    {
+        struct snapshotEntry * snap = &superblock->snapshots[slot];
+        if(!snap->first_block)
+        {
+            continue;
+        }
+
+        char when[32];
+        time_t created = snap->created;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+        printf("%-32.32s %s %6u files\n", snap->name, when, snap->files);
+        found = 1;
+    }
+
+    if(!found)
+    {
+        printf("No snapshots.\n");
+    }
+}
+
+// snapshot <name> | snapshot list | snapshot delete <name> |
+// snapshot retrieve <name> <file> [new file]
+void snapshot(char ** token)
+{
+    int32_t status;
+    if(token[1] == NULL)
+    {
+        printf("ERROR: snapshot needs a name.\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    if(strcmp(token[1], "list") == 0)
+    {
+        snapshotList();
+        return;
+    }
+
+    if(strcmp(token[1], "delete") == 0)
+    {
+        if(token[2] == NULL)
+        {
+            printf("ERROR: snapshot delete needs a name.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            return;
+        }
+        status = snapshotDelete(token[2]);
+    }
+    else if(strcmp(token[1], "retrieve") == 0)
+    {
+        if(token[2] == NULL || token[3] == NULL)
+        {
+            printf("ERROR: snapshot retrieve needs a snapshot and a file name.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            return;
+        }
+
+        int32_t slot = findSnapshot(token[2]);
+        if(slot == -1)
+        {
+            printf("ERROR: %s.\n", mfs_strerror(MFS_ERR_NOT_FOUND));
+            last_status = MFS_ERR_NOT_FOUND;
+            return;
+        }
+
+        char * out = token[4] != NULL ? token[4] : token[3];
+        int ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(ofd == -1)
+        {
+            printf("ERROR: Can not create the output file\n");
+            last_status = MFS_ERR_IO;
+            return;
+        }
+
+        struct snapshotFind find = { token[3], ofd, MFS_ERR_NOT_FOUND };
+        status = snapshotWalk(slot, snapshotCopyOut, NULL, &find) == -1 ? MFS_ERR_CORRUPT
+                                                                        : find.status;
+        close(ofd);
+        if(status != MFS_OK)
+        {
+            unlink(out);
+        }
+    }
+    else
+    {
+        status = snapshotCreate(token[1]);
+    }
+
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+        last_status = status;
+    }
+}
+
+// ustar archive header; every header and every file's data fill whole TAR_BLOCK records
+#define TAR_BLOCK 512
+
+struct tarHeader
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+_Static_assert(sizeof(struct tarHeader) == TAR_BLOCK, "tar header is not one record");
+
+// Attributes travel in a pax extended header under this vendor keyword
+#define TAR_ATTRIBUTE "MFS.attribute"
+
+uint32_t tarChecksum(const struct tarHeader * header)
+{
+    const uint8_t * p = (const uint8_t*) header;
+    uint32_t sum = 0;
+    int i;
+    for(i = 0; i < TAR_BLOCK; i++)
+    {
+        sum += (i >= 148 && i < 156) ? ' ' : p[i];
+    }
+    return sum;
+}
+
+// Parse an octal header field, or a base-256 one when its top bit is set
+uint64_t tarNumber(const char * field, int len)
+{
+    uint64_t value = 0;
+    int i = 0;
+    if((uint8_t) field[0] & 0x80)
+    {
+        value = field[0] & 0x7f;
+        for(i = 1; i < len; i++)
+        {
+            value = (value << 8) | (uint8_t) field[i];
+        }
+        return value;
+    }
+
+    while(i < len && field[i] == ' ')
+    {
+        i++;
+    }
+    for(; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Read and throw away len bytes
+int tarSkip(struct stream * in, uint64_t len)
+{
+    uint8_t buf[8192];
+    while(len > 0)
+    {
+        size_t bytes = len < sizeof(buf) ? len : sizeof(buf);
+        if(streamRead(in, buf, bytes) != (ssize_t) bytes)
+        {
+            return -1;
+        }
+        len -= bytes;
+    }
+    return 0;
+}
+
+#define TAR_PADDING(size) ((TAR_BLOCK - (size) % TAR_BLOCK) % TAR_BLOCK)
+
+// Pick the name and attribute out of a pax extended header's "length key=value\n" records
+void tarPax(char * records, uint64_t len, char * name, int * attribute)
+{
+    uint64_t pos = 0;
+    while(pos < len)
+    {
+        char * end;
+        uint64_t size = strtoull(records + pos, &end, 10);
+        if(size == 0 || *end != ' ' || pos + size > len || records[pos + size - 1] != '\n')
+        {
+            return;
+        }
+
+        char * key = end + 1;
+        char * value = strchr(key, '=');
+        records[pos + size - 1] = '\0';
+        if(value != NULL)
+        {
+            *value++ = '\0';
+            if(!strcmp(key, "path"))
+            {
+                snprintf(name, MAX_FILENAME + 2, "%s", value);
+            }
+            else if(!strcmp(key, TAR_ATTRIBUTE))
+            {
+                *attribute = atoi(value);
+            }
+        }
+        pos += size;
+    }
+}
+
+// import <archive.tar|->: add every regular file of a tar archive in one sequential pass.
+// Entries the image can not take are reported and skipped, and the status of the last one is
+// left in skipped; running out of space ends the import.
+int32_t importTar(struct stream * in, uint32_t * files, uint64_t * bytes, int32_t * skipped)
+{
+    char pax_name[MAX_FILENAME + 2] = "";
+    int pax_attribute = -1;
+    struct tarHeader header;
+
+    while(1)
+    {
+        ssize_t got = streamRead(in, &header, TAR_BLOCK);
+        if(got == 0)
+        {
+            return MFS_OK;
+        }
+        if(got != TAR_BLOCK)
+        {
+            return MFS_ERR_IO;
+        }
+
+        // Two zero records end the archive; one is enough to stop
+        static const struct tarHeader zero;
+        if(!memcmp(&header, &zero, TAR_BLOCK))
+        {
+            return MFS_OK;
+        }
+
+        if(tarNumber(header.chksum, sizeof(header.chksum)) != tarChecksum(&header))
+        {
+            return MFS_ERR_CORRUPT;
+        }
+
+        uint64_t size = tarNumber(header.size, sizeof(header.size));
+        uint64_t padded = size + TAR_PADDING(size);
+
+        if(header.typeflag == 'x' && size < 65536)
+        {
+            char * records = malloc(padded + 1);
+            if(records == NULL || streamRead(in, records, padded) != (ssize_t) padded)
+            {
+                free(records);
+                return MFS_ERR_IO;
+            }
+            records[size] = '\0';
+            tarPax(records, size, pax_name, &pax_attribute);
+            free(records);
+            continue;
+        }
+
+        if(header.typeflag != '0' && header.typeflag != '\0')
+        {
+            // Directories, links, global headers and the rest have nothing to add
+            if(tarSkip(in, padded) == -1)
+            {
+                return MFS_ERR_IO;
+            }
+            continue;
+        }
+
+        char name[sizeof(header.prefix) + sizeof(header.name) + 2];
+        if(pax_name[0])
+        {
+            snprintf(name, sizeof(name), "%s", pax_name);
+        }
+        else if(header.prefix[0] && !memcmp(header.magic, "ustar", 5))
+        {
+            snprintf(name, sizeof(name), "%.155s/%.100s", header.prefix, header.name);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%.100s", header.name);
+        }
+
+        char * base = name;
+        while(!strncmp(base, "./", 2))
+        {
+            base += 2;
+        }
+
+        int attribute = pax_attribute;
+        pax_name[0] = '\0';
+        pax_attribute = -1;
+
+        int32_t status = MFS_OK;
+        if(strlen(base) > MAX_FILENAME || base[0] == '\0')
+        {
+            status = MFS_ERR_NAME;
+        }
+        else if(size > MAX_FILE_SIZE)
+        {
+            status = MFS_ERR_TOO_LARGE;
+        }
+        else if(findFile(base) != -1)
+        {
+            status = MFS_ERR_EXISTS;
+        }
+
+        if(status != MFS_OK)
+        {
+            printf("ERROR: %.200s: %s.\n", base, mfs_strerror(status));
+            *skipped = status;
+            if(tarSkip(in, padded) == -1)
+            {
+                return MFS_ERR_IO;
+            }
+            continue;
+        }
+
+        status = insertStream(in, base, size);
+        if(status != MFS_OK)
+        {
+            printf("ERROR: %.200s: %s.\n", base, mfs_strerror(status));
+            return status;
+        }
+
+        // Without an attribute record a file with no write permission comes in read-only
+        int32_t inode = dirEntry(findFile(base))->inode;
+        if(attribute == -1)
+        {
+            attribute = (tarNumber(header.mode, sizeof(header.mode)) & 0222) ? 0 : READ_ONLY;
+        }
+        inodeInfo(inode)->attribute = attribute & (HIDDEN | READ_ONLY);
+
+        if(tarSkip(in, padded - size) == -1)
+        {
+            return MFS_ERR_IO;
+        }
+        (*files)++;
+        *bytes += size;
+    }
+}
+
+// Write value into a header field as len - 1 octal digits and a NUL. Returns -1 if it needs
+// more digits than that.
+int tarOctal(char * field, int len, uint64_t value)
+{
+    int i;
+    field[len - 1] = '\0';
+    for(i = len - 2; i >= 0; i--)
+    {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+    return value == 0 ? 0 : -1;
+}
+
+int32_t tarWriteHeader(struct stream * out, const char * name, char type, uint32_t mode,
+                   uint64_t size, time_t mtime)
+{
+    struct tarHeader header;
+    memset(&header, 0, sizeof(header));
+    snprintf(header.name, sizeof(header.name), "%s", name);
+    if(tarOctal(header.mode, sizeof(header.mode), mode) == -1 ||
+       tarOctal(header.uid, sizeof(header.uid), 0) == -1 ||
+       tarOctal(header.gid, sizeof(header.gid), 0) == -1 ||
+       tarOctal(header.size, sizeof(header.size), size) == -1 ||
+       tarOctal(header.mtime, sizeof(header.mtime), mtime) == -1)
+    {
+        return MFS_ERR_TOO_LARGE;
+    }
+    header.typeflag = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tarChecksum(&header));
+    header.chksum[7] = ' ';
+    return streamWrite(out, &header, TAR_BLOCK) == -1 ? MFS_ERR_IO : MFS_OK;
+}
+
+// export <archive.tar|->: write every file as a ustar archive in one pass over the directory
+int32_t exportTar(struct stream * out, uint32_t * files, uint64_t * bytes)
+{
+    static const uint8_t zero[2 * TAR_BLOCK];
+    time_t now = time(NULL);
+    int32_t i;
+    for(i = 0; i < num_files; i++)
+    {
+        if(!entryLive(i))
+        {
+            continue;
+        }
+
+        char name[MAX_FILENAME + 1];
+        snprintf(name, sizeof(name), "%.64s", dirEntry(i)->filename);
+        struct inodeInfo * info = inodeInfo(dirEntry(i)->inode);
+
+        // Read-only shows in the mode; anything more needs a pax record
+        if(info->attribute & ~READ_ONLY)
+        {
+            char record[64];
+            char pax_name[100];
+            int len = snprintf(record, sizeof(record), " %s=%d\n", TAR_ATTRIBUTE,
+                               info->attribute);
+            // The length prefix counts itself
+            int total = len + snprintf(NULL, 0, "%d", len);
+            total = len + snprintf(NULL, 0, "%d", total);
+            snprintf(record, sizeof(record), "%d %s=%d\n", total, TAR_ATTRIBUTE,
+                     info->attribute);
+            snprintf(pax_name, sizeof(pax_name), "PaxHeader/%.64s", name);
+            int32_t status = tarWriteHeader(out, pax_name, 'x', 0644, total, now);
+            if(status == MFS_OK && (streamWrite(out, record, total) == -1 ||
+                                    streamWrite(out, zero, TAR_PADDING(total)) == -1))
+            {
+                status = MFS_ERR_IO;
+            }
+            if(status != MFS_OK)
+            {
+                return status;
+            }
+        }
+
+        uint32_t mode = (info->attribute & READ_ONLY) ? 0444 : 0644;
+        // A size or time too large for its octal field is refused rather than cut short
+        int32_t status = tarWriteHeader(out, name, '0', mode, info->file_size, now);
+        if(status == MFS_OK)
+        {
+            status = writeRangeTo(i, 0, info->file_size, out);
+        }
+        if(status == MFS_OK && streamWrite(out, zero, TAR_PADDING(info->file_size)) == -1)
+        {
+            status = MFS_ERR_IO;
+        }
+        if(status != MFS_OK)
+        {
+            printf("ERROR: %.64s: %s.\n", name, mfs_strerror(status));
+            return status;
+        }
+
+        (*files)++;
+        *bytes += info->file_size;
+    }
+
+    return streamWrite(out, zero, sizeof(zero)) == -1 || streamFlush(out) == -1 ? MFS_ERR_IO
+                                                                                : MFS_OK;
+}
+
+// import or export an archive at path, or on standard input or output for "-"
+void tarCommand(int import, const char * path)
+{
+    int fd;
+    if(!strcmp(path, "-"))
+    {
+        fd = import ? STDIN_FILENO : stdout_fd;
+    }
+    else
+    {
+        fd = import ? open(path, O_RDONLY) : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if(fd == -1)
+    {
+        printf("ERROR: Can not open %s\n", path);
+        last_status = MFS_ERR_IO;
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct stream st = streamOpen(fd);
+    uint32_t files = 0;
+    uint64_t bytes = 0;
+    int32_t skipped = MFS_OK;
+    int32_t status = import ? importTar(&st, &files, &bytes, &skipped)
+                            : exportTar(&st, &files, &bytes);
+    streamClose(&st);
+
+    if(strcmp(path, "-"))
+    {
+        close(fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if(status != MFS_OK)
+    {
+        printf("ERROR: %s.\n", mfs_strerror(status));
+    }
+    printf("%s: %u files, %llu bytes in %.3f s\n", import ? "import" : "export", files,
+           (unsigned long long) bytes, secs);
+    last_status = status != MFS_OK ? status : skipped;
+}
+
+void read_bytes(char* filename, uint32_t start_byte, uint32_t req_num_bytes)
+{
+  int file_location = findFile(filename);
+
+
+  if(file_location == -1)
+  {
+    printf("ERROR: File not found\n");
+    last_status = MFS_ERR_NOT_FOUND;
+    return;
+  }
+
+
+  if(req_num_bytes == 0)
+  {
+    printf("ERROR: No bytes to read\n");
+    last_status = MFS_ERR_BAD_REQUEST;
+    return;
+  }
+
+  
+  int32_t file_inode = dirEntry(file_location)->inode;
+  if(req_num_bytes > inodeInfo(file_inode)->file_size)
+  {
+    printf("ERROR: Request exceeds file size\n");
+    last_status = MFS_ERR_RANGE;
+    return;
+  }
+
+
+  uint32_t file_size = inodeInfo(file_inode)->file_size;
+  if( (start_byte + req_num_bytes) > file_size)
+  {
+    printf("ERROR: Specifications of request exceed file size\n");
+    last_status = MFS_ERR_RANGE;
+    return;
+  }
+
+  
+  uint32_t start_block_index = 0;
+  uint32_t temp_start_byte = start_byte;
+  uint32_t req_bytes_temp = req_num_bytes;
+  uint32_t num_blocks_to_read = 1;
+
+  // Find out how many blocks we need to read
+  while(req_bytes_temp > (uint32_t)BLOCK_SIZE)
+  {
+    num_blocks_to_read++;
+    req_bytes_temp -= BLOCK_SIZE;
+  }
+  
+  
+  // Find out the first index of our block array within inode
+  // we should start looking at
+  // We are also able to then record the byte we should start
+  // reading at within the start block
+  while(temp_start_byte >= (uint32_t)BLOCK_SIZE)
+  {
+    start_block_index++;
+    temp_start_byte -= (uint32_t)BLOCK_SIZE;
+  }
+       
+
+  // Check every block of the range before printing any of it
+  uint32_t index;
+  const uint8_t * block;
+  for(index = start_block_index; index < BLOCKS_FOR(start_byte + req_num_bytes); index++)
+  {
+    int32_t status = getFileBytes(file_inode, index, &block);
+    putFileBytes(file_inode, index);
+    if(status != MFS_OK)
+    {
+      printf("ERROR: %s.\n", mfs_strerror(status));
+      last_status = status;
+      return;
+    }
+  }
+
+  int32_t remaining_bytes = req_num_bytes;
+  int32_t curr_block_index = start_block_index;
+  getFileBytes(file_inode, curr_block_index, &block);
+
+  while(remaining_bytes != 0)
+  {
+    // Step on to the next block of the file once this one is used up
+    if(temp_start_byte == BLOCK_SIZE)
+    {
+      putFileBytes(file_inode, curr_block_index);
+      temp_start_byte = 0;
+      curr_block_index++;
+      getFileBytes(file_inode, curr_block_index, &block);
+    }
+
+    printf("%x", block[temp_start_byte]);
+
+    temp_start_byte++;
+    remaining_bytes--;
+  }
+  putFileBytes(file_inode, curr_block_index);
+  printf("\n");
+
+  return;
+}
+
+void encrypt(char* filename, char* key)
+{
+    if(filename == NULL)
+    {
+        printf("ERROR: Filename not specified.\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        return;
+    }
+
+    FILE *readFile;
+    FILE *writeFile;
+ 
+    readFile = fopen(filename, "r");
+    writeFile = fopen(filename, "r+");
+    char c;
+
+    if(!readFile || !writeFile)
+    {
+        printf("ERROR: File does not exist.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    do
+    {
+        c = fgetc(readFile);
+        if(feof(readFile))
+        {
+            break;
+        }
+        c = c ^ *key;
+        fputc(c, writeFile);
+    } 
+    while(1);
+    
+    fclose(readFile);
+    fclose(writeFile);
+}
+
+void attrib(char* attribute, char* filename)
+{
+    int change_attrib_index = findFile(filename);
+
+    if(change_attrib_index == -1)
+    {
+        printf("ERROR: File not found.\n");
+        last_status = MFS_ERR_NOT_FOUND;
+        return;
+    }
+
+    uint32_t inode_index = dirEntry(change_attrib_index)->inode;
+
+    // +h, -h, +r, -r
+    if(strcmp(attribute, "+h") == 0)
+    {
+        inodeInfo(inode_index)->attribute |= HIDDEN;
+        return;
+    }
+    if(strcmp(attribute, "+r") == 0)
+    {
+        inodeInfo(inode_index)->attribute |= READ_ONLY;
+        return;
+    }
+    if(strcmp(attribute, "-h") == 0)
+    {
+        inodeInfo(inode_index)->attribute &= HIDDEN_MASK;
+        return;
+    }
+    if(strcmp(attribute, "-r") == 0)
+    {
+        inodeInfo(inode_index)->attribute &= READ_MASK;
+        return;
+    }
+
+    printf("ERROR: Incorrent attribute.\n");
+    last_status = MFS_ERR_BAD_REQUEST;
+
+
+
+}
+
+// Server mode. "mfs --serve <socket> <image>" keeps one image resident and answers requests
+// from any number of local clients over a Unix-domain stream socket. Every request is a
+// struct mfs_request followed by name_len bytes of file name (no terminator); every reply is
+// a struct mfs_response followed by length bytes of payload. Both use host byte order.
+//
+//   LOOKUP    name                  -> one struct mfs_stat followed by the name
+//   READ      name offset length    -> length bytes of file data, or if the request carried a
+//                                      descriptor the bytes are written to it and not returned
+//   INSERT    name + descriptor     -> the rest of a regular file (or length bytes of a pipe)
+//                                      is copied from the descriptor into a new file
+//   DELETE    name                  -> nothing
+//   LIST                            -> one struct mfs_stat plus name per file, hidden included
+//   RETRIEVE  name + descriptor     -> the whole file is written to the descriptor
+//   SAVE                            -> the image is written back to its file
+//
+// Descriptors are passed with SCM_RIGHTS in the same sendmsg() as the request they belong
+// to, so file contents never have to travel over the socket.
+//
+// Requests are answered by a pool of worker threads, one client at a time per worker so each
+// client sees its replies in order. READ, LIST and RETRIEVE hold image_lock shared and run
+// side by side; INSERT, DELETE and SAVE hold it exclusively, since every change goes through
+// the one block and inode allocator. An INSERT reads the client's data before it takes the
+// lock and a RETRIEVE writes it out after, so a slow descriptor holds up no one else. LOOKUP
+// takes no lock at all and retries if a writer changed the directory under it. Through a
+// block cache every access moves cache slots, so there all requests take the lock exclusively.
+#define MFS_OP_LOOKUP   1
+#define MFS_OP_READ     2
+#define MFS_OP_INSERT   3
+#define MFS_OP_DELETE   4
+#define MFS_OP_LIST     5
+#define MFS_OP_RETRIEVE 6
+#define MFS_OP_SAVE     7
+
+#define MAX_CLIENTS     128
+#define MAX_CLIENT_FDS  8
+
+struct mfs_request
+{
+    uint8_t  op;
+    uint8_t  name_len;
+    uint16_t reserved;
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct mfs_response
+{
+    int32_t  status;
+    uint32_t length;
+};
+
+struct mfs_stat
+{
+    uint32_t file_size;
+    int32_t  inode;
+    uint8_t  attribute;
+    uint8_t  name_len;
+    uint16_t reserved;
+};
+
+struct client
+{
+    int       sock;
+
+    // Partially received request. consumed is the stream offset of in[0] so descriptors
+    // can be matched with the request whose bytes they arrived with.
+    uint8_t   in[sizeof(struct mfs_request) + MAX_FILENAME];
+    uint32_t  in_len;
+    uint64_t  consumed;
+    int       fds[MAX_CLIENT_FDS];
+    uint64_t  fd_offsets[MAX_CLIENT_FDS];
+    int       num_fds;
+
+    // Replies not yet accepted by the socket
+    uint8_t  *out;
+    uint32_t  out_len;
+    uint32_t  out_sent;
+    uint32_t  out_cap;
+
+    // Set while a worker answers the client's requests; the event loop leaves it alone then
+    int       busy;
+    int       drop;
+};
+
+static volatile sig_atomic_t serving;
+static uint8_t server_dirty;
+
+pthread_rwlock_t image_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void lockImage(int exclusive)
+{
+    if(exclusive || cache_mode)
+    {
+        pthread_rwlock_wrlock(&image_lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&image_lock);
+    }
+}
+
+void unlockImage()
+{
+    pthread_rwlock_unlock(&image_lock);
+}
+
+// Directory sequence count. Writers make it odd while they change directory entries, inodes
+// or the name index, and even again when done; a lookup that saw it odd or changed retries.
+uint32_t dir_seq;
+
+void dirWriteBegin()
+{
+    __atomic_store_n(&dir_seq, dir_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void dirWriteEnd()
+{
+    __atomic_store_n(&dir_seq, dir_seq + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t dirReadBegin()
+{
+    uint32_t seq;
+    while((seq = __atomic_load_n(&dir_seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        sched_yield();
+    }
+    return seq;
+}
+
+int dirReadRetry(uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&dir_seq, __ATOMIC_RELAXED) != seq;
+}
+
+void stopServing(int sig)
+{
+    serving = 0;
+}
+
+// Reserve len more bytes at the end of the client's reply buffer
+uint8_t * clientReserve(struct client * c, uint32_t len)
+{
+    if(c->out_len + len > c->out_cap)
+    {
+        uint32_t cap = c->out_cap ? c->out_cap : 4096;
+        while(cap < c->out_len + len)
+        {
+            cap *= 2;
+        }
+        uint8_t * out = realloc(c->out, cap);
+        if(out == NULL)
+        {
+            return NULL;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+
+    uint8_t * p = c->out + c->out_len;
+    c->out_len += len;
+    return p;
+}
+
+// Append a reply header announcing len bytes of payload
+void clientHeader(struct client * c, int32_t status, uint32_t len)
+{
+    struct mfs_response rsp = { status, len };
+    uint8_t * p = clientReserve(c, sizeof(rsp));
+    if(p != NULL)
+    {
+        memcpy(p, &rsp, sizeof(rsp));
+    }
+}
+
+void clientReply(struct client * c, int32_t status, const void * payload, uint32_t len)
+{
+    clientHeader(c, status, len);
+    uint8_t * p = clientReserve(c, len);
+    if(p != NULL && len)
+    {
+        memcpy(p, payload, len);
+    }
+}
+
+// Fill st and name for directory index entry. Returns MFS_ERR_CORRUPT if the entry names an
+// inode that does not exist, which is also what a lookup racing a writer can see.
+int32_t statEntry(int32_t entry, struct mfs_stat * st, char * name)
+{
+    memset(st, 0, sizeof(*st));
+    st->inode = dirEntry(entry)->inode;
+    if(st->inode < 0 || st->inode >= num_files)
+    {
+        return MFS_ERR_CORRUPT;
+    }
+    st->file_size = inodeInfo(st->inode)->file_size;
+    st->attribute = inodeInfo(st->inode)->attribute;
+    st->name_len = strnlen(dirEntry(entry)->filename, MAX_FILENAME);
+    memcpy(name, dirEntry(entry)->filename, st->name_len);
+    return MFS_OK;
+}
+
+// Append a struct mfs_stat and the file name
+void clientStat(struct client * c, struct mfs_stat * st, const char * name)
+{
+    uint8_t * p = clientReserve(c, sizeof(*st) + st->name_len);
+    if(p != NULL)
+    {
+        memcpy(p, st, sizeof(*st));
+        memcpy(p + sizeof(*st), name, st->name_len);
+    }
+}
+
+// Take the descriptor that arrived with the request occupying stream offsets [start, end)
+int clientTakeFd(struct client * c, uint64_t start, uint64_t end)
+{
+    int fd = -1;
+    int i = 0;
+    while(i < c->num_fds)
+    {
+        if(c->fd_offsets[i] < end)
+        {
+            // Descriptors sent with earlier requests that did not use them are dropped
+            if(fd == -1 && c->fd_offsets[i] >= start)
+            {
+                fd = c->fds[i];
+            }
+            else
+            {
+                close(c->fds[i]);
+            }
+            c->num_fds--;
+            memmove(&c->fds[i], &c->fds[i + 1], (c->num_fds - i) * sizeof(int));
+            memmove(&c->fd_offsets[i], &c->fd_offsets[i + 1], (c->num_fds - i) * sizeof(uint64_t));
+            continue;
+        }
+        i++;
+    }
+    return fd;
+}
+
+// LOOKUP runs without image_lock: it copies the entry out and starts over if a writer was
+// active meanwhile
+void serveLookup(struct client * c, const char * name)
+{
+    struct mfs_stat st;
+    char filename[MAX_FILENAME];
+    int32_t status;
+    uint32_t seq;
+    do
+    {
+        seq = dirReadBegin();
+        int32_t entry = findFile(name);
+        status = entry == -1 ? MFS_ERR_NOT_FOUND : statEntry(entry, &st, filename);
+    } while(dirReadRetry(seq));
+
+    if(status != MFS_OK)
+    {
+        clientReply(c, status, NULL, 0);
+        return;
+    }
+    clientHeader(c, MFS_OK, sizeof(st) + st.name_len);
+    clientStat(c, &st, filename);
+}
+
+void serveInsert(struct client * c, struct mfs_request * req, char * name, int fd)
+{
+    struct stat buf;
+    if(fd == -1 || fstat(fd, &buf) == -1)
+    {
+        clientReply(c, MFS_ERR_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    uint64_t size = req->length;
+    if(S_ISREG(buf.st_mode))
+    {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        size = buf.st_size - (pos > 0 ? pos : 0);
+    }
+    if(size > MAX_FILE_SIZE)
+    {
+        clientReply(c, MFS_ERR_TOO_LARGE, NULL, 0);
+        return;
+    }
+
+    // Stage the data before locking; insertStream() then reads it from memory, and data that
+    // came up short fails the insert as a read error
+    uint8_t * staged = malloc(size ? size : 1);
+    if(staged == NULL)
+    {
+        clientReply(c, MFS_ERR_NO_SPACE, NULL, 0);
+        return;
+    }
+    ssize_t got = readFull(fd, staged, size);
+    struct stream in = streamBuffer(staged, got > 0 ? got : 0);
+
+    lockImage(1);
+    dirWriteBegin();
+    int32_t status = insertStream(&in, name, size);
+    dirWriteEnd();
+    server_dirty |= (status == MFS_OK);
+    unlockImage();
+
+    streamClose(&in);
+    clientReply(c, status, NULL, 0);
+}
+
+// READ into a descriptor and RETRIEVE copy the range out under the lock and write it after
+void serveToFd(struct client * c, struct mfs_request * req, char * name, int fd)
+{
+    if(fd == -1)
+    {
+        clientReply(c, MFS_ERR_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    uint8_t * buf = NULL;
+    uint32_t len = 0;
+    int32_t status = MFS_ERR_NOT_FOUND;
+
+    lockImage(0);
+    int32_t entry = findFile(name);
+    if(entry != -1)
+    {
+        uint32_t size = inodeInfo(dirEntry(entry)->inode)->file_size;
+        uint32_t offset = 0;
+        len = size;
+        if(req->op == MFS_OP_READ)
+        {
+            offset = req->offset;
+            len = req->length;
+        }
+
+        status = MFS_ERR_RANGE;
+        if(offset <= size && len <= size - offset)
+        {
+            buf = malloc(len ? len : 1);
+            status = buf == NULL ? MFS_ERR_NO_SPACE : readfile(entry, offset, len, buf);
+        }
+    }
+    unlockImage();
+
+    if(status == MFS_OK && writeFull(fd, buf, len) == -1)
+    {
+        status = MFS_ERR_IO;
+    }
+    free(buf);
+    clientReply(c, status, NULL, 0);
+}
+
+// READ into the reply, DELETE, LIST and SAVE, with image_lock held
+void serveLocked(struct client * c, struct mfs_request * req, char * name)
+{
+    int32_t entry = -1;
+    int32_t status = MFS_OK;
+
+    if(req->op == MFS_OP_READ || req->op == MFS_OP_DELETE)
+    {
+        entry = findFile(name);
+        if(entry == -1)
+        {
+            clientReply(c, MFS_ERR_NOT_FOUND, NULL, 0);
+            return;
+        }
+    }
+
+    switch(req->op)
+    {
+        case MFS_OP_READ:
+        {
+            uint32_t size = inodeInfo(dirEntry(entry)->inode)->file_size;
+            if(req->offset > size || req->length > size - req->offset)
+            {
+                clientReply(c, MFS_ERR_RANGE, NULL, 0);
+                return;
+            }
+
+            clientHeader(c, MFS_OK, req->length);
+            uint8_t * p = clientReserve(c, req->length);
+            if(p != NULL)
+            {
+                readfile(entry, req->offset, req->length, p);
+            }
+            return;
+        }
+
+        case MFS_OP_DELETE:
+            dirWriteBegin();
+            status = removeFile(name);
+            dirWriteEnd();
+            server_dirty |= (status == MFS_OK);
+            clientReply(c, status, NULL, 0);
+            return;
+
+        case MFS_OP_LIST:
+        {
+            clientHeader(c, MFS_OK, 0);
+            uint32_t header = c->out_len - sizeof(struct mfs_response);
+            int i;
+            for(i = 0; i < num_files; i++)
+            {
+                struct mfs_stat st;
+                char filename[MAX_FILENAME];
+                if(entryLive(i) && statEntry(i, &st, filename) == MFS_OK)
+                {
+                    clientStat(c, &st, filename);
+                }
+            }
+            struct mfs_response rsp = { MFS_OK, c->out_len - header - sizeof(rsp) };
+            memcpy(c->out + header, &rsp, sizeof(rsp));
+            return;
+        }
+
+        case MFS_OP_SAVE:
+            savefs();
+            server_dirty = 0;
+            clientReply(c, MFS_OK, NULL, 0);
+            return;
+    }
+
+    clientReply(c, MFS_ERR_BAD_REQUEST, NULL, 0);
+}
+
+void serveRequest(struct client * c, struct mfs_request * req, char * name, int fd)
+{
+    switch(req->op)
+    {
+        case MFS_OP_LOOKUP:
+            serveLookup(c, name);
+            return;
+
+        case MFS_OP_INSERT:
+            serveInsert(c, req, name, fd);
+            return;
+
+        case MFS_OP_READ:
+            if(fd != -1)
+            {
+                serveToFd(c, req, name, fd);
+                return;
+            }
+            break;
+
+        case MFS_OP_RETRIEVE:
+            serveToFd(c, req, name, fd);
+            return;
+    }
+
+    lockImage(req->op == MFS_OP_DELETE || req->op == MFS_OP_SAVE);
+    serveLocked(c, req, name);
+    unlockImage();
+}
+
+// Answer every complete request sitting in the client's input buffer. Returns -1 when the
+// client sent something that can not be a request and has to be dropped.
+int serveClient(struct client * c)
+{
+    while(c->in_len >= sizeof(struct mfs_request))
+    {
+        struct mfs_request req;
+        memcpy(&req, c->in, sizeof(req));
+
+        if(req.name_len > MAX_FILENAME)
+        {
+            clientReply(c, MFS_ERR_BAD_REQUEST, NULL, 0);
+            return -1;
+        }
+
+        uint32_t len = sizeof(req) + req.name_len;
+        if(c->in_len < len)
+        {
+            break;
+        }
+
+        char name[MAX_FILENAME + 1];
+        memcpy(name, c->in + sizeof(req), req.name_len);
+        name[req.name_len] = '\0';
+
+        int fd = clientTakeFd(c, c->consumed, c->consumed + len);
+        serveRequest(c, &req, name, fd);
+        if(fd != -1)
+        {
+            close(fd);
+        }
+
+        c->in_len -= len;
+        c->consumed += len;
+        memmove(c->in, c->in + len, c->in_len);
+    }
+    return 0;
+}
+
+// Receive what the client has sent along with any descriptors. Returns 0 on end of stream.
+ssize_t clientReceive(struct client * c)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_CLIENT_FDS)];
+    struct iovec iov = { c->in + c->in_len, sizeof(c->in) - c->in_len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    ssize_t n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC);
+    if(n <= 0)
+    {
+        return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 1 : n;
+    }
+
+    struct cmsghdr * cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int i;
+        for(i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if(c->num_fds == MAX_CLIENT_FDS)
+            {
+                close(fd);
+                continue;
+            }
+            c->fds[c->num_fds] = fd;
+            c->fd_offsets[c->num_fds] = c->consumed + c->in_len;
+            c->num_fds++;
+        }
+    }
+
+    c->in_len += n;
+    return n;
+}
+
+// Send as much of the pending reply as the socket takes without blocking
+int clientFlush(struct client * c)
+{
+    while(c->out_sent < c->out_len)
+    {
+        ssize_t n = send(c->sock, c->out + c->out_sent, c->out_len - c->out_sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN)
+        {
+            return 0;
+        }
+        if(n <= 0)
+        {
+            return -1;
+        }
+        c->out_sent += n;
+    }
+
+    c->out_len = 0;
+    c->out_sent = 0;
+    return 0;
+}
+
+// A client with a whole request waiting, or one that can not be a request
+int clientReady(struct client * c)
+{
+    if(c->in_len < sizeof(struct mfs_request))
+    {
+        return 0;
+    }
+    struct mfs_request req;
+    memcpy(&req, c->in, sizeof(req));
+    return req.name_len > MAX_FILENAME || c->in_len >= sizeof(req) + req.name_len;
+}
+
+// Clients with requests to answer, handed from the event loop to the workers. A client is
+// queued at most once at a time, so MAX_CLIENTS slots are enough.
+struct workQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    struct client * clients[MAX_CLIENTS];
+    int             head;
+    int             count;
+    int             stop;
+    int             wake_fd;    // written when a worker is done with a client
+};
+
+void queueClient(struct workQueue * q, struct client * c)
+{
+    c->busy = 1;
+    pthread_mutex_lock(&q->lock);
+    q->clients[(q->head + q->count) % MAX_CLIENTS] = c;
+    q->count++;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void * serveWorker(void * arg)
+{
+    struct workQueue * q = arg;
+    while(1)
+    {
+        pthread_mutex_lock(&q->lock);
+        while(q->count == 0 && !q->stop)
+        {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        if(q->count == 0)
+        {
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        struct client * c = q->clients[q->head];
+        q->head = (q->head + 1) % MAX_CLIENTS;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+
+        c->drop = serveClient(c) == -1;
+        __atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
+        while(write(q->wake_fd, "", 1) == -1 && errno == EINTR)
+        {
+        }
+    }
+}
+
+void clientClose(struct client * c)
+{
+    while(c->num_fds > 0)
+    {
+        close(c->fds[--c->num_fds]);
+    }
+    close(c->sock);
+    free(c->out);
+    free(c);
+}
+
+// Event loop for server mode. It accepts clients and moves bytes and descriptors in and out
+// of their buffers; complete requests go to the workers. The sockets are non-blocking so a
+// slow client only delays itself.
+int serve(char * sock_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        printf("ERROR: Socket path too long\n");
+        return 1;
+    }
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+    int lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(sock_path);
+    if(lsock == -1 || bind(lsock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+       listen(lsock, 64) == -1)
+    {
+        printf("ERROR: Can not listen on %s: %s\n", sock_path, strerror(errno));
+        return 1;
+    }
+
+    struct workQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+
+    int wake[2];
+    if(pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        printf("ERROR: Can not create a pipe: %s\n", strerror(errno));
+        close(lsock);
+        return 1;
+    }
+    queue.wake_fd = wake[1];
+
+    // Lookups from here on may read the name index while a writer grows it
+    names_shared = 1;
+
+    pthread_t workers[MAX_WORKERS];
+    int num_workers;
+    for(num_workers = 0; num_workers < numWorkers(); num_workers++)
+    {
+        if(pthread_create(&workers[num_workers], NULL, serveWorker, &queue) != 0)
+        {
+            break;
+        }
+    }
+    if(num_workers == 0)
+    {
+        printf("ERROR: Can not start a worker thread\n");
+        close(lsock);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServing);
+    signal(SIGTERM, stopServing);
+
+    struct client * clients[MAX_CLIENTS];
+    struct pollfd pfd[MAX_CLIENTS + 2];
+    int num_clients = 0;
+    int i;
+
+    printf("Serving %s on %s with %d workers\n", image_name, sock_path, num_workers);
+    fflush(stdout);
+
+    serving = 1;
+    while(serving)
+    {
+        pfd[0].fd = lsock;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = wake[0];
+        pfd[1].events = POLLIN;
+        for(i = 0; i < num_clients; i++)
+        {
+            // Clients a worker is busy with are skipped: a negative fd is ignored by poll()
+            struct client * c = clients[i];
+            int busy = __atomic_load_n(&c->busy, __ATOMIC_ACQUIRE);
+            pfd[i + 2].fd = busy ? -1 : c->sock;
+            pfd[i + 2].events = busy ? 0 : (c->out_len || c->drop ? POLLOUT : POLLIN);
+            pfd[i + 2].revents = 0;
+        }
+
+        if(poll(pfd, num_clients + 2, -1) < 0)
+        {
+            continue;
+        }
+
+        if(pfd[1].revents & POLLIN)
+        {
+            char drain[64];
+            while(read(wake[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+
+        for(i = num_clients - 1; i >= 0; i--)
+        {
+            struct client * c = clients[i];
+            short revents = pfd[i + 2].revents;
+            int drop = 0;
+
+            if(pfd[i + 2].fd == -1)
+            {
+                continue;
+            }
+
+            if(revents & POLLOUT)
+            {
+                drop = clientFlush(c) == -1 || (c->drop && c->out_len == 0);
+            }
+            else if(revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                drop = clientReceive(c) <= 0;
+                if(!drop && clientReady(c))
+                {
+                    queueClient(&queue, c);
+                }
+            }
+
+            if(drop)
+            {
+                clientClose(c);
+                clients[i] = clients[--num_clients];
+            }
+        }
+
+        if(pfd[0].revents & POLLIN)
+        {
+            int sock;
+            while((sock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+            {
+                struct client * c = calloc(1, sizeof(struct client));
+                if(num_clients == MAX_CLIENTS || c == NULL)
+                {
+                    free(c);
+                    close(sock);
+                    continue;
+                }
+                c->sock = sock;
+                clients[num_clients++] = c;
+            }
+        }
+    }
+
+    // Let the workers finish what they have, then stop them
+    pthread_mutex_lock(&queue.lock);
+    queue.stop = 1;
+    pthread_cond_broadcast(&queue.ready);
+    pthread_mutex_unlock(&queue.lock);
+    for(i = 0; i < num_workers; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    names_shared = 0;
+    indexReclaim();
+
+    for(i = 0; i < num_clients; i++)
+    {
+        clientClose(clients[i]);
+    }
+    close(wake[0]);
+    close(wake[1]);
+    close(lsock);
+    unlink(sock_path);
+
+    if(server_dirty)
+    {
+        savefs();
+    }
+
+    return 0;
+}
+
+// --trace <file> appends a JSON line for every command the shell runs: when it started, the
+// size of the host file it read, its status, how long it took and its arguments. --replay
+// runs a trace again in a scratch directory, with random host files of the recorded sizes in
+// place of the real ones, and compares the times.
+FILE * trace_file;
+
+struct tracedCommand
+{
+    int      active;
+    int      count;
+    char     args[MAX_NUM_ARGUMENTS][MAX_COMMAND_SIZE + 1];
+    int64_t  in_bytes;      // size of the host file the command read, or -1
+    double   started;       // seconds since the epoch
+    uint64_t start_ns;
+};
+
+struct tracedCommand traced;
+
+struct replayTotal
+{
+    char     cmd[16];
+    uint32_t count;
+    double   recorded_ms;
+    double   replayed_ms;
+};
+
+#define REPLAY_TOTALS 32
+
+struct replayState
+{
+    FILE             * in;
+    FILE             * report;
+    char               dir[32];
+    uint32_t           line;
+    uint32_t           replayed;
+    uint32_t           skipped;
+    int64_t            recorded_ns;     // of the command being replayed
+    int32_t            recorded_status;
+    struct replayTotal totals[REPLAY_TOTALS];
+    int                num_totals;
+};
+
+struct replayState replay;
+
+uint64_t monotonicNs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Argument naming the host file a command reads, or -1
+int traceInputArg(const char * cmd)
+{
+    if(!strcmp(cmd, "insert") || !strcmp(cmd, "import") || !strcmp(cmd, "encrypt") ||
+       !strcmp(cmd, "decrypt"))
+    {
+        return 1;
+    }
+    if(!strcmp(cmd, "append"))
+    {
+        return 2;
+    }
+    if(!strcmp(cmd, "write"))
+    {
+        return 3;
+    }
+    return -1;
+}
+
+void jsonPut(FILE * out, const char * text)
+{
+    fputc('"', out);
+    for(; *text; text++)
+    {
+        if(*text == '"' || *text == '\\')
+        {
+            fprintf(out, "\\%c", *text);
+        }
+        else if((uint8_t) *text < 0x20)
+        {
+            fprintf(out, "\\u%04x", (uint8_t) *text);
+        }
+        else
+        {
+            fputc(*text, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Read the JSON string at *p into out, which holds max bytes, and step past it. Returns -1
+// if there is no string there.
+int jsonGet(const char ** p, char * out, size_t max)
+{
+    const char * s = *p;
+    size_t n = 0;
+    if(*s++ != '"')
+    {
+        return -1;
+    }
+
+    while(*s && *s != '"')
+    {
+        char c = *s++;
+        if(c == '\\')
+        {
+            unsigned code;
+            c = *s++;
+            switch(c)
+            {
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case '"': case '\\': case '/': break;
+                case 'u':
+                    if(sscanf(s, "%4x", &code) != 1)
+                    {
+                        return -1;
+                    }
+                    c = code;
+                    s += 4;
+                    break;
+                default: return -1;
+            }
+        }
+        if(n + 1 < max)
+        {
+            out[n++] = c;
+        }
+    }
+
+    if(*s != '"')
+    {
+        return -1;
+    }
+    out[n] = '\0';
+    *p = s + 1;
+    return 0;
+}
+
+// Number after "key": in a trace line, or fallback when it is missing
+double jsonNumber(const char * line, const char * key, double fallback)
+{
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char * p = strstr(line, pattern);
+    return p == NULL ? fallback : strtod(p + strlen(pattern), NULL);
+}
+
+// Start timing a command when tracing or replaying
+void commandBegin(char ** token)
+{
+    // Every command starts out successful and sets last_status on the way to an error
+    last_status = MFS_OK;
+    if((trace_file == NULL && replay.in == NULL) || token[0] == NULL)
+    {
+        return;
+    }
+
+    int i;
+    for(i = 0; i < MAX_NUM_ARGUMENTS && token[i] != NULL; i++)
+    {
+        strncpy(traced.args[i], token[i], MAX_COMMAND_SIZE);
+        traced.args[i][MAX_COMMAND_SIZE] = '\0';
+    }
+    traced.count = i;
+
+    struct stat st;
+    int input = traceInputArg(token[0]);
+    traced.in_bytes = -1;
+    if(input != -1 && input < i && stat(token[input], &st) == 0 && S_ISREG(st.st_mode))
+    {
+        traced.in_bytes = st.st_size;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    traced.started = now.tv_sec + now.tv_nsec / 1e9;
+    traced.active = 1;
+    traced.start_ns = monotonicNs();
+}
+
+void replayRecord(uint64_t ns);
+
+// Finish the command started by commandBegin(), if any: append it to the trace or compare it
+// with the recorded run
+void commandEnd()
+{
+    if(!traced.active)
+    {
+        return;
+    }
+    uint64_t ns = monotonicNs() - traced.start_ns;
+    traced.active = 0;
+
+    if(replay.in != NULL)
     {
-        printf("ERROR: Filename not specified.\n");
+        replayRecord(ns);
         return;
     }
 
-    int delete_index = -1;
-    for(int i = 0; i < NUM_FILES; i++)
+    fprintf(trace_file, "{\"t\":%.6f,\"cmd\":", traced.started);
+    jsonPut(trace_file, traced.args[0]);
+    fprintf(trace_file, ",\"in_bytes\":%lld,\"status\":%d,\"ns\":%llu,\"args\":[",
+            (long long) traced.in_bytes, last_status, (unsigned long long) ns);
+    int i;
+    for(i = 1; i < traced.count; i++)
     {
-        if(strcmp(filename, directory[i].filename) == 0)
+        if(i > 1)
         {
-            delete_index = i;
-            break;
+            fputc(',', trace_file);
         }
-        
+        jsonPut(trace_file, traced.args[i]);
     }
+    fprintf(trace_file, "]}\n");
+    fflush(trace_file);
+}
 
-    if(delete_index == -1)
+void replayRecord(uint64_t ns)
+{
+    double recorded = replay.recorded_ns / 1e6;
+    double replayed = ns / 1e6;
+    fprintf(replay.report, "%6u %-10.10s %12.3f %12.3f %+8.1f%%", replay.line, traced.args[0],
+            recorded, replayed, recorded > 0 ? 100.0 * (replayed - recorded) / recorded : 0.0);
+    if(last_status != replay.recorded_status)
     {
-        printf("ERROR: File does not exist.\n");
-        return;
+        fprintf(replay.report, "  status %d, recorded %d", last_status,
+                replay.recorded_status);
     }
+    fputc('\n', replay.report);
 
-    uint32_t inode_index = directory[delete_index].inode;
-    if((inodes[inode_index].attribute & READ_ONLY) == 2)
+    // Every command name fits in a total; a longer one is not a command and is left out
+    int i = REPLAY_TOTALS;
+    size_t len = strlen(traced.args[0]);
+    if(len < sizeof(replay.totals[0].cmd))
     {
-        printf("ERROR: %s is read-only.\n", filename);
+        for(i = 0; i < replay.num_totals; i++)
+        {
+            if(!strcmp(replay.totals[i].cmd, traced.args[0]))
+            {
+                break;
+            }
+        }
+        if(i == replay.num_totals && i < REPLAY_TOTALS)
+        {
+            memcpy(replay.totals[i].cmd, traced.args[0], len + 1);
+            replay.num_totals++;
+        }
     }
-    else
+    if(i < REPLAY_TOTALS)
     {
-        directory[delete_index].in_use = 0;
-        inode_index = directory[delete_index].inode;
-        inodes[inode_index].in_use = 0;
+        replay.totals[i].count++;
+        replay.totals[i].recorded_ms += recorded;
+        replay.totals[i].replayed_ms += replayed;
     }
-
-    return;
-    
+    replay.replayed++;
 }
-void undel(char* filename)
+
+// Fill path with len bytes that depend only on seed, creating its directories
+int replayInput(char * path, int64_t len, uint32_t seed)
 {
-    if(filename == NULL)
+    char * slash;
+    for(slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
     {
-        printf("ERROR: Filename not specified.\n");
-        return;
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
     }
-    
-    int undelete_index = -1;
-    for(int i = 0; i < NUM_FILES; i++)
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
     {
-        if(strcmp(filename, directory[i].filename) == 0)
-        {
-            undelete_index = i;
-            break;
-        }
-        
+        return -1;
     }
 
-    if(undelete_index == -1)
+    struct stream out = streamOpen(fd);
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (seed + 1);
+    int status = 0;
+    while(len > 0 && status == 0)
     {
-        printf("ERROR: File does not exist.\n");
-        return;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int n = len < 8 ? len : 8;
+        status = streamWrite(&out, &x, n);
+        len -= n;
     }
-
-    directory[undelete_index].in_use = 1;
-    uint32_t inode_index = directory[undelete_index].inode;
-    inodes[inode_index].in_use = 1;
+    status |= streamFlush(&out);
+    streamClose(&out);
+    close(fd);
+    return status;
 }
 
-void retrieve(char* filename, char* new_filename)
+// Put the next replayable command of the trace in command_string. Paths are made relative so
+// everything stays inside the scratch directory, and an image is created fresh before it is
+// first opened.
+// Commands that read standard input or a real archive can not be replayed and are skipped.
+// Returns 0 at the end of the trace.
+int replayNext(char * command_string)
 {
-  int i;
-  int directory_location = -1;
-  for(i = 0; i < NUM_FILES; i++)
-  {
-    if(!strcmp(directory[i].filename, filename))
+    char line[4 * MAX_COMMAND_SIZE];
+    while(fgets(line, sizeof(line), replay.in) != NULL)
     {
-      directory_location = i;
-      break;
-    }
-  }
+        replay.line++;
 
+        char args[MAX_NUM_ARGUMENTS][MAX_COMMAND_SIZE + 1];
+        const char * p = strstr(line, "\"cmd\":");
+        int count = 0;
+        if(p == NULL || (p += 6, jsonGet(&p, args[count++], sizeof(args[0]))) == -1)
+        {
+            replay.skipped++;
+            continue;
+        }
 
-  if(directory_location == -1)
-  {
-    printf("ERROR: File not found\n");
-    return;
-  }
+        p = strstr(p, "\"args\":[");
+        for(p = p != NULL ? p + 8 : ""; *p == '"' && count < MAX_NUM_ARGUMENTS; count++)
+        {
+            if(jsonGet(&p, args[count], sizeof(args[0])) == -1)
+            {
+                break;
+            }
+            p += *p == ',';
+        }
 
+        int skip = !strcmp(args[0], "quit") || !strcmp(args[0], "import");
+        int i;
+        for(i = 1; i < count; i++)
+        {
+            skip |= !strcmp(args[i], "-");
+            memmove(args[i], args[i] + strspn(args[i], "/"), strlen(args[i]) + 1);
+            skip |= args[i][0] == '\0' || strstr(args[i], "..") != NULL;
+        }
+        if(skip)
+        {
+            replay.skipped++;
+            continue;
+        }
 
-  int file_inode = directory[directory_location].inode;
-  
+        if(!strcmp(args[0], "open") && count > 1 && access(args[count - 1], F_OK) != 0)
+        {
+            createfs(args[count - 1]);
+            closefs();
+        }
 
-  if(new_filename == NULL)
-  {
-    fp = fopen(filename, "w");
-  }
-  else
-  {
-    fp = fopen(new_filename, "w");
-  }
+        int64_t in_bytes = jsonNumber(line, "in_bytes", -1);
+        int input = traceInputArg(args[0]);
+        if(in_bytes >= 0 && input != -1 && input < count &&
+           replayInput(args[input], in_bytes, replay.line) == -1)
+        {
+            replay.skipped++;
+            continue;
+        }
 
-  
-  // Record the file size to know how many bytes to copy,
-  // initialize offset and current_block
-  int32_t offset = 0;
-  int32_t current_block = 0;
-  int32_t copy_size = inodes[file_inode].file_size;
+        replay.recorded_ns = jsonNumber(line, "ns", 0);
+        replay.recorded_status = jsonNumber(line, "status", 0);
+        command_string[0] = '\0';
+        for(i = 0; i < count; i++)
+        {
+            strncat(command_string, args[i], MAX_COMMAND_SIZE - strlen(command_string) - 2);
+            strcat(command_string, " ");
+        }
+        return 1;
+    }
+    return 0;
+}
 
+// Open the trace and move into a scratch directory. Command output goes to /dev/null so the
+// report is all that is printed.
+int replayStart(const char * path)
+{
+    replay.in = fopen(path, "r");
+    if(replay.in == NULL)
+    {
+        fprintf(stderr, "mfs: can not open trace %s\n", path);
+        return -1;
+    }
 
-  while(inodes[file_inode].blocks[current_block] != (int32_t) -1)
-  {
-    int32_t bytes;
+    strcpy(replay.dir, "/tmp/mfs-replay-XXXXXX");
+    replay.report = fdopen(dup(STDOUT_FILENO), "w");
+    if(mkdtemp(replay.dir) == NULL || chdir(replay.dir) == -1 || replay.report == NULL ||
+       freopen("/dev/null", "w", stdout) == NULL)
+    {
+        fprintf(stderr, "mfs: can not set up a scratch directory to replay in\n");
+        return -1;
+    }
 
-    // Save off the current block within our inode that has our data
-    int32_t block_index = inodes[file_inode].blocks[current_block];
+    fprintf(replay.report, "replaying %s in %s, times in ms\n", path, replay.dir);
+    fprintf(replay.report, "%6s %-10s %12s %12s %9s\n", "line", "command", "recorded",
+            "replayed", "change");
+    return 0;
+}
 
-    fseek(fp, offset, SEEK_SET);
+int replayRemove(const char * path, const struct stat * st, int flag, struct FTW * ftw)
+{
+    return remove(path);
+}
 
-    if(copy_size < BLOCK_SIZE)
+// Print the totals per command and remove the scratch directory
+void replayFinish()
+{
+    fprintf(replay.report, "\n%-10s %6s %12s %12s %9s\n", "command", "count", "recorded",
+            "replayed", "change");
+    int i;
+    for(i = 0; i < replay.num_totals; i++)
     {
-      bytes = fwrite(data[block_index], (int) copy_size, 1, fp);
+        struct replayTotal * t = &replay.totals[i];
+        fprintf(replay.report, "%-10s %6u %12.3f %12.3f %+8.1f%%\n", t->cmd, t->count,
+                t->recorded_ms, t->replayed_ms,
+                t->recorded_ms > 0 ? 100.0 * (t->replayed_ms - t->recorded_ms) / t->recorded_ms
+                                   : 0.0);
     }
-    else
+    fprintf(replay.report, "%u commands replayed, %u skipped\n", replay.replayed,
+            replay.skipped);
+    fclose(replay.report);
+    fclose(replay.in);
+
+    while(image_open)
+    {
+        closefs();
+    }
+    if(chdir("/") == 0)
     {
-      bytes = fwrite(data[block_index], BLOCK_SIZE, 1, fp);
+        nftw(replay.dir, replayRemove, 16, FTW_DEPTH | FTW_PHYS);
     }
+}
 
+// Commands run from the mfs command line rather than the shell
+char ** one_shot;
+int     one_shot_done;
 
-    if( (bytes == 0) && (inodes[file_inode].blocks[current_block] != -1) )
+// Commands that never change the image, so a one-shot run has nothing to save
+int oneShotChanges(char ** args)
+{
+    static const char * readers[] = { "list", "df", "retrieve", "read", "export", "cache",
+                                      "scrub", "images", "grep", "sum", "cat", "syncfs",
+                                      "signature", "delta", "layout", NULL };
+    int i;
+    for(i = 0; readers[i] != NULL; i++)
     {
-      printf("ERROR: An error occurred writing to the specified file\n");
-      return;
+        if(!strcmp(args[0], readers[i]))
+        {
+            return 0;
+        }
     }
 
-    offset += BLOCK_SIZE;
-    copy_size -= BLOCK_SIZE;
-    current_block ++;
-  }
-
+    // An explicit savefs has saved already, or is saving in the background
+    if(!strcmp(args[0], "savefs"))
+    {
+        return 0;
+    }
 
+    if(!strcmp(args[0], "fsck"))
+    {
+        return args[1] != NULL && !strcmp(args[1], "-r");
+    }
 
-  fclose(fp);
+    if(!strcmp(args[0], "snapshot"))
+    {
+        return args[1] == NULL || (strcmp(args[1], "list") && strcmp(args[1], "retrieve"));
+    }
 
+    return 1;
 }
 
-void read_bytes(char* filename, uint32_t start_byte, uint32_t req_num_bytes)
+// cat, or a command with a "-" argument, may stream data to standard output
+int oneShotWritesStdout(char ** args)
 {
-  int file_location = -1;
-  int i;
-  for(i = 0; i < NUM_FILES; i++)
-  {
-    if(!strcmp(directory[i].filename, filename))
+    if(!strcmp(args[0], "cat"))
     {
-      file_location = i;
-      break;
+        return 1;
     }
-  }
-
-
-  if(file_location == -1)
-  {
-    printf("ERROR: File not found\n");
-    return;
-  }
 
+    int i;
+    for(i = 1; args[i] != NULL; i++)
+    {
+        if(!strcmp(args[i], "-"))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-  if(req_num_bytes == 0)
-  {
-    printf("ERROR: No bytes to read\n");
-    return;
-  }
-
-  
-  int32_t file_inode = directory[file_location].inode;
-  if(req_num_bytes > inodes[file_inode].file_size)
-  {
-    printf("ERROR: Request exceeds file size\n");
-    return;
-  }
+int main(int argc, char * argv[])
+{
 
+  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
 
-  uint32_t file_size = inodes[file_inode].file_size;
-  if( (start_byte + req_num_bytes) > file_size)
-  {
-    printf("ERROR: Specifications of request exceed file size\n");
-    return;
-  }
+  fp = NULL;
 
-  
-  uint32_t start_block_index = 0;
-  uint32_t temp_start_byte = start_byte;
-  uint32_t req_bytes_temp = req_num_bytes;
-  uint32_t num_blocks_to_read = 1;
+  init();
 
-  // Find out how many blocks we need to read
-  while(req_bytes_temp > (uint32_t)BLOCK_SIZE)
-  {
-    num_blocks_to_read++;
-    req_bytes_temp -= BLOCK_SIZE;
-  }
-  
-  
-  // Find out the first index of our block array within inode
-  // we should start looking at
-  // We are also able to then record the byte we should start
-  // reading at within the start block
-  while(temp_start_byte > (uint32_t)BLOCK_SIZE)
+  // --trace <file> records every command run by the rest of the command line
+  if(argc > 2 && !strcmp(argv[1], "--trace"))
   {
-    start_block_index++;
-    temp_start_byte -= (uint32_t)BLOCK_SIZE;
+    trace_file = fopen(argv[2], "a");
+    if(trace_file == NULL)
+    {
+      fprintf(stderr, "mfs: can not open trace %s\n", argv[2]);
+      return 1;
+    }
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
   }
-       
-
-  int32_t remaining_bytes = req_num_bytes;
-  int32_t data_block_location = inodes[file_inode].blocks[start_block_index];
-  int32_t curr_block_index = start_block_index;
 
-  while(remaining_bytes != 0)
+  if(argc == 3 && !strcmp(argv[1], "--replay"))
   {
-    if(temp_start_byte == 1023)
+    if(trace_file != NULL || replayStart(argv[2]) == -1)
     {
-      temp_start_byte = 0;
-      data_block_location = inodes[file_inode].blocks[curr_block_index];
+      return 1;
     }
-
-    printf("%x", data[data_block_location][temp_start_byte]);
-
-    temp_start_byte++;
-    remaining_bytes--;
   }
-  printf("\n");
-
-  return;
-}
-
-void encrypt(char* filename, char* key)
-{
-    if(filename == NULL)
+  else if(argc > 1)
+  {
+    if(argc == 4 && !strcmp(argv[1], "--serve"))
     {
-        printf("ERROR: Filename not specified.\n");
-        return;
+      openfs(argv[3], 0);
+      return image_open ? serve(argv[2]) : 1;
     }
 
-    FILE *readFile;
-    FILE *writeFile;
- 
-    readFile = fopen(filename, "r");
-    writeFile = fopen(filename, "r+");
-    char c;
-
-    if(!readFile || !writeFile)
+    if(argc == 6 && !strcmp(argv[1], "--cache") && !strcmp(argv[3], "--serve"))
     {
-        printf("ERROR: File does not exist.\n");
-        return;
+      openfs(argv[5], atoi(argv[2]));
+      return image_open ? serve(argv[4]) : 1;
     }
 
-    do
+    // mfs [--cache <blocks> | --shared] <image> <command> [arguments] runs one command on the
+    // image
+    int first = 1;
+    int shared = !strcmp(argv[1], "--shared");
+    if(!strcmp(argv[1], "--cache") && argc > 3)
     {
-        c = fgetc(readFile);
-        if(feof(readFile))
-        {
-            break;
-        }
-        c = c ^ *key;
-        fputc(c, writeFile);
-    } 
-    while(1);
-    
-    fclose(readFile);
-    fclose(writeFile);
-}
-
-void attrib(char* attribute, char* filename)
-{
-    int change_attrib_index = -1;
-    for(int i = 0; i < NUM_FILES; i++)
+      first = 3;
+    }
+    else if(shared)
     {
-        if(strcmp(filename, directory[i].filename) == 0)
-        {
-            change_attrib_index = i;
-            break;
-        }
+      first = 2;
     }
 
-    if(change_attrib_index == -1)
+    if(argc - first < 2 || argv[first][0] == '-')
     {
-        printf("ERROR: File not found.\n");
-        return;
+      fprintf(stderr, "usage: %s [--trace <file>] [--cache <blocks>]"
+                      " [--serve <socket> <image>]\n"
+                      "       %s [--trace <file>] [--cache <blocks> | --shared] <image>"
+                      " <command> [arguments]\n"
+                      "       %s --replay <file>\n",
+              argv[0], argv[0], argv[0]);
+      return 1;
     }
 
-    uint32_t inode_index = directory[change_attrib_index].inode;
-
-    // +h, -h, +r, -r
-    if(strcmp(attribute, "+h") == 0)
+    // The implicit open and save are traced like the commands they stand for
+    char * open_args[] = { "open", "-c", argv[2], argv[first], NULL };
+    commandBegin(first == 3 ? open_args : shared ? (char*[]) { "open", "-s", argv[first], NULL }
+                                                 : (char*[]) { "open", argv[first], NULL });
+    if(shared)
     {
-        inodes[inode_index].attribute |= HIDDEN;
-        return;
+      openShared(argv[first]);
     }
-    if(strcmp(attribute, "+r") == 0)
+    else
     {
-        inodes[inode_index].attribute |= READ_ONLY;
-        return;
+      openfs(argv[first], first == 3 ? atoi(argv[2]) : 0);
     }
-    if(strcmp(attribute, "-h") == 0)
+    commandEnd();
+    if(!image_open)
     {
-        inodes[inode_index].attribute &= HIDDEN_MASK;
-        return;
+      return 1;
     }
-    if(strcmp(attribute, "-r") == 0)
+
+    one_shot = &argv[first + 1];
+    if(oneShotWritesStdout(one_shot))
     {
-        inodes[inode_index].attribute &= READ_MASK;
-        return;
+      fflush(stdout);
+      stdout_fd = dup(STDOUT_FILENO);
+      dup2(STDERR_FILENO, STDOUT_FILENO);
     }
+  }
 
-    printf("ERROR: Incorrent attribute.\n");
-
-
-
-}
-
-int main()
-{
-
-  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
+  while( 1 )
+  {
+    sharedEnd();
+    commandEnd();
 
-  fp = NULL;
+    if(replay.in != NULL)
+    {
+      if(!replayNext(command_string))
+      {
+        replayFinish();
+        return 0;
+      }
+    }
+    else if(one_shot != NULL)
+    {
+      // The one command has run: keep its changes if it succeeded and report how it went
+      if(one_shot_done)
+      {
+        if(image_open && last_status == MFS_OK && oneShotChanges(one_shot))
+        {
+          commandBegin((char*[]) { "savefs", NULL });
+          savefs();
+          commandEnd();
+        }
+        saveWait(NULL);
+        fflush(stdout);
+        return last_status == MFS_OK ? 0 : 1;
+      }
 
-  init();
+      command_string[0] = '\0';
+      for(int i = 0; one_shot[i] != NULL; i++)
+      {
+        strncat(command_string, one_shot[i], MAX_COMMAND_SIZE - strlen(command_string) - 2);
+        strcat(command_string, " ");
+      }
+      one_shot_done = 1;
+    }
+    else
+    {
+      savePoll();
 
-  while( 1 )
-  {
-    // Print out the msh prompt
-    printf ("mfs> ");
+      // Print out the msh prompt
+      printf ("mfs> ");
 
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while( !fgets (command_string, MAX_COMMAND_SIZE, stdin) );
+      // Read the command from the commandline.  The
+      // maximum command that will be read is MAX_COMMAND_SIZE
+      // This while command will wait here until the user
+      // inputs something since fgets returns NULL when there
+      // is no input
+      while( !fgets (command_string, MAX_COMMAND_SIZE, stdin) );
+    }
 
     /* Parse input */
     char *token[MAX_NUM_ARGUMENTS];
@@ -843,11 +9951,31 @@ int main()
         token_count++;
     }
 
+    // Arguments past the last token would be dropped without a word, so refuse the command
+    int dropped = argument_ptr != NULL && *argument_ptr != '\0';
+    while(!dropped && working_string != NULL)
+    {
+      dropped = *strsep(&working_string, WHITESPACE) != '\0';
+    }
+    if(dropped)
+    {
+      printf("ERROR: Too many arguments, at most %d are allowed\n", MAX_NUM_ARGUMENTS - 1);
+      last_status = MFS_ERR_BAD_REQUEST;
+      continue;
+    }
+
+    commandBegin(token);
+    if(sharedBegin(token) == -1)
+    {
+      continue;
+    }
+
     if(strcmp("createfs", token[0]) == 0)
     {
         if(token[1] == NULL)
         {
             printf("ERROR: No filename specified.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue;
         }
 
@@ -856,7 +9984,34 @@ int main()
 
     if(strcmp("savefs", token[0]) == 0)
     {
-        savefs();
+        // savefs -z saves compressed from now on and -u uncompressed, before any other option
+        int arg = 1;
+        if(token[arg] != NULL && (!strcmp(token[arg], "-z") || !strcmp(token[arg], "-u")))
+        {
+            if(saveFormat(token[arg][1] == 'z') == -1)
+            {
+                continue;
+            }
+            arg++;
+        }
+
+        // savefs --bg saves in a child process; --status and --wait follow up on it
+        if(token[arg] != NULL && !strcmp(token[arg], "--bg"))
+        {
+            saveBackground();
+        }
+        else if(token[arg] != NULL && !strcmp(token[arg], "--status"))
+        {
+            saveStatus();
+        }
+        else if(token[arg] != NULL && !strcmp(token[arg], "--wait"))
+        {
+            saveWait(NULL);
+        }
+        else
+        {
+            savefs();
+        }
     }
 
     if(strcmp("open", token[0]) == 0)
@@ -864,9 +10019,36 @@ int main()
         if(token[1] == NULL)
         {
             printf("ERROR: No filename specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue; 
         }
-        openfs(token[1]);
+
+        // open -s <image> shares the image with other processes
+        if(!strcmp(token[1], "-s"))
+        {
+            if(token[2] == NULL)
+            {
+                printf("ERROR: No filename specified\n");
+                last_status = MFS_ERR_BAD_REQUEST;
+                continue;
+            }
+            openShared(token[2]);
+            continue;
+        }
+
+        // open -c <blocks> <image> reads data blocks through a block cache
+        if(!strcmp(token[1], "-c"))
+        {
+            if(token[2] == NULL || token[3] == NULL || atoi(token[2]) <= 0)
+            {
+                printf("ERROR: open -c needs a cache size in blocks and a filename\n");
+                last_status = MFS_ERR_BAD_REQUEST;
+                continue;
+            }
+            openfs(token[3], atoi(token[2]));
+            continue;
+        }
+        openfs(token[1], 0);
     }
 
     if(strcmp("close", token[0]) == 0)
@@ -874,11 +10056,62 @@ int main()
         closefs();
     }
 
+    if(strcmp("clone", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printf("ERROR: clone needs a source and a new filename\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        clonecmd(token[1], token[2]);
+    }
+
+    if(strcmp("images", token[0]) == 0)
+    {
+        imageList();
+    }
+
+    if(strcmp("use", token[0]) == 0)
+    {
+        if(token[1] == NULL)
+        {
+            printf("ERROR: No filename specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        useImage(token[1]);
+    }
+
+    if(strcmp("copy", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printf("ERROR: copy needs a filename and the image to copy it to\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        copyfile(token[1], token[2], token[3]);
+    }
+
     if(strcmp("list", token[0]) == 0)
     {
         if(!image_open)
         {
             printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue;
         }
 
@@ -890,9 +10123,19 @@ int main()
         if(!image_open)
         {
             printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue;
         }
-        printf("%d bytes free\n", df());
+        uint64_t reserved = reservedBytes();
+        if(reserved)
+        {
+            printf("%d bytes free, %llu more reserved by fallocate\n", df(),
+                   (unsigned long long) reserved);
+        }
+        else
+        {
+            printf("%d bytes free\n", df());
+        }
     }
 
     if(strcmp("insert", token[0]) == 0)
@@ -900,28 +10143,82 @@ int main()
         if(!image_open)
         {
             printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue;
         }
         if(token[1] == NULL)
         {
             printf("ERROR: No filename specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue; 
         }
 
+        if(!strcmp(token[1], "-"))
+        {
+            insertStdin(token[2]);
+            continue;
+        }
+        if(!strcmp(token[1], "--reserve"))
+        {
+            if(token[2] == NULL || token[3] == NULL)
+            {
+                printf("ERROR: insert --reserve needs a size and a filename\n");
+                last_status = MFS_ERR_BAD_REQUEST;
+                continue;
+            }
+            insertReserve(token[2], token[3]);
+            continue;
+        }
         insert(token[1]);
     }
 
+    if(!strcmp("fallocate", token[0]))
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not open\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printf("ERROR: fallocate needs a filename and a size\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        fallocatecmd(token[1], token[2]);
+    }
+
+    if(!strcmp("cat", token[0]))
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not open\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL)
+        {
+            printf("ERROR: No filename specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        cat(token[1]);
+    }
+
     if(!strcmp("retrieve", token[0]))
     {
       if(!image_open)
       {
         printf("ERROR: Disk image is not open");
+        last_status = MFS_ERR_BAD_REQUEST;
         continue;
       }
 
       if(token[1] == NULL)
       {
         printf("ERROR: No filename specified\n");
+        last_status = MFS_ERR_BAD_REQUEST;
         continue;
       }
 
@@ -933,6 +10230,7 @@ int main()
       if(!image_open)
       {
         printf("ERROR: Disk image is not open\n");
+        last_status = MFS_ERR_BAD_REQUEST;
         continue;
       }
 
@@ -944,12 +10242,14 @@ int main()
         if(token[1] == NULL)
         {
             printf("ERROR: No filename specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue; 
         }
 
         if(token[2] == NULL)
         {
             printf("ERROR: No key specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue; 
         }
 
@@ -961,47 +10261,278 @@ int main()
         if(token[1] == NULL)
         {
             printf("ERROR: No filename specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue; 
         }
 
         if(token[2] == NULL)
         {
             printf("ERROR: No key specified\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue; 
         }
 
         encrypt(token[1], token[2]);
     }
 
+    if(!strcmp("write", token[0]) || !strcmp("append", token[0]) ||
+       !strcmp("truncate", token[0]))
+    {
+      if(!image_open)
+      {
+        printf("ERROR: Disk image is not open\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        continue;
+      }
+
+      if(token[1] == NULL || token[2] == NULL || (!strcmp("write", token[0]) && token[3] == NULL))
+      {
+        printf("ERROR: Missing arguments\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        continue;
+      }
+
+      if(!strcmp("write", token[0]))
+      {
+        writefile(token[1], token[2], token[3]);
+      }
+      else if(!strcmp("append", token[0]))
+      {
+        appendfile(token[1], token[2]);
+      }
+      else
+      {
+        truncatecmd(token[1], token[2]);
+      }
+    }
+
     if(strcmp("delete", token[0]) == 0)
     {
+      if(!image_open)
+      {
+        printf("ERROR: Disk image is not open\n");
+        last_status = MFS_ERR_BAD_REQUEST;
+        continue;
+      }
       delete(token[1]);
     }
     
     if (strcmp("undel", token[0]) == 0)
     {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
         undel(token[1]);
     }
 
     // attrib +h filename.txt
     if(strcmp("attrib", token[0]) == 0)
     {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
         if(token[1] == NULL)
         {
             printf("ERROR: No attribute listed.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue;
         }
         if(token[2] == NULL)
         {
             printf("ERROR: No filename listed.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
             continue;
         }
 
         attrib(token[1], token[2]);
     }
 
+    if(strcmp("cache", token[0]) == 0)
+    {
+        cachestat();
+    }
+
+    if(strcmp("import", token[0]) == 0 || strcmp("export", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL)
+        {
+            printf("ERROR: %s needs an archive name or -.\n", token[0]);
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        tarCommand(token[0][0] == 'i', token[1]);
+    }
+
+    if(strcmp("snapshot", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        snapshot(token);
+    }
+
+    if(strcmp("rollback", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL)
+        {
+            printf("ERROR: rollback needs a snapshot name.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+
+        int32_t status = snapshotRollback(token[1]);
+        if(status != MFS_OK)
+        {
+            printf("ERROR: %s.\n", mfs_strerror(status));
+            last_status = status;
+        }
+    }
+
+    if(strcmp("defrag", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        defrag(token[1]);
+    }
+
+    if(strcmp("layout", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        layout(token[1]);
+    }
+
+    if(strcmp("fsck", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] != NULL && strcmp(token[1], "-r"))
+        {
+            printf("ERROR: Incorrect parameter %s.\n", token[1]);
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        fsck(0, token[1] != NULL);
+    }
+
+    if(strcmp("grep", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        grep(token);
+    }
+
+    if(strcmp("sum", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        sum(token);
+    }
+
+    if(strcmp("scrub", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        scrub();
+    }
+
+    if(strcmp("syncfs", token[0]) == 0 || strcmp("signature", token[0]) == 0 ||
+       strcmp("apply", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL)
+        {
+            printf("ERROR: %s needs a file name%s.\n", token[0],
+                   token[0][1] == 'y' ? "" : " or -");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[0][1] == 'y')
+        {
+            syncImage(token[1]);
+        }
+        else if(token[0][1] == 'i')
+        {
+            signature(token[1]);
+        }
+        else
+        {
+            apply(token[1]);
+        }
+    }
+
+    if(strcmp("delta", token[0]) == 0)
+    {
+        if(!image_open)
+        {
+            printf("ERROR: Disk image is not opened.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        if(token[1] == NULL || token[2] == NULL)
+        {
+            printf("ERROR: delta needs a signature and an output file, or -.\n");
+            last_status = MFS_ERR_BAD_REQUEST;
+            continue;
+        }
+        delta(token[1], token[2]);
+    }
+
     if(strcmp("quit", token[0]) == 0)
     {
+        sharedEnd();
+        saveWait(NULL);
+        commandEnd();
         exit(0);
     }
 
@@ -0,0 +1,45 @@
+#!/bin/sh
+# An image opened with a block cache far smaller than its files must save and reopen intact,
+# with the blocks evicted before savefs included.
+# Run from the top of the tree with "make test".
+
+set -e
+
+mfs=$(pwd)/mfs
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+head -c 300000 /dev/urandom > big
+head -c 5000 /dev/urandom > small
+head -c 700 /dev/urandom > patch
+
+printf 'createfs test.img\ninsert small\nsavefs\nquit\n' | timeout 60 "$mfs" > /dev/null
+cp test.img before.img
+
+{
+    echo "open -c 64 test.img"
+    echo "insert big"
+    echo "write small 100 patch"
+    echo "cache"
+    echo "close"
+    echo "quit"
+} > commands
+
+timeout 60 "$mfs" < commands > output
+
+# The evicted blocks went to the scratch file, and closing without savefs changed nothing
+grep -q "[1-9][0-9]* set aside until savefs" output
+cmp -s test.img before.img
+
+printf 'open -c 64 test.img\ninsert big\nwrite small 100 patch\nsavefs\nquit\n' |
+    timeout 60 "$mfs" > /dev/null
+
+printf 'open test.img\nfsck\nretrieve big out_big\nretrieve small out_small\nquit\n' |
+    timeout 60 "$mfs" > output
+grep -q "fsck: .* 0 problems" output
+cmp -s big out_big
+{ head -c 100 small; cat patch; tail -c +801 small; } > expected
+cmp -s expected out_small
+
+echo "cache: ok"
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Writing to a clone, or to the file it was cloned from, must leave the other one as it was.
+# Run from the top of the tree with "make test".
+
+set -e
+
+mfs=$(pwd)/mfs
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+head -c 10000 /dev/urandom > orig
+head -c 3000 /dev/urandom > more
+head -c 2000 /dev/urandom > patch
+
+{
+    echo "createfs test.img"
+    echo "insert orig"
+    echo "clone orig copy"
+    echo "write copy 1000 patch"
+    echo "append copy more"
+    echo "clone orig second"
+    echo "write orig 0 patch"
+    echo "delete orig"
+    echo "fsck"
+    echo "retrieve copy out_copy"
+    echo "retrieve second out_second"
+    echo "savefs"
+    echo "quit"
+} > commands
+
+timeout 60 "$mfs" < commands > output
+
+grep -q "fsck: .* 0 problems" output
+cmp -s orig out_second
+
+# copy is orig with patch over bytes 1000 to 2999, followed by more
+{ head -c 1000 orig; cat patch; tail -c +3001 orig; cat more; } > expected
+cmp -s expected out_copy
+
+# The saved image keeps the clones apart too
+printf 'open test.img\nfsck\nretrieve second reopened\nquit\n' | timeout 60 "$mfs" > output
+grep -q "fsck: .* 0 problems" output
+cmp -s orig reopened
+
+echo "clone: ok"
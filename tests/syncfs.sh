@@ -0,0 +1,43 @@
+#!/bin/sh
+# syncfs to a target whose path is longer than the old 64-byte name buffers must update that
+# image, keep its signature cache in a separate .sig file, and pick up later changes.
+# Run from the top of the tree with "make test".
+
+set -e
+
+mfs=$(pwd)/mfs
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+head -c 20000 /dev/urandom > first
+head -c 7000 /dev/urandom > second
+
+long=a_directory_name_long_enough/to_push_the_paths_past_sixty_four_bytes
+mkdir -p "$long"
+target=$long/synced_copy.img
+
+{
+    echo "createfs $long/source.img"
+    echo "insert first"
+    echo "syncfs $target"
+    echo "insert second"
+    echo "syncfs $target"
+    echo "savefs"
+    echo "quit"
+} > commands
+
+timeout 60 "$mfs" < commands > output
+! grep -q "ERROR" output
+
+# The target is still an image the size of the source, and the signature sits beside it
+[ -f "$target.sig" ]
+[ "$(wc -c < "$target")" -eq "$(wc -c < "$long/source.img")" ]
+
+printf 'open %s\nfsck\nretrieve first out1\nretrieve second out2\nquit\n' "$target" |
+    timeout 60 "$mfs" > output
+grep -q "fsck: .* 0 problems" output
+cmp -s first out1
+cmp -s second out2
+
+echo "syncfs: ok"
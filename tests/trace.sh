@@ -0,0 +1,30 @@
+#!/bin/sh
+# A traced command records the status it finished with, and replay finds the same ones.
+# Run from the top of the tree with "make test".
+
+set -e
+
+mfs=$(pwd)/mfs
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+head -c 3000 /dev/urandom > present
+
+printf 'createfs test.img\ninsert missing\ninsert present\ndelete missing\nquit\n' |
+    timeout 60 "$mfs" --trace trace.jsonl > /dev/null
+
+grep -q '"cmd":"insert".*"status":-1,.*"args":\["missing"\]' trace.jsonl
+grep -q '"cmd":"insert".*"status":0,.*"args":\["present"\]' trace.jsonl
+grep -q '"cmd":"delete".*"status":-1,' trace.jsonl
+
+timeout 60 "$mfs" --replay trace.jsonl > report
+grep -q "commands replayed" report
+! grep -q "recorded -\?[0-9]" report
+
+# A one-shot command that fails says so and leaves the image alone
+cp test.img before.img
+! timeout 60 "$mfs" test.img insert missing > /dev/null
+cmp -s test.img before.img
+
+echo "trace: ok"